@@ -0,0 +1,283 @@
+#!/bin/sh
+# Times diskinfo, disklist (one directory, recursive and --du), diskget, diskput and mkimage on generated images
+# of several sizes.
+#
+# Every measurement is printed as one JSON object per line:
+#   {"command":..., "image_bytes":..., "block_size":..., "runs":..., "seconds":..., "ops_per_sec":...,
+#    "mb_per_sec":..., "peak_rss_kb":...}
+# seconds is the mean wall time of one run, mb_per_sec the data moved per second (the FAT for diskinfo,
+# the file for diskget and diskput, the image for mkimage) and peak_rss_kb the largest resident set of any run.
+# The listings of one large directory also carry "entries_per_sec".
+#
+# Settings, from the environment:
+#   BENCH_SIZES       image sizes (default "10M 100M 1G", up to "10G")
+#   BENCH_REPEAT      runs per command (default 3)
+#   BENCH_BLOCK_SIZE  block size of the images (default 4096)
+#   BENCH_FILL        fraction of the data blocks used by files (default 0.5)
+#   BENCH_FRAG        fragmentation of the files (default 0.1)
+#   BENCH_FANOUT      subdirectories per directory (default 4)
+#   BENCH_DEPTH       levels of subdirectories (default 2)
+#   BENCH_SPARSE      1 to leave file data as holes, for quick runs on large sizes (default 0)
+#   BENCH_FULL_SIZE   size of the 90%-full fragmented image of the diskput size sweep (default 1G, 0 to skip)
+#   BENCH_FULL_PUTS   file sizes of that sweep (default "1M 4M 16M 64M")
+#   BENCH_LIST_ENTRIES  files in the directory of the listing benchmark (default 100000, 0 to skip)
+#   BENCH_DIR_ENTRIES   files put into one directory, grown from a single block (default 100000, 0 to skip)
+#   BENCH_FROM_FILES  small files in the host tree packed by mkimage --from (default 100000, 0 to skip)
+#   BENCH_DURABLE_FILES  4 KB files put in one batch with and without --durable (default 2000, 0 to skip)
+#   BENCH_HUGE_SIZE   size of the sparse image of the large-image checks (default 50G, 0 to skip)
+#   BENCH_IO_SIZE     image size of the I/O backend comparison (default 256M, 0 to skip)
+#   BENCH_IO_DEPTH    io_uring queue depth of that comparison (default 16)
+#   BENCH_DIR         scratch directory for the images (default bench/work)
+
+set -e
+cd "$(dirname "$0")/.."
+
+SIZES=${BENCH_SIZES:-"10M 100M 1G"}
+REPEAT=${BENCH_REPEAT:-3}
+BLOCK_SIZE=${BENCH_BLOCK_SIZE:-4096}
+FILL=${BENCH_FILL:-0.5}
+FRAG=${BENCH_FRAG:-0.1}
+FANOUT=${BENCH_FANOUT:-4}
+DEPTH=${BENCH_DEPTH:-2}
+FULL_SIZE=${BENCH_FULL_SIZE:-1G}
+FULL_PUTS=${BENCH_FULL_PUTS:-"1M 4M 16M 64M"}
+LIST_ENTRIES=${BENCH_LIST_ENTRIES:-100000}
+DIR_ENTRIES=${BENCH_DIR_ENTRIES:-100000}
+FROM_FILES=${BENCH_FROM_FILES:-100000}
+DURABLE_FILES=${BENCH_DURABLE_FILES:-2000}
+HUGE_SIZE=${BENCH_HUGE_SIZE:-50G}
+IO_SIZE=${BENCH_IO_SIZE:-256M}
+IO_DEPTH=${BENCH_IO_DEPTH:-16}
+DIR=${BENCH_DIR:-bench/work}
+SPARSE=
+if [ "${BENCH_SPARSE:-0}" = 1 ]; then
+    SPARSE=-p
+fi
+
+mkdir -p "$DIR"
+IMG="$DIR/bench.img"
+
+# report <command> <image_bytes> <runs> <total_seconds> <bytes_per_run> <peak_rss_kb>
+# ENTRIES, when set, is the number of directory entries handled per run
+report() {
+    awk -v c="$1" -v size="$2" -v bs="$BLOCK_SIZE" -v runs="$3" -v total="$4" -v bytes="$5" -v rss="$6" -v entries="${ENTRIES:-0}" 'BEGIN {
+        mean = total / runs
+        ops = mean > 0 ? 1 / mean : 0
+        mbs = mean > 0 ? bytes / 1048576 / mean : 0
+        printf "{\"command\":\"%s\",\"image_bytes\":%.0f,\"block_size\":%d,\"runs\":%d,\"seconds\":%.6f,\"ops_per_sec\":%.2f,\"mb_per_sec\":%.2f,\"peak_rss_kb\":%d",
+            c, size, bs, runs, mean, ops, mbs, rss
+        if (entries + 0 > 0) {
+            printf ",\"entries\":%d,\"entries_per_sec\":%.0f", entries, (mean > 0 ? entries / mean : 0)
+        }
+        printf "}\n"
+    }'
+}
+
+# measure <label> <image_bytes> <bytes_per_run> <command> [<args>...], runs the command BENCH_REPEAT times
+# PREPARE, when set, is a shell command run before every run, outside of the timing
+measure() {
+    label=$1; size=$2; bytes=$3
+    shift 3
+    total=0; peak=0; run=0
+    while [ $run -lt "$REPEAT" ]; do
+        if [ -n "$PREPARE" ]; then sh -c "$PREPARE"; fi
+        set -- $(bench/runstat "$@") "$@"
+        if [ "$3" != 0 ]; then
+            echo "bench: $label failed" >&2
+            exit 1
+        fi
+        total=$(awk -v a="$total" -v b="$1" 'BEGIN { printf "%.6f", a + b }')
+        if [ "$2" -gt "$peak" ]; then peak=$2; fi
+        shift 3
+        run=$((run + 1))
+    done
+    report "$label" "$size" "$REPEAT" "$total" "$bytes" "$peak"
+}
+
+# measure_put <label> <image_bytes> <bytes_per_run> [<env>...], puts $DIR/put.in under a new name every run
+measure_put() {
+    label=$1; size=$2; bytes=$3
+    shift 3
+    total=0; peak=0; run=0
+    while [ $run -lt "$REPEAT" ]; do
+        set -- $(bench/runstat env "$@" ./diskput "$IMG" "$DIR/put.in" "/$label$run") "$@"
+        if [ "$3" != 0 ]; then
+            echo "bench: $label failed" >&2
+            exit 1
+        fi
+        total=$(awk -v a="$total" -v b="$1" 'BEGIN { printf "%.6f", a + b }')
+        if [ "$2" -gt "$peak" ]; then peak=$2; fi
+        shift 3
+        run=$((run + 1))
+    done
+    report "$label" "$size" "$REPEAT" "$total" "$bytes" "$peak"
+}
+
+for SIZE in $SIZES; do
+    set -- $(bench/runstat ./mkimage "$IMG" -s "$SIZE" -b "$BLOCK_SIZE" -f "$FILL" -F "$FRAG" -d "$FANOUT" -D "$DEPTH" $SPARSE)
+    if [ "$3" != 0 ]; then
+        echo "bench: mkimage $SIZE failed" >&2
+        exit 1
+    fi
+    IMAGE_BYTES=$(wc -c < "$IMG")
+    report mkimage "$IMAGE_BYTES" 1 "$1" "$IMAGE_BYTES" "$2"
+
+    BLOCKS=$((IMAGE_BYTES / BLOCK_SIZE))
+    measure diskinfo "$IMAGE_BYTES" $((BLOCKS * 4)) ./diskinfo "$IMG"
+    measure disklist "$IMAGE_BYTES" 0 ./disklist "$IMG"
+    measure disklist_subdir "$IMAGE_BYTES" 0 ./disklist "$IMG" /d1
+    measure disklist_recursive "$IMAGE_BYTES" 0 ./disklist "$IMG" -R
+    measure disklist_du "$IMAGE_BYTES" 0 ./disklist "$IMG" --du
+
+    # The largest file of the root directory
+    set -- $(./disklist "$IMG" | awk '$1 == "F" { print $2, $3 }' | sort -n | tail -1)
+    if [ $# -eq 2 ]; then
+        measure diskget "$IMAGE_BYTES" "$1" ./diskget "$IMG" "/$2" "$DIR/get.out"
+        rm -f "$DIR/get.out"
+    fi
+
+    # Put a file of 1/50 of the image, at most 64 MB, under a new name every run
+    PUT_BYTES=$((IMAGE_BYTES / 50))
+    if [ $PUT_BYTES -gt 67108864 ]; then PUT_BYTES=67108864; fi
+    head -c "$PUT_BYTES" /dev/urandom > "$DIR/put.in"
+    measure_put diskput "$IMAGE_BYTES" "$PUT_BYTES"
+
+    rm -f "$IMG" "$DIR/put.in"
+done
+
+# Puts of growing size into a sparse image of FULL_SIZE whose 512-byte blocks are 90% used by fragmented files,
+# restored before every run, where finding free runs dominates the cost of a put
+if [ "$FULL_SIZE" != 0 ]; then
+    BLOCK_SIZE=512
+    ./mkimage "$DIR/full.img" -s "$FULL_SIZE" -b 512 -f 0.9 -F 0.5 -d "$FANOUT" -D "$DEPTH" -p > /dev/null
+    IMAGE_BYTES=$(wc -c < "$DIR/full.img")
+    PREPARE="cp --sparse=always $DIR/full.img $IMG"
+    for PUT_SIZE in $FULL_PUTS; do
+        head -c "$PUT_SIZE" /dev/zero | tr '\0' x > "$DIR/put.in"
+        PUT_BYTES=$(wc -c < "$DIR/put.in")
+        measure "diskput_full_$PUT_SIZE" "$IMAGE_BYTES" "$PUT_BYTES" ./diskput "$IMG" "$DIR/put.in" /put.out
+    done
+    PREPARE=
+    rm -f "$IMG" "$DIR/full.img" "$DIR/put.in"
+fi
+
+# One directory with LIST_ENTRIES files, listed in every output format
+if [ "$LIST_ENTRIES" -gt 0 ]; then
+    ./mkimage "$IMG" -b 512 -n $((LIST_ENTRIES * 2 + 16384)) -a 512 -f 0.5 -D 0 -p > /dev/null
+    IMAGE_BYTES=$(wc -c < "$IMG")
+    ENTRIES=$(./disklist "$IMG" | wc -l)
+    BLOCK_SIZE=512
+    measure disklist_large "$IMAGE_BYTES" 0 ./disklist "$IMG"
+    measure disklist_large_json "$IMAGE_BYTES" 0 ./disklist "$IMG" --json
+    measure disklist_large_nul "$IMAGE_BYTES" 0 ./disklist "$IMG" -0
+    measure disklist_large_sort_name "$IMAGE_BYTES" 0 ./disklist "$IMG" --sort name
+    measure disklist_large_sort_mtime "$IMAGE_BYTES" 0 ./disklist "$IMG" --sort mtime
+    ENTRIES=
+    rm -f "$IMG"
+fi
+
+# A root directory of one block grown to DIR_ENTRIES empty files by one batch, then single puts into it
+if [ "$DIR_ENTRIES" -gt 0 ]; then
+    BLOCK_SIZE=512
+    BLOCKS=$((DIR_ENTRIES * 2 + 16384))
+    IMAGE_BYTES=$((BLOCKS * 512))
+    : > "$DIR/put.in"
+    awk -v n="$DIR_ENTRIES" -v src="$DIR/put.in" 'BEGIN { for (i = 0; i < n; i++) printf "%s\t/f%07d\n", src, i }' > "$DIR/manifest"
+    ENTRIES=$DIR_ENTRIES
+    PREPARE="./mkimage $IMG -b 512 -n $BLOCKS -f 0 -D 0 > /dev/null"
+    measure diskput_dir_fill "$IMAGE_BYTES" 0 sh -c "./diskput $IMG --batch < $DIR/manifest"
+    PREPARE=
+    ENTRIES=
+    measure_put diskput_dir_full "$IMAGE_BYTES" 0
+    rm -f "$IMG" "$DIR/put.in" "$DIR/manifest"
+fi
+
+# A host tree of about FROM_FILES small files in 16 directories, extracted from a generated image, packed back
+# into a new image
+if [ "$FROM_FILES" -gt 0 ]; then
+    ./mkimage "$IMG" -b 512 -n $((FROM_FILES * 8)) -a 1024 -f 0.5 -d 16 -D 1 > /dev/null
+    rm -rf "$DIR/from"
+    ./diskget "$IMG" -r / "$DIR/from" > /dev/null
+    TREE_BYTES=$(./disklist "$IMG" --du | awk '$4 == "/" { print $1 }')
+    ENTRIES=$(./disklist "$IMG" -R | wc -l)
+    BLOCK_SIZE=4096
+    PREPARE="rm -f $DIR/from.img"
+    measure mkimage_from "$TREE_BYTES" "$TREE_BYTES" ./mkimage "$DIR/from.img" --from "$DIR/from" -b 4096
+    PREPARE=
+    ENTRIES=
+    rm -rf "$IMG" "$DIR/from" "$DIR/from.img"
+fi
+
+# DURABLE_FILES files of 4 KB put into a fresh image by one batch, as is and with --durable, which adds the
+# journal commit and its two syncs to the single write back of the batch
+if [ "$DURABLE_FILES" -gt 0 ]; then
+    BLOCK_SIZE=4096
+    BLOCKS=$((DURABLE_FILES * 2 + 4096))
+    IMAGE_BYTES=$((BLOCKS * 4096))
+    head -c 4096 /dev/urandom > "$DIR/put.in"
+    awk -v n="$DURABLE_FILES" -v src="$DIR/put.in" 'BEGIN { for (i = 0; i < n; i++) printf "%s\t/f%07d\n", src, i }' > "$DIR/manifest"
+    ENTRIES=$DURABLE_FILES
+    PREPARE="rm -f $IMG.journal; ./mkimage $IMG -b 4096 -n $BLOCKS -f 0 -D 0 > /dev/null"
+    measure diskput_batch "$IMAGE_BYTES" $((DURABLE_FILES * 4096)) sh -c "./diskput $IMG --batch < $DIR/manifest"
+    measure diskput_batch_durable "$IMAGE_BYTES" $((DURABLE_FILES * 4096)) sh -c "./diskput $IMG --durable --batch < $DIR/manifest"
+    PREPARE=
+    ENTRIES=
+    rm -f "$IMG" "$IMG.journal" "$DIR/put.in" "$DIR/manifest"
+fi
+
+# A sparse image of HUGE_SIZE, half full of files that are only holes, so that most blocks lie past 4 GB. A file
+# put into it must come back unchanged, whole and by range, also when the FAT is read in windows (FSIMG_NO_MMAP).
+if [ "$HUGE_SIZE" != 0 ]; then
+    BLOCK_SIZE=4096
+    set -- $(bench/runstat ./mkimage "$IMG" -s "$HUGE_SIZE" -b 4096 -f 0.5 -d "$FANOUT" -D "$DEPTH" -p)
+    if [ "$3" != 0 ]; then
+        echo "bench: mkimage $HUGE_SIZE failed" >&2
+        exit 1
+    fi
+    IMAGE_BYTES=$(wc -c < "$IMG")
+    report mkimage_huge "$IMAGE_BYTES" 1 "$1" 0 "$2"
+    BLOCKS=$((IMAGE_BYTES / 4096))
+    measure diskinfo_huge "$IMAGE_BYTES" $((BLOCKS * 4)) ./diskinfo "$IMG"
+    measure diskinfo_huge_windowed "$IMAGE_BYTES" $((BLOCKS * 4)) env FSIMG_NO_MMAP=1 ./diskinfo "$IMG"
+    measure disklist_huge_recursive "$IMAGE_BYTES" 0 ./disklist "$IMG" -R
+    head -c 67108864 /dev/urandom > "$DIR/put.in"
+    measure_put diskput_huge "$IMAGE_BYTES" 67108864
+    measure diskget_huge "$IMAGE_BYTES" 67108864 ./diskget "$IMG" /diskput_huge0 "$DIR/get.out"
+    cmp -s "$DIR/put.in" "$DIR/get.out" || { echo "bench: diskget_huge returned other data" >&2; exit 1; }
+    measure diskget_huge_windowed "$IMAGE_BYTES" 67108864 env FSIMG_NO_MMAP=1 ./diskget "$IMG" /diskput_huge0 "$DIR/get.out"
+    cmp -s "$DIR/put.in" "$DIR/get.out" || { echo "bench: diskget_huge_windowed returned other data" >&2; exit 1; }
+    measure diskget_huge_range "$IMAGE_BYTES" 4096 ./diskget "$IMG" /diskput_huge0 "$DIR/get.out" --offset 67104768
+    tail -c 4096 "$DIR/put.in" | cmp -s - "$DIR/get.out" || { echo "bench: diskget_huge_range returned other data" >&2; exit 1; }
+    ./diskfsck "$IMG" > /dev/null || { echo "bench: diskfsck found problems in the large image" >&2; exit 1; }
+    rm -f "$IMG" "$DIR/put.in" "$DIR/get.out"
+fi
+
+# diskget of the largest root file and of the whole tree, and diskput, through each I/O backend. Warm runs find
+# the image in the page cache, cold runs drop it first (with dd iflag=nocache, no root needed).
+if [ "$IO_SIZE" != 0 ]; then
+    ./mkimage "$IMG" -s "$IO_SIZE" -b "$BLOCK_SIZE" -f "$FILL" -F "$FRAG" -d "$FANOUT" -D "$DEPTH" > /dev/null
+    IMAGE_BYTES=$(wc -c < "$IMG")
+    TREE_BYTES=$(./disklist "$IMG" --du | awk '$4 == "/" { print $1 }')
+    set -- $(./disklist "$IMG" | awk '$1 == "F" { print $2, $3 }' | sort -n | tail -1)
+    GET_BYTES=$1; GET_FILE=$2
+    PUT_BYTES=$((IMAGE_BYTES / 50))
+    if [ $PUT_BYTES -gt 67108864 ]; then PUT_BYTES=67108864; fi
+    head -c "$PUT_BYTES" /dev/urandom > "$DIR/put.in"
+    sync
+    for IO in psync uring; do
+        for CACHE in warm cold; do
+            PREPARE=
+            if [ $CACHE = cold ]; then
+                PREPARE="dd if=$IMG iflag=nocache count=0 2>/dev/null"
+            fi
+            measure diskget_${IO}_$CACHE "$IMAGE_BYTES" "$GET_BYTES" \
+                env FSIMG_IO=$IO FSIMG_IO_DEPTH="$IO_DEPTH" ./diskget "$IMG" "/$GET_FILE" "$DIR/get.out"
+            rm -rf "$DIR/tree"
+            measure diskget_tree_${IO}_$CACHE "$IMAGE_BYTES" "$TREE_BYTES" \
+                env FSIMG_IO=$IO FSIMG_IO_DEPTH="$IO_DEPTH" ./diskget "$IMG" -r / "$DIR/tree"
+        done
+        PREPARE=
+        measure_put diskput_$IO "$IMAGE_BYTES" "$PUT_BYTES" FSIMG_IO=$IO FSIMG_IO_DEPTH="$IO_DEPTH"
+    done
+    rm -rf "$IMG" "$DIR/get.out" "$DIR/tree" "$DIR/put.in"
+fi
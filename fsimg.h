@@ -0,0 +1,185 @@
+/**
+ * libfsimg: reads and writes CSC360 file system images without going through the command-line tools.
+ *
+ * Every function returns one of the FSIMG_ status codes instead of exiting, and results go into buffers
+ * and structures owned by the caller. An image handle may be shared by threads that only read from it, and a
+ * call only ever reports the I/O errors of its own thread; fsimg_put and fsimg_close need the handle to themselves.
+ */
+#ifndef FSIMG_H
+#define FSIMG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FSIMG_API __attribute__((visibility("default")))
+
+// Status codes, also the status byte of the diskserver replies
+#define FSIMG_OK 0
+#define FSIMG_NOT_FOUND 1           // No such file or directory
+#define FSIMG_NO_SPACE 2            // Not enough free blocks
+#define FSIMG_DIR_FULL 3            // No free slot in the directory
+#define FSIMG_BAD_REQUEST 4
+#define FSIMG_IO_ERROR 5
+#define FSIMG_INVALID_IMAGE 6       // Bad super block or broken chain
+#define FSIMG_READ_ONLY 7           // The image was not opened for writing
+#define FSIMG_BUFFER_TOO_SMALL 8
+#define FSIMG_END 9                 // No more directory entries
+#define FSIMG_BUSY 10               // Another process has the image open with a journal
+
+// Modes of fsimg_open
+#define FSIMG_RDONLY 0
+#define FSIMG_RDWR 1
+#define FSIMG_DURABLE 2             // With FSIMG_RDWR: every put is on disk, crash consistent, when it returns
+
+// Status of a directory entry
+#define FSIMG_FILE 3
+#define FSIMG_DIR 5
+
+typedef struct fs_image fsimg;
+
+typedef struct fsimg_time {
+    uint16_t year;
+    uint8_t month;
+    uint8_t day;
+    uint8_t hour;
+    uint8_t minute;
+    uint8_t second;
+} fsimg_time;
+
+typedef struct fsimg_entry {
+    uint8_t status;             // FSIMG_FILE or FSIMG_DIR
+    uint32_t start_block;
+    uint32_t block_count;
+    uint32_t size;
+    fsimg_time create_time;
+    fsimg_time modify_time;
+    char name[32];              // Always NUL-terminated
+} fsimg_entry;
+
+typedef struct fsimg_info {
+    uint16_t block_size;
+    uint32_t block_count;
+    uint32_t fat_start_block;
+    uint32_t fat_block_count;
+    uint32_t root_dir_start_block;
+    uint32_t root_dir_block_count;
+    uint32_t free_blocks;
+    uint32_t reserved_blocks;
+    uint32_t allocated_blocks;
+} fsimg_info;
+
+// Directory iterator, lives wherever the caller puts it and allocates nothing
+typedef struct fsimg_dir {
+    fsimg *img;
+    uint32_t next_block;        // Next directory block to load
+    uint32_t blocks_left;
+    uint32_t index;             // Next entry of the loaded block
+    uint32_t entry_count;       // Entries in the loaded block, 0 before the first one
+    const void *entries;        // Loaded block, in the image mapping or in buffer
+    void *buffer;               // Caller's block buffer, used when the image is not mapped
+} fsimg_dir;
+
+/**
+ * Opens an image and loads its super block and FAT.
+ *
+ * A journal left next to the image ("<path>.journal") by a crash during a durable put is replayed first by a writable
+ * open; a read-only open never writes the image. A durable handle keeps its journal locked until it is closed.
+ * With FSIMG_DURABLE every flush of metadata is committed to that journal before it is written in place, after
+ * the file data has been synced.
+ *
+ * @param path The path of the image file.
+ * @param mode FSIMG_RDONLY, FSIMG_RDWR or FSIMG_RDWR | FSIMG_DURABLE.
+ * @param img Set to the new handle.
+ * @return FSIMG_OK, FSIMG_NOT_FOUND, FSIMG_BUSY (a writable open while another process holds the journal),
+ * FSIMG_IO_ERROR or FSIMG_INVALID_IMAGE.
+ */
+FSIMG_API int fsimg_open(const char *path, int mode, fsimg **img);
+
+/**
+ * Writes back any pending metadata and releases a handle.
+ *
+ * @return FSIMG_OK or FSIMG_IO_ERROR. The handle is released either way.
+ */
+FSIMG_API int fsimg_close(fsimg *img);
+
+/**
+ * Fills in the super block fields and the FAT counts of an image.
+ */
+FSIMG_API int fsimg_get_info(fsimg *img, fsimg_info *info);
+
+/**
+ * Looks up a file or directory. The path "" (or "/") is the root directory.
+ */
+FSIMG_API int fsimg_stat(fsimg *img, const char *path, fsimg_entry *entry);
+
+/**
+ * Starts iterating over a directory.
+ *
+ * @param img The image.
+ * @param path The path of the directory, "" for the root directory.
+ * @param dir The iterator to initialize.
+ * @param buffer A buffer of at least one block, only used when the image cannot be mapped. May be NULL otherwise.
+ * @param buffer_size The size of buffer.
+ * @return FSIMG_OK, FSIMG_NOT_FOUND or FSIMG_BUFFER_TOO_SMALL.
+ */
+FSIMG_API int fsimg_opendir(fsimg *img, const char *path, fsimg_dir *dir, void *buffer, size_t buffer_size);
+
+/**
+ * Decodes the next used entry of a directory into entry.
+ *
+ * @return FSIMG_OK, FSIMG_END after the last entry, or FSIMG_IO_ERROR.
+ */
+FSIMG_API int fsimg_readdir(fsimg_dir *dir, fsimg_entry *entry);
+
+/**
+ * Reads up to length bytes of a file starting at offset.
+ *
+ * @param img The image.
+ * @param file The entry of the file, from fsimg_stat or fsimg_readdir.
+ * @param offset The offset in the file.
+ * @param buffer The buffer to read into.
+ * @param length The size of buffer.
+ * @param bytes_read Set to the number of bytes read, less than length only at the end of the file.
+ * @return FSIMG_OK, FSIMG_INVALID_IMAGE if the chain is broken, or FSIMG_IO_ERROR.
+ */
+FSIMG_API int fsimg_read(fsimg *img, const fsimg_entry *file, uint64_t offset, void *buffer, size_t length, size_t *bytes_read);
+
+/**
+ * Writes a whole file to a descriptor (a file, a pipe or a socket), at its current position.
+ */
+FSIMG_API int fsimg_get(fsimg *img, const char *path, int dest_fd);
+
+/**
+ * Writes length bytes of a file starting at offset to a descriptor, at its current position.
+ *
+ * The range is cut at the end of the file, and a range past the end writes nothing. Reads that do not start at
+ * the beginning of a file (here and in fsimg_read) find their first block through an extent index of the file's
+ * chain, cached in the handle, so only the first of them walks the chain.
+ *
+ * @return FSIMG_OK, FSIMG_NOT_FOUND, FSIMG_INVALID_IMAGE if the chain is broken, or FSIMG_IO_ERROR.
+ */
+FSIMG_API int fsimg_get_range(fsimg *img, const char *path, uint64_t offset, uint64_t length, int dest_fd);
+
+/**
+ * Creates a file from size bytes read from a descriptor and writes its metadata back.
+ *
+ * @return FSIMG_OK, FSIMG_READ_ONLY, FSIMG_NOT_FOUND if the directory does not exist, FSIMG_DIR_FULL,
+ *         FSIMG_NO_SPACE, or FSIMG_IO_ERROR if the descriptor ended early or the image could not be written.
+ *         Nothing has been read from src_fd unless the status is FSIMG_OK or FSIMG_IO_ERROR.
+ */
+FSIMG_API int fsimg_put(fsimg *img, const char *path, int src_fd, uint32_t size);
+
+/**
+ * Returns a short description of a status code.
+ */
+FSIMG_API const char *fsimg_strerror(int status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
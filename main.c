@@ -1,11 +1,42 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64    // Images past 4 GB on 32-bit builds too
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <arpa/inet.h>
 #include <stdbool.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <endian.h>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "fsimg.h"
+
+_Static_assert(sizeof(off_t) == 8, "image offsets need a 64-bit off_t");
 
 typedef struct __attribute__((__packed__)) super_block{
     uint8_t fs_id[8];
@@ -37,6 +68,482 @@ typedef struct __attribute__((__packed__)) dir_entry_t {
     uint8_t unused[6];
 } dir_entry_t;
 
+#define MAX_IO_SIZE (8 * 1024 * 1024)   // Largest single read or write of file data
+#define DIR_GROW_MAX_BLOCKS 64         // Most blocks added to a full directory at a time
+#define STREAM_BUFFERS 3                // Chunks of a streamed put: one being read while the others are written
+
+// Ways of copying image data to a host file, from fastest to most portable
+#define COPY_FILE_RANGE 0
+#define COPY_SENDFILE 1
+#define COPY_READ_WRITE 2
+
+#define IO_PSYNC 0              // One blocking request at a time: copy_file_range, sendfile, pread and pwrite
+#define IO_URING 1              // io_uring, with up to depth chunks in flight
+#define IO_CHUNK_SIZE (1 << 20) // Largest single io_uring read or write
+#define IO_DEFAULT_DEPTH 16
+#define IO_MAX_DEPTH 256
+#define IO_BATCH_FILES 64       // Files of a put batch copied together
+
+#define CENSUS_THREAD_MIN_BLOCKS (1u << 22)    // Images with fewer blocks are counted on one thread
+#define CENSUS_MAX_THREADS 16
+#define FAT_WINDOW_ENTRIES 65536    // FAT entries per window of an unmapped read-only image, 256 KB
+#define FAT_WINDOWS 16              // Windows cached per image
+#define JOURNAL_MAGIC "FSIMGJNL"
+#define JOURNAL_VERSION 1
+#define JOURNAL_SUFFIX ".journal"
+
+#define OUT_BUFFER_SIZE (1 << 20)
+
+#define LIST_HUMAN 0
+#define LIST_JSON 1
+#define LIST_NUL 2              // Tab-separated fields, one NUL-terminated record per entry
+
+#define LIST_UNSORTED 0
+#define LIST_BY_NAME 1
+#define LIST_BY_SIZE 2
+#define LIST_BY_MTIME 3
+
+#define TREE_CHUNK_NODES 4096     // Directory nodes per allocation of a tree walk
+#define TREE_MAX_THREADS 16
+
+#define SERVER_LIST 1
+#define SERVER_STAT 2
+#define SERVER_GET 3
+#define SERVER_PUT 4
+#define SERVER_GET_RANGE 5
+#define SERVER_MAX_PATH 4096
+#define SERVER_TIMEOUT_SECONDS 30   // A connection that sends nothing for this long is closed
+
+// Phases timed by --stats
+#define PHASE_OPEN 0            // Opening and mapping the image
+#define PHASE_SUPER_BLOCK 1
+#define PHASE_FAT_LOAD 2        // Loading the FAT and building the free-space bitmap
+#define PHASE_LOOKUP 3          // Resolving paths
+#define PHASE_SCAN 4            // Listing directories, walking trees and counting the FAT
+#define PHASE_DATA_COPY 5
+#define PHASE_FLUSH 6           // Writing back the FAT and the directory entries
+#define PHASE_COUNT 7
+
+#define FSCK_CHAIN_OK 0
+#define FSCK_OUT_OF_RANGE 1         // A link points outside the image
+#define FSCK_FREE_BLOCK 2           // A link points to a free block
+#define FSCK_RESERVED_BLOCK 3       // A link points to a reserved block
+#define FSCK_CYCLE 4                // The chain loops back on itself
+#define FSCK_CROSS_LINK 5           // The chain runs into a block of another chain
+#define FSCK_JOB_ENTRIES 256        // Entries handed to a checker thread at a time
+#define FSCK_MAX_THREADS 16
+
+typedef struct extent {
+    uint32_t start;
+    uint32_t length;
+} extent;
+
+typedef struct io_segment {
+    int src_fd;
+    int dest_fd;
+    off_t src_offset;
+    off_t dest_offset;
+    size_t length;
+    uint32_t tag;               // Caller's index of what the segment belongs to
+} io_segment;
+
+#define CHAIN_CACHE_SIZE 64         // Chain indexes kept per image, by first block
+
+typedef struct chain_index {
+    uint32_t start_block;       // First block of the chain
+    uint32_t max_blocks;        // Blocks the chain was followed for, the file's block count
+    uint64_t fat_generation;    // Value of the image's FAT generation when the index was built
+    extent *extents;            // Runs of the chain in file order, NULL for an empty slot
+    uint32_t *first_blocks;     // File block at which every extent starts
+    uint32_t extent_count;
+} chain_index;
+
+typedef struct io_slot {
+    const io_segment *segment;  // Chunk being copied through the buffer of the slot
+    size_t offset;              // Offset of the chunk in the segment
+    size_t length;
+    size_t done;                // Bytes of the current read or write transferred so far
+    bool writing;
+} io_slot;
+
+typedef struct io_engine {
+    int kind;                   // IO_PSYNC, or IO_URING when a ring could be set up
+    uint32_t depth;             // Chunks in flight at most, one buffer each
+    uint8_t *buffers;           // depth buffers of IO_CHUNK_SIZE bytes
+    io_slot *slots;
+    uint32_t *free_slots;
+    bool fixed;                 // The buffers are registered with the ring
+    int ring_fd;
+    uint8_t *sq_ring;
+    size_t sq_ring_size;
+    uint8_t *cq_ring;
+    size_t cq_ring_size;
+    void *sqes;
+    size_t sqes_size;
+    uint32_t *sq_tail;
+    uint32_t *sq_mask;
+    uint32_t *sq_array;
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t *cq_mask;
+    void *cqes;
+    uint32_t to_submit;         // Entries queued since the last io_uring_enter
+    const io_segment *failed;   // Segment of the first failed request
+    bool failed_write;
+} io_engine;
+
+typedef struct free_run {
+    uint32_t prefix;        // Free blocks at the start of the range
+    uint32_t suffix;        // Free blocks at the end of the range
+    uint32_t longest;       // Longest free run inside the range
+} free_run;
+
+typedef struct free_map {
+    uint64_t *words;        // One bit per block, set when the block is free
+    uint32_t word_count;
+    uint32_t block_count;
+    uint32_t free_count;
+    uint32_t hint;          // No word below this one has a free block
+    uint32_t leaf_count;    // Words covered by the run tree, a power of two
+    free_run *runs;         // Run tree: node 1 covers every word, node n has children 2n and 2n + 1, leaves are words
+} free_map;
+
+typedef struct fat_window {
+    uint32_t first;             // First block covered
+    uint32_t *entries;          // FAT entries in on-disk order, NULL before the window is first loaded
+} fat_window;
+
+typedef struct fat_census {
+    uint32_t free_blocks;
+    uint32_t reserved_blocks;
+    uint32_t allocated_blocks;
+    uint32_t chains;            // Chain terminators (0xFFFFFFFF), one per chain
+    uint32_t jumps;             // Links to a block other than the following one
+    uint32_t largest_free_run;
+    uint32_t leading_free_run;  // Free run at the start of the counted range
+    uint32_t free_run;          // Free run ending at the current position
+    uint32_t length;
+    bool seen_used;
+} fat_census;
+
+typedef struct dentry {
+    char *path;                 // Normalized path of the directory, without leading or trailing '/'
+    uint32_t hash;
+    uint32_t start_block;
+    uint32_t block_count;
+    struct dentry *next;
+} dentry;
+
+typedef struct dentry_cache {
+    dentry **buckets;
+    uint32_t bucket_count;
+    uint32_t entry_count;
+    uint64_t hits;
+    uint64_t misses;
+} dentry_cache;
+
+typedef struct pending_entry {
+    off_t offset;
+    uint64_t sequence;          // Order of the update, the latest one of an offset wins
+    dir_entry_t entry;          // In on-disk byte order
+} pending_entry;
+
+// Start of the journal of a durable image, in big-endian order like the image
+typedef struct journal_header {
+    char magic[8];              // JOURNAL_MAGIC
+    uint32_t version;
+    uint32_t segment_count;
+    uint64_t payload_bytes;     // Bytes of records after the header
+    uint64_t checksum;          // journal_checksum of the records
+} journal_header;
+
+// One write of a transaction, followed by its data padded to 8 bytes
+typedef struct journal_record {
+    uint64_t offset;            // Offset of the write in the image
+    uint32_t length;
+    uint32_t reserved;
+} journal_record;
+
+typedef struct meta_segment {
+    off_t offset;
+    const void *data;
+    size_t length;
+} meta_segment;
+
+typedef struct fs_image {
+    char *path;
+    int fd;
+    bool writable;
+    bool fail_fast;     // Exit on I/O errors (the tools) instead of recording them in image_error (the library)
+    super_block sb;
+    uint8_t *map;       // Read-only mapping of the whole image, NULL when reads fall back to pread
+    size_t map_size;
+    uint32_t *fat;      // FAT in on-disk (big-endian) order, NULL when it is read in windows
+    bool fat_owned;     // The FAT was copied to the heap instead of pointing into a mapping
+    uint8_t *fat_map;   // Private copy-on-write mapping of the FAT of a writable image
+    size_t fat_map_size;
+    fat_window *fat_windows;    // Windows of the FAT of a read-only image that could not be mapped
+    pthread_mutex_t fat_lock;
+    free_map *free;     // Free-space index of a writable image
+    dentry_cache *dcache;   // Resolved directory paths
+    pthread_mutex_t dcache_lock;
+    uint8_t *fat_dirty;     // One bit per FAT block changed since the last flush
+    pending_entry *pending; // Directory entry updates not written yet
+    uint32_t pending_count;
+    uint32_t pending_capacity;
+    uint64_t pending_sequence;
+    uint64_t meta_bytes_written;
+    uint64_t meta_write_calls;
+    bool root_dirty;                // root_dir_start_block or root_dir_block_count changed since the last flush
+    struct slot_cursor *cursors;    // Free-slot cursors of the directories written to, kept until the image is closed
+    uint32_t cursor_count;
+    uint64_t fat_generation;        // Bumped by every FAT change, so that cached chain indexes can tell they are stale
+    chain_index *chain_cache;       // Indexes of the chains read by range, allocated on the first range read
+    pthread_mutex_t chain_lock;
+    int journal_fd;                 // Journal of a durable image (see journal_open), -1 otherwise
+    bool journal_dirty;             // A transaction was committed since the journal was last emptied
+} fs_image;
+
+typedef struct dir_iter {
+    fs_image *img;
+    uint32_t next_block;        // Next directory block to load
+    uint32_t blocks_left;
+    uint32_t block;             // Directory block currently loaded
+    off_t offset;               // Offset of the current block in the image
+    const dir_entry_t *entries; // Entries of the current block, in the mapping or in buffer
+    uint32_t entry_count;
+    dir_entry_t *buffer;
+} dir_iter;
+
+typedef struct export_job {
+    dir_entry_t entry;          // Decoded entry of the file to extract
+    char *host_path;
+} export_job;
+
+typedef struct export_job_list {
+    export_job *jobs;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t next;              // Next job to hand out, shared by the workers
+} export_job_list;
+
+typedef struct export_worker_state {
+    fs_image *img;
+    export_job_list *job_list;
+    uint32_t files;
+    uint64_t bytes;
+    double seconds;
+} export_worker_state;
+
+typedef struct mkimage_options {
+    uint16_t block_size;
+    uint32_t block_count;
+    double fill;                // Fraction of the free data blocks taken by files
+    double fragmentation;       // Chance that the next block of a file is taken at random instead of next in line
+    uint32_t fan_out;           // Subdirectories per directory
+    uint32_t depth;             // Levels of subdirectories below the root
+    uint32_t file_size;         // Average file size in bytes
+    bool sparse;                // Leave file data as holes instead of writing it
+    uint64_t seed;
+} mkimage_options;
+
+typedef struct source_node {
+    char *path;                 // Path on the host
+    uint32_t parent;
+    uint32_t first_child;       // Children of a directory are contiguous, in name order
+    uint32_t child_count;
+    uint8_t status;             // 3 for a file, 5 for a directory
+    uint32_t size;
+    uint32_t start_block;
+    uint32_t block_count;
+    time_t mtime;
+    char name[31];
+} source_node;
+
+typedef struct source_tree {
+    source_node *nodes;         // Breadth first, the top directory first
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t files;
+    uint32_t directories;
+} source_tree;
+
+typedef struct slot_cursor {
+    uint32_t dir_start_block;   // Directory the cursor walks
+    char *path;                 // Normalized path of the directory, "" for the root directory
+    dir_iter it;
+    uint32_t index;             // Next entry to look at in the loaded block
+    bool loaded;
+    uint32_t last_block;        // Last block walked so far, where the directory grows from
+    uint32_t block_count;       // Blocks of the directory, including the ones it grew by
+    off_t entry_offset;         // Where the directory's own entry is, 0 until the directory first grows
+    dir_entry_t entry;          // That entry as last staged, in on-disk byte order
+    off_t *returned;            // Slots given back by puts that failed, handed out again first
+    uint32_t returned_count;
+    uint32_t returned_capacity;
+} slot_cursor;
+
+typedef struct out_buffer {
+    int fd;
+    char *data;
+    size_t length;
+    size_t capacity;
+    pthread_mutex_t *lock;      // Taken by the first flush when several buffers share fd, kept until out_release
+    bool held;
+    bool *started;              // Shared by the buffers of one JSON array, set once an element is out
+} out_buffer;
+
+typedef struct tree_node {
+    char *path;                 // Path of the directory in the image, starting with '/'
+    uint32_t parent;            // Node of the parent directory, the top of the tree is its own parent
+    uint32_t start_block;
+    uint32_t block_count;
+    uint32_t files;             // Files directly in the directory
+    uint64_t bytes;
+    uint64_t blocks;            // Blocks of those files and of the directory itself as walked
+    uint32_t total_files;       // The same, with every subdirectory added in
+    uint64_t total_bytes;
+    uint64_t total_blocks;
+} tree_node;
+
+typedef struct tree_deque {
+    pthread_mutex_t lock;
+    uint32_t *items;            // Nodes waiting to be walked
+    uint32_t head;              // Oldest item, taken by thieves
+    uint32_t tail;              // One past the newest item, taken by the owner
+    uint32_t capacity;
+} tree_deque;
+
+typedef struct tree_walk {
+    fs_image *img;
+    tree_node **chunks;         // Nodes, TREE_CHUNK_NODES per chunk, allocated on first use
+    uint32_t node_count;
+    uint8_t *visited;           // One bit per block, set for the first block of every directory claimed
+    tree_deque *deques;         // One per worker
+    uint32_t worker_count;
+    uint32_t pending;           // Directories queued or being walked
+    uint32_t queued;            // Directories waiting in the deques
+    uint32_t idle;              // Workers asleep on work_cond
+    pthread_mutex_t idle_lock;
+    pthread_cond_t work_cond;   // Signalled when a directory is queued and broadcast when the walk is over
+    int format;
+    int sort;
+    bool du;
+    pthread_mutex_t out_lock;
+    bool out_started;
+} tree_walk;
+
+typedef struct tree_worker {
+    tree_walk *walk;
+    uint32_t id;
+    out_buffer out;
+    dir_entry_t *entries;       // Entries of the directory being walked, reused from one directory to the next
+    uint32_t capacity;
+} tree_worker;
+
+typedef struct server_state {
+    fs_image *img;
+    pthread_rwlock_t lock;      // Shared by list, stat and get, held alone by put
+    bool durable;               // Puts are acknowledged once a group commit covers them
+    pthread_mutex_t commit_lock;
+    pthread_cond_t committed_cond;
+    uint64_t staged;            // Puts staged so far, numbered from 1
+    uint64_t committed;         // Puts covered by the last group commit
+    bool committing;            // A connection thread is running a group commit
+    int commit_status;          // Status of the last group commit
+} server_state;
+
+typedef struct server_connection {
+    server_state *server;
+    int fd;
+} server_connection;
+
+typedef struct put_request {
+    char *src_path;
+    char *dest_path;
+    uint32_t size;
+    uint32_t block_count;
+    off_t entry_address;
+    uint32_t cursor;            // Free-slot cursor of the image the slot came from
+    dir_entry_t entry;          // New directory entry, in on-disk byte order
+    extent *extents;
+    uint32_t extent_count;
+    bool stream;                // The size is not known up front, the source is read to its end
+} put_request;
+
+typedef struct stream_reader {
+    int fd;
+    uint8_t *buffers[STREAM_BUFFERS];
+    size_t lengths[STREAM_BUFFERS];
+    size_t chunk_size;          // Whole blocks, only the last chunk is shorter
+    uint32_t head;              // Oldest chunk not yet written out
+    uint32_t filled;            // Chunks read and not yet written out
+    bool done;                  // The reader stopped, at the end of the source or on an error
+    bool failed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} stream_reader;
+
+typedef struct fsck_entry {
+    char *path;
+    off_t offset;               // Offset of the directory entry in the image, -1 for the root directory
+    dir_entry_t entry;          // Decoded entry
+    uint32_t blocks;            // Blocks of the chain before the first broken link
+    uint32_t last_block;        // Last of those blocks, 0xFFFFFFFF if there are none
+    uint32_t bad_block;         // Block the broken link points to
+    uint32_t owner;             // Entry holding bad_block when the chain is cross-linked
+    uint32_t owner_blocks;      // Blocks of the owner's chain before bad_block
+    uint32_t owner_last_block;  // Last of those blocks, 0xFFFFFFFF if there are none
+    bool unresolved;            // Shares blocks with a chain and neither can be told to own them, left as is
+    uint32_t first_child;       // Entries of a directory, added one after the other
+    uint32_t child_count;
+    uint8_t chain;              // FSCK_CHAIN_OK or what broke the chain
+} fsck_entry;
+
+typedef struct fsck_state {
+    fs_image *img;
+    uint64_t *claimed;          // One bit per block, set by the first chain that walks it
+    fsck_entry *entries;        // The root directory first, then every entry in the order directories are walked
+    uint32_t entry_count;
+    uint32_t capacity;
+    uint32_t next;              // Next entry to hand out, shared by the checker threads
+} fsck_state;
+
+typedef struct io_stats {
+    bool enabled;               // Nothing below is counted unless set
+    bool json;
+    uint64_t start_ns;
+    uint64_t syscalls;          // System calls that read, write, seek, open or map files
+    uint64_t bytes_read;        // Read by system calls, from the image or a host file
+    uint64_t bytes_written;
+    uint64_t mapped_bytes;      // Read from the image mapping, without a system call
+    uint64_t seeks;             // Image accesses that do not start where the previous one ended
+    uint64_t next_offset;       // Where the previous image access ended
+    uint64_t fat_entries;       // FAT entries read or set one at a time, or scanned by a census
+    uint64_t dir_slots;         // Directory entries loaded by directory walks
+    uint64_t cache_hits;        // Path cache lookups
+    uint64_t cache_misses;
+    uint64_t index_hits;        // Chain index lookups of range reads
+    uint64_t index_misses;
+    uint64_t phase_ns[PHASE_COUNT];
+    uint64_t phase_calls[PHASE_COUNT];
+} io_stats;
+
+typedef struct defrag_state {
+    fs_image *img;
+    const uint64_t *used;       // One bit per block in a chain, by original position
+    uint32_t *where;            // Current position of the data of every block, by original position
+    uint32_t *occupant;         // Original position of the data at every position
+    uint32_t *displaced;        // Scratch list of the occupants moved out of the way by one move
+    uint8_t *buffer;
+    uint32_t max_run;           // Blocks moved by one move at most
+    bool dry_run;
+    uint64_t blocks_moved;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t io_calls;
+} defrag_state;
+
 /**
  * Allocates memory of the given size using malloc and performs error handling.
  * 
@@ -52,560 +559,7446 @@ void *emalloc(size_t size) {
     return ptr;
 }
 
+// Counters of the running tool, shared by all its threads
+io_stats stats;
+
+// First I/O error since the library call running on this thread started, so that readers sharing a handle never
+// see or clear each other's errors
+__thread int image_error;
+
+/**
+ * Returns the time of the monotonic clock in nanoseconds.
+ */
+uint64_t monotonic_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Adds n to a counter of the statistics when they are enabled. Costs one predictable branch otherwise.
+ */
+static inline void stats_add(uint64_t *counter, uint64_t n){
+    if (__builtin_expect(stats.enabled, 0)) {
+        __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Counts one system call and the bytes it moved, when it moved any.
+ */
+static inline void stats_syscall(uint64_t *bytes, ssize_t n){
+    if (__builtin_expect(stats.enabled, 0)) {
+        __atomic_fetch_add(&stats.syscalls, 1, __ATOMIC_RELAXED);
+        if (bytes != NULL && n > 0) {
+            __atomic_fetch_add(bytes, (uint64_t)n, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * Counts an access of len bytes at offset off of the image as a seek unless it starts where the previous one ended.
+ */
+static inline void stats_seek(off_t off, size_t len){
+    if (__builtin_expect(stats.enabled, 0)) {
+        uint64_t previous = __atomic_exchange_n(&stats.next_offset, (uint64_t)off + len, __ATOMIC_RELAXED);
+        if (previous != (uint64_t)off) {
+            __atomic_fetch_add(&stats.seeks, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
 /**
- * Reads the super block from a file and performs necessary byte order conversions.
+ * Starts timing a phase.
  * 
- * @param filename The name of the file to read the super block from.
- * @return super_block* A pointer to the super block structure.
+ * @return The start time to hand to stats_phase, 0 when the statistics are disabled.
  */
-super_block* get_superblock(char *filename){
-    FILE *file = fopen(filename, "rb");
-    if (file == NULL) {
-        fprintf(stderr, "Error: Unable to open file %s\n", filename);
-        exit(1);
+static inline uint64_t stats_clock(void){
+    return __builtin_expect(stats.enabled, 0) ? monotonic_ns() : 0;
+}
+
+/**
+ * Adds the time since start to a phase. Phases timed on several threads add up their times.
+ */
+void stats_phase(int phase, uint64_t start){
+    if (__builtin_expect(stats.enabled, 0)) {
+        __atomic_fetch_add(&stats.phase_ns[phase], monotonic_ns() - start, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats.phase_calls[phase], 1, __ATOMIC_RELAXED);
     }
-    super_block *sb = (super_block *)emalloc(sizeof(super_block));
-    fread(sb, sizeof(super_block), 1, file);
-    sb->block_size = htons(sb->block_size);
-    sb->file_system_block_count = htonl(sb->file_system_block_count);
-    sb->fat_start_block = htonl(sb->fat_start_block);
-    sb->fat_block_count = htonl(sb->fat_block_count);
-    sb->root_dir_start_block = htonl(sb->root_dir_start_block);
-    sb->root_dir_block_count = htonl(sb->root_dir_block_count);
+}
 
-    fclose(file);
-    return sb;
+/**
+ * Prints the statistics of the run to standard error, as a table or as one JSON object.
+ * Registered with atexit, so the tools report even when they exit on an error.
+ */
+void stats_report(void){
+    static const char *phase_names[PHASE_COUNT] = {
+        "open", "super_block", "fat_load", "lookup", "scan", "data_copy", "metadata_flush"
+    };
+    double total = (monotonic_ns() - stats.start_ns) / 1e9;
+    if (stats.json) {
+        fprintf(stderr, "{\"seconds\":%.6f,\"phases\":{", total);
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            fprintf(stderr, "%s\"%s\":{\"seconds\":%.6f,\"calls\":%llu}", p > 0 ? "," : "", phase_names[p],
+                    stats.phase_ns[p] / 1e9, (unsigned long long)stats.phase_calls[p]);
+        }
+        fprintf(stderr, "},\"syscalls\":%llu,\"bytes_read\":%llu,\"bytes_written\":%llu,\"mapped_bytes\":%llu,"
+                "\"seeks\":%llu,\"fat_entries\":%llu,\"dir_slots\":%llu,\"cache_hits\":%llu,\"cache_misses\":%llu,"
+                "\"index_hits\":%llu,\"index_misses\":%llu}\n",
+                (unsigned long long)stats.syscalls, (unsigned long long)stats.bytes_read,
+                (unsigned long long)stats.bytes_written, (unsigned long long)stats.mapped_bytes,
+                (unsigned long long)stats.seeks, (unsigned long long)stats.fat_entries,
+                (unsigned long long)stats.dir_slots, (unsigned long long)stats.cache_hits,
+                (unsigned long long)stats.cache_misses, (unsigned long long)stats.index_hits,
+                (unsigned long long)stats.index_misses);
+        return;
+    }
+    fprintf(stderr, "%-16s %12s %10s\n", "Phase", "Seconds", "Calls");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        fprintf(stderr, "%-16s %12.6f %10llu\n", phase_names[p], stats.phase_ns[p] / 1e9,
+                (unsigned long long)stats.phase_calls[p]);
+    }
+    fprintf(stderr, "%-16s %12.6f\n", "total", total);
+    fprintf(stderr, "System calls: %llu\n", (unsigned long long)stats.syscalls);
+    fprintf(stderr, "Bytes read: %llu, %llu more through the mapping\n", (unsigned long long)stats.bytes_read,
+            (unsigned long long)stats.mapped_bytes);
+    fprintf(stderr, "Bytes written: %llu\n", (unsigned long long)stats.bytes_written);
+    fprintf(stderr, "Seeks: %llu\n", (unsigned long long)stats.seeks);
+    fprintf(stderr, "FAT entries touched: %llu\n", (unsigned long long)stats.fat_entries);
+    fprintf(stderr, "Directory slots scanned: %llu\n", (unsigned long long)stats.dir_slots);
+    fprintf(stderr, "Path cache: %llu hits, %llu misses\n", (unsigned long long)stats.cache_hits,
+            (unsigned long long)stats.cache_misses);
+    fprintf(stderr, "Chain index: %llu hits, %llu misses\n", (unsigned long long)stats.index_hits,
+            (unsigned long long)stats.index_misses);
 }
 
 /**
- * This function searches for a directory within a file system image.
+ * Turns the statistics on when asked to, and takes the option out of the arguments.
  * 
- * @param filename The name of the file system image.
- * @param dir_path The path of the directory to find.
+ * @param argc The number of arguments, decreased when the option is removed.
+ * @param argv The arguments.
  * 
- * The function first opens the file system image and reads the superblock.
- * It then reads the FAT (File Allocation Table) into memory.
- * The function then tokenizes the directory path and searches for each directory in the path sequentially.
- * If a directory is found, it updates the current block and blocks count to the found directory's start block and block count.
- * If a directory is not found, it returns NULL.
+ * "--stats" prints a table and "--stats=json" a JSON object when the tool exits. Without the option, the
+ * environment variable FSIMG_STATS does the same: "json" for JSON, any other value but "0" for the table.
+ */
+void stats_option(int *argc, char *argv[]){
+    const char *env = getenv("FSIMG_STATS");
+    if (env != NULL && env[0] != '\0' && strcmp(env, "0") != 0) {
+        stats.enabled = true;
+        stats.json = strcmp(env, "json") == 0;
+    }
+    for (int i = 1; i < *argc; i++) {
+        if (strcmp(argv[i], "--stats") != 0 && strcmp(argv[i], "--stats=json") != 0) {
+            continue;
+        }
+        stats.enabled = true;
+        stats.json = strcmp(argv[i], "--stats=json") == 0;
+        memmove(&argv[i], &argv[i + 1], (*argc - i) * sizeof(char *));
+        (*argc)--;
+        i--;
+    }
+    if (stats.enabled) {
+        stats.start_ns = monotonic_ns();
+        atexit(stats_report);
+    }
+}
+
+/**
+ * Tells whether a tool should make its writes durable, and takes the option out of the arguments.
  * 
- * @return A pointer to the directory entry if found, NULL otherwise.
+ * @param argc The number of arguments, decreased when the option is removed.
+ * @param argv The arguments.
+ * 
+ * "--durable" anywhere on the command line, or the environment variable FSIMG_DURABLE set to anything but "0".
  */
-dir_entry_t *find_directory(char *filename, char *dir_path){
-    super_block sb = *get_superblock(filename);
-    
-    FILE *file = fopen(filename, "rb");
-    if (file == NULL) {
-        fprintf(stderr, "Error: Unable to open file %s\n", filename);
+bool durable_option(int *argc, char *argv[]){
+    const char *env = getenv("FSIMG_DURABLE");
+    bool durable = env != NULL && env[0] != '\0' && strcmp(env, "0") != 0;
+    for (int i = 1; i < *argc; i++) {
+        if (strcmp(argv[i], "--durable") != 0) {
+            continue;
+        }
+        durable = true;
+        memmove(&argv[i], &argv[i + 1], (*argc - i) * sizeof(char *));
+        (*argc)--;
+        i--;
+    }
+    return durable;
+}
+
+/**
+ * Returns the byte offset of a block within the file system image.
+ * 
+ * @param img The opened file system image.
+ * @param block The block index.
+ * @return off_t The offset of the first byte of the block.
+ */
+off_t block_offset(fs_image *img, uint32_t block){
+    return (off_t)block * img->sb.block_size;
+}
+
+/**
+ * Reports a failed read or write of the image.
+ * 
+ * @param img The opened file system image.
+ * @param what "read" or "write".
+ * 
+ * The tools print an error message and exit the program. The library records FSIMG_IO_ERROR in image_error, for
+ * the calling thread only, and carries on, the public call returns it once the operation unwinds.
+ */
+void image_failed(fs_image *img, const char *what){
+    if (img->fail_fast) {
+        fprintf(stderr, "Error: Unable to %s file %s\n", what, img->path);
         exit(1);
     }
-    uint32_t current_block = sb.root_dir_start_block;
-    uint32_t blocks_count = sb.root_dir_block_count;
-    bool found_dir = false;
-    char *part = strtok(dir_path, "/");
-    dir_entry_t *entry = (dir_entry_t*)emalloc(sizeof(dir_entry_t));
+    if (image_error == FSIMG_OK) {
+        image_error = FSIMG_IO_ERROR;
+    }
+}
 
-    fseek(file, sb.fat_start_block * sb.block_size, SEEK_SET);
-    uint32_t *fat = (uint32_t *)emalloc(sb.fat_block_count * sb.block_size);
-    fread(fat, sb.fat_block_count * sb.block_size, 1, file);
-    
-    int count = 0;
-    while (part != NULL){
-        found_dir = false;
-        count = 0;
-        while (count < blocks_count) {
-            fseek(file, current_block * sb.block_size, SEEK_SET);
-            for (int i = 0; i < sb.block_size / sizeof(dir_entry_t); i++) {
-                fread(entry, sizeof(dir_entry_t), 1, file);
-                if (entry->status == 5 && strcmp((char *)entry->filename, part) == 0) {
-                    entry->start_block = htonl(entry->start_block);
-                    entry->block_count = htonl(entry->block_count);
-                    entry->size = htonl(entry->size);
-                    entry->create_time.year = htons(entry->create_time.year);
-                    entry->modify_time.year = htons(entry->modify_time.year);
-                    found_dir = true;
-                    current_block = entry->start_block;
-                    blocks_count = entry->block_count;
-                    break;
-                }
-            }
-            if (found_dir){
-                break;
-            }
-            count++;
-            current_block = ntohl(fat[current_block]);
-            }
-            if (!found_dir){
-                return NULL;
-            }
-            part = strtok(NULL, "/");
+/**
+ * Reads len bytes at offset off of the file system image into buf.
+ * 
+ * @param img The opened file system image.
+ * @param buf The buffer to read into.
+ * @param len The number of bytes to read.
+ * @param off The offset in the image to start reading from.
+ * 
+ * The bytes are copied out of the image mapping when there is one, otherwise they are read with pread.
+ * Bytes past the end of the image, or that could not be read, are returned as zeros.
+ */
+void read_image(fs_image *img, void *buf, size_t len, off_t off){
+    stats_seek(off, len);
+    if (img->map != NULL && off >= 0 && (uint64_t)off + len <= img->map_size) {
+        memcpy(buf, img->map + off, len);
+        stats_add(&stats.mapped_bytes, len);
+        return;
+    }
+    uint8_t *dst = (uint8_t *)buf;
+    while (len > 0) {
+        ssize_t n = pread(img->fd, dst, len, off);
+        stats_syscall(&stats.bytes_read, n);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            memset(dst, 0, len);
+            image_failed(img, "read");
+            return;
+        }
+        if (n == 0) {
+            memset(dst, 0, len);
+            return;
+        }
+        dst += n;
+        len -= n;
+        off += n;
     }
+}
 
-    return entry;
+/**
+ * Writes len bytes from buf at offset off of the file system image.
+ * 
+ * @param img The opened file system image, opened for writing.
+ * @param buf The buffer to write from.
+ * @param len The number of bytes to write.
+ * @param off The offset in the image to start writing at.
+ * 
+ * Writes go through pwrite, the shared mapping sees them through the page cache.
+ */
+void write_image(fs_image *img, const void *buf, size_t len, off_t off){
+    stats_seek(off, len);
+    const uint8_t *src = (const uint8_t *)buf;
+    while (len > 0) {
+        ssize_t n = pwrite(img->fd, src, len, off);
+        stats_syscall(&stats.bytes_written, n);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            image_failed(img, "write");
+            return;
+        }
+        src += n;
+        len -= n;
+        off += n;
+    }
 }
 
 /**
- * This function searches for a file within a file system image.
+ * Returns the FAT value of a block of an image whose FAT is read in windows, loading its window if needed.
  * 
- * @param filename The name of the file system image.
- * @param file_path The path of the file to find.
+ * @param img The opened file system image, read-only and not mapped.
+ * @param block The block index.
  * 
- * It searches for a file withing a given file path 
- * If the file is found, it creates a file entry object to return it.
- * If the file is not found, it returns NULL.
+ * Windows are cached by window number modulo FAT_WINDOWS, so following a chain through nearby blocks reads
+ * every window once. The windows are shared by all the threads reading the image.
  * 
- * @return A pointer to the file entry if found, NULL otherwise.
+ * @return uint32_t The FAT value for the block, in host byte order.
  */
-dir_entry_t *find_file(char *filename, char *file_path){
-    super_block sb = *get_superblock(filename);
-    char *file_name;
-    char *dir_path;
-    if (strncmp(file_path, "./", 2) == 0) {
-        file_path += 2;
-    } else if (strncmp(file_path, "/", 1) == 0){
-        file_path += 1;
+uint32_t fat_window_next(fs_image *img, uint32_t block){
+    uint32_t first = block - block % FAT_WINDOW_ENTRIES;
+    pthread_mutex_lock(&img->fat_lock);
+    fat_window *window = &img->fat_windows[(block / FAT_WINDOW_ENTRIES) % FAT_WINDOWS];
+    if (window->entries == NULL || window->first != first) {
+        if (window->entries == NULL) {
+            window->entries = (uint32_t *)emalloc(FAT_WINDOW_ENTRIES * sizeof(uint32_t));
+        }
+        uint32_t count = img->sb.file_system_block_count - first;
+        if (count > FAT_WINDOW_ENTRIES) {
+            count = FAT_WINDOW_ENTRIES;
+        }
+        read_image(img, window->entries, (size_t)count * sizeof(uint32_t),
+                   block_offset(img, img->sb.fat_start_block) + (off_t)first * sizeof(uint32_t));
+        window->first = first;
     }
-    char *last_l = strrchr(file_path, '/');
+    uint32_t value = ntohl(window->entries[block - first]);
+    pthread_mutex_unlock(&img->fat_lock);
+    return value;
+}
 
-    uint32_t current_block;
-    uint32_t blocks_count;
-    if (last_l != NULL){
-        file_name = last_l + 1;
-        size_t dir_path_length = last_l - file_path;
-        dir_path = (char *)malloc(dir_path_length + 1);
-        strncpy(dir_path, file_path, dir_path_length);
-        dir_path[dir_path_length] = '\0';
-        dir_entry_t *dir = find_directory(filename, dir_path);
-        if (dir == NULL){
-            return NULL;
+/**
+ * Returns the next block of a chain as stored in the FAT, in host byte order.
+ * 
+ * @param img The opened file system image.
+ * @param block The block index to look up.
+ * @return uint32_t The FAT value for the block.
+ */
+uint32_t fat_next(fs_image *img, uint32_t block){
+    stats_add(&stats.fat_entries, 1);
+    if (__builtin_expect(img->fat == NULL, 0)) {
+        return fat_window_next(img, block);
+    }
+    return ntohl(img->fat[block]);
+}
+
+/**
+ * Summarizes the free runs of one word of the bitmap.
+ * 
+ * @param bits The word, bit i set when block i of the word is free.
+ * 
+ * @return free_run The free blocks at both ends of the word and its longest free run.
+ */
+free_run word_free_run(uint64_t bits){
+    free_run run;
+    if (bits == ~0ULL) {
+        run.prefix = run.suffix = run.longest = 64;
+        return run;
+    }
+    run.prefix = __builtin_ctzll(~bits);
+    run.suffix = __builtin_clzll(~bits);
+    run.longest = 0;
+    uint32_t b = 0;
+    while (b < 64) {
+        uint64_t rest = bits >> b;
+        if (rest == 0) {
+            break;
         }
-        current_block = dir->start_block;
-        blocks_count = dir->block_count;
-        free(dir_path);
-    }else{
-        file_name = file_path;
-        current_block = sb.root_dir_start_block;
-        blocks_count = sb.root_dir_block_count;
+        b += __builtin_ctzll(rest);
+        uint32_t n = __builtin_ctzll(~(bits >> b));
+        if (n > run.longest) {
+            run.longest = n;
+        }
+        b += n;
+    }
+    return run;
+}
+
+/**
+ * Recomputes a node of the run tree from its two children.
+ * 
+ * @param fm The free-space bitmap.
+ * @param node The node to recompute.
+ * @param span The number of blocks covered by each child.
+ */
+void free_run_merge(free_map *fm, uint32_t node, uint64_t span){
+    free_run *left = &fm->runs[2 * node];
+    free_run *right = &fm->runs[2 * node + 1];
+    free_run *run = &fm->runs[node];
+    run->prefix = left->prefix == span ? left->prefix + right->prefix : left->prefix;
+    run->suffix = right->suffix == span ? right->suffix + left->suffix : right->suffix;
+    run->longest = left->suffix + right->prefix;
+    if (left->longest > run->longest) {
+        run->longest = left->longest;
+    }
+    if (right->longest > run->longest) {
+        run->longest = right->longest;
+    }
+}
+
+/**
+ * Brings the run tree up to date after the words first_word to last_word of the bitmap changed.
+ * 
+ * @param fm The free-space bitmap.
+ * @param first_word The first word that changed.
+ * @param last_word The last word that changed.
+ * 
+ * Each level only recomputes the nodes above the changed words, so a change of n words costs O(n + log blocks).
+ */
+void free_map_refresh(free_map *fm, uint32_t first_word, uint32_t last_word){
+    for (uint32_t w = first_word; w <= last_word; w++) {
+        fm->runs[fm->leaf_count + w] = word_free_run(fm->words[w]);
+    }
+    uint32_t low = fm->leaf_count + first_word;
+    uint32_t high = fm->leaf_count + last_word;
+    uint64_t span = 64;
+    while (low > 1) {
+        low /= 2;
+        high /= 2;
+        for (uint32_t node = low; node <= high; node++) {
+            free_run_merge(fm, node, span);
+        }
+        span *= 2;
+    }
+}
+
+/**
+ * Builds the free-space bitmap of an image from its FAT.
+ * 
+ * @param img The opened file system image.
+ * 
+ * The FAT is scanned once. Every later lookup works on the bitmap, 64 blocks at a time, and on a tree over its
+ * words that keeps the free blocks at both ends and the longest free run of every range of words, so that the
+ * first free run of a given length is found in O(log blocks) however fragmented the free space is.
+ * 
+ * @return free_map* A pointer to the free-space bitmap.
+ */
+free_map *build_free_map(fs_image *img){
+    free_map *fm = (free_map *)emalloc(sizeof(free_map));
+    fm->block_count = img->sb.file_system_block_count;
+    fm->word_count = (fm->block_count + 63) / 64;
+    fm->words = (uint64_t *)emalloc((size_t)fm->word_count * sizeof(uint64_t));
+    memset(fm->words, 0, (size_t)fm->word_count * sizeof(uint64_t));
+    fm->free_count = 0;
+    fm->hint = 0;
+    stats_add(&stats.fat_entries, fm->block_count);
+    for (uint32_t i = 0; i < fm->block_count; i++) {
+        if (img->fat[i] == 0) {
+            fm->words[i / 64] |= 1ULL << (i % 64);
+            fm->free_count++;
+        }
+    }
+    fm->leaf_count = 1;
+    while (fm->leaf_count < fm->word_count) {
+        fm->leaf_count *= 2;
+    }
+    fm->runs = (free_run *)calloc(2 * (size_t)fm->leaf_count, sizeof(free_run));
+    if (fm->runs == NULL) {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+    if (fm->word_count > 0) {
+        free_map_refresh(fm, 0, fm->word_count - 1);
+    }
+    return fm;
+}
+
+/**
+ * Returns the lowest free block of the bitmap without taking it.
+ * 
+ * @param fm The free-space bitmap.
+ * 
+ * The search starts at the hint, which only moves forward while blocks are taken,
+ * so taking N blocks one after another costs O(N + blocks / 64) in total.
+ * 
+ * @return The index of the free block, or 0xFFFFFFFF if the image is full.
+ */
+uint32_t free_map_next(free_map *fm){
+    for (uint32_t w = fm->hint; w < fm->word_count; w++) {
+        if (fm->words[w] != 0) {
+            fm->hint = w;
+            return w * 64 + __builtin_ctzll(fm->words[w]);
+        }
+    }
+    fm->hint = fm->word_count;
+    return 0xFFFFFFFF;
+}
+
+/**
+ * Finds the first run of at least run_length contiguous free blocks.
+ * 
+ * @param fm The free-space bitmap.
+ * @param run_length The number of blocks needed.
+ * @param start Set to the first block of the run when one is found.
+ * 
+ * The run tree is walked down from the root, going left whenever the left half holds a long enough run and
+ * stopping where a run crosses from one half into the other, so the lookup costs O(log blocks) and a request
+ * that no free run can satisfy is refused at the root.
+ * 
+ * @return true if a run was found, false otherwise.
+ */
+bool free_map_find_run(free_map *fm, uint32_t run_length, uint32_t *start){
+    if (run_length == 0) {
+        run_length = 1;
+    }
+    if (fm->word_count == 0 || fm->runs[1].longest < run_length) {
+        return false;
+    }
+    uint32_t node = 1;
+    uint64_t first = 0;
+    uint64_t span = (uint64_t)fm->leaf_count * 64;
+    while (node < fm->leaf_count) {
+        span /= 2;
+        free_run *left = &fm->runs[2 * node];
+        free_run *right = &fm->runs[2 * node + 1];
+        if (left->longest >= run_length) {
+            node = 2 * node;
+        }else if (left->suffix + right->prefix >= run_length) {
+            *start = (uint32_t)(first + span - left->suffix);
+            return true;
+        }else{
+            node = 2 * node + 1;
+            first += span;
+        }
+    }
+    // The run lies inside this word
+    uint64_t bits = fm->words[node - fm->leaf_count];
+    uint32_t b = 0;
+    while (true) {
+        b += __builtin_ctzll(bits >> b);
+        uint64_t rest = bits >> b;
+        uint32_t n = rest == ~0ULL ? 64 : __builtin_ctzll(~rest);
+        if (n >= run_length) {
+            *start = (uint32_t)first + b;
+            return true;
+        }
+        b += n;
+    }
+}
+
+/**
+ * Counts the free blocks of the bitmap that directly follow a block.
+ * 
+ * @param fm The free-space bitmap.
+ * @param start The first block to look at.
+ * @param max_length The most blocks to count.
+ * 
+ * @return The length of the free run starting at start, at most max_length.
+ */
+uint32_t free_map_run_length(free_map *fm, uint32_t start, uint32_t max_length){
+    uint32_t length = 0;
+    while (length < max_length && start + length < fm->block_count) {
+        uint32_t block = start + length;
+        uint64_t rest = ~(fm->words[block / 64] >> (block % 64));
+        if (rest == 0) {
+            length += 64 - block % 64;
+            continue;
+        }
+        uint32_t n = __builtin_ctzll(rest);
+        length += n;
+        if (n < 64 - block % 64) {
+            break;
+        }
+    }
+    return length < max_length ? length : max_length;
+}
+
+/**
+ * Collects every run of free blocks of the bitmap in block order.
+ * 
+ * @param fm The free-space bitmap.
+ * @param run_count Set to the number of runs found.
+ * 
+ * @return extent* The array of free runs, to be freed by the caller.
+ */
+extent *free_map_runs(free_map *fm, uint32_t *run_count){
+    uint32_t capacity = 64;
+    uint32_t count = 0;
+    extent *runs = (extent *)emalloc(capacity * sizeof(extent));
+    bool in_run = false;
+    for (uint32_t w = fm->hint; w < fm->word_count; w++) {
+        uint64_t bits = fm->words[w];
+        uint32_t b = 0;
+        while (b < 64) {
+            uint64_t rest = bits >> b;
+            if ((rest & 1) == 0) {
+                in_run = false;
+                if (rest == 0) {
+                    break;
+                }
+                b += __builtin_ctzll(rest);
+                continue;
+            }
+            uint32_t n = (b == 0 && rest == ~0ULL) ? 64 : __builtin_ctzll(~rest);
+            if (!in_run) {
+                if (count == capacity) {
+                    capacity *= 2;
+                    extent *grown = (extent *)realloc(runs, capacity * sizeof(extent));
+                    if (grown == NULL) {
+                        fprintf(stderr, "Error: Unable to allocate memory\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    runs = grown;
+                }
+                runs[count].start = w * 64 + b;
+                runs[count].length = 0;
+                count++;
+                in_run = true;
+            }
+            runs[count - 1].length += n;
+            b += n;
+        }
+    }
+    *run_count = count;
+    return runs;
+}
+
+/**
+ * Marks a run of blocks as used in the bitmap.
+ * 
+ * @param fm The free-space bitmap.
+ * @param start The first block of the run.
+ * @param length The number of blocks in the run.
+ */
+void free_map_take(free_map *fm, uint32_t start, uint32_t length){
+    if (length == 0) {
+        return;
+    }
+    for (uint32_t i = start; i < start + length; i++) {
+        uint64_t mask = 1ULL << (i % 64);
+        if (fm->words[i / 64] & mask) {
+            fm->words[i / 64] &= ~mask;
+            fm->free_count--;
+        }
+    }
+    free_map_refresh(fm, start / 64, (start + length - 1) / 64);
+}
+
+/**
+ * Marks a run of blocks as free in the bitmap.
+ * 
+ * @param fm The free-space bitmap.
+ * @param start The first block of the run.
+ * @param length The number of blocks in the run.
+ */
+void free_map_release(free_map *fm, uint32_t start, uint32_t length){
+    for (uint32_t i = start; i < start + length; i++) {
+        uint64_t mask = 1ULL << (i % 64);
+        if ((fm->words[i / 64] & mask) == 0) {
+            fm->words[i / 64] |= mask;
+            fm->free_count++;
+        }
+    }
+    if (length == 0) {
+        return;
+    }
+    free_map_refresh(fm, start / 64, (start + length - 1) / 64);
+    if (start / 64 < fm->hint) {
+        fm->hint = start / 64;
+    }
+}
+
+/**
+ * Releases the bitmap of an image.
+ * 
+ * @param fm The free-space bitmap.
+ */
+void free_free_map(free_map *fm){
+    free(fm->runs);
+    free(fm->words);
+    free(fm);
+}
+
+/**
+ * Hashes a path with 32-bit FNV-1a.
+ */
+uint32_t path_hash(const char *path){
+    uint32_t hash = 2166136261u;
+    for (const uint8_t *c = (const uint8_t *)path; *c != '\0'; c++) {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Returns a normalized copy of a path: no leading, trailing or repeated '/', and no "." components.
+ * 
+ * @param path The path to normalize, left unchanged.
+ * @return char* The normalized path, to be freed by the caller. The root directory is "".
+ */
+char *normalize_path(const char *path){
+    char *normalized = (char *)emalloc(strlen(path) + 1);
+    size_t length = 0;
+    const char *part = path;
+    while (*part != '\0') {
+        while (*part == '/') {
+            part++;
+        }
+        const char *end = part;
+        while (*end != '\0' && *end != '/') {
+            end++;
+        }
+        size_t part_length = end - part;
+        if (part_length > 0 && !(part_length == 1 && part[0] == '.')) {
+            if (length > 0) {
+                normalized[length++] = '/';
+            }
+            memcpy(normalized + length, part, part_length);
+            length += part_length;
+        }
+        part = end;
+    }
+    normalized[length] = '\0';
+    return normalized;
+}
+
+/**
+ * Looks up a normalized directory path in the path cache of an image.
+ * 
+ * @return true on a hit, with start_block and block_count set, false otherwise.
+ */
+bool dcache_lookup(fs_image *img, const char *path, uint32_t *start_block, uint32_t *block_count){
+    pthread_mutex_lock(&img->dcache_lock);
+    dentry_cache *cache = img->dcache;
+    if (cache == NULL) {
+        pthread_mutex_unlock(&img->dcache_lock);
+        return false;
+    }
+    uint32_t hash = path_hash(path);
+    for (dentry *d = cache->buckets[hash % cache->bucket_count]; d != NULL; d = d->next) {
+        if (d->hash == hash && strcmp(d->path, path) == 0) {
+            *start_block = d->start_block;
+            *block_count = d->block_count;
+            cache->hits++;
+            stats_add(&stats.cache_hits, 1);
+            pthread_mutex_unlock(&img->dcache_lock);
+            return true;
+        }
+    }
+    cache->misses++;
+    stats_add(&stats.cache_misses, 1);
+    pthread_mutex_unlock(&img->dcache_lock);
+    return false;
+}
+
+/**
+ * Records where a directory lives in the path cache of an image, creating the cache on first use.
+ * The cache is guarded by a mutex, so threads sharing an image can resolve paths at the same time.
+ * 
+ * @param img The opened file system image.
+ * @param path The normalized path of the directory.
+ * @param start_block The first block of the directory.
+ * @param block_count The number of blocks of the directory.
+ */
+void dcache_insert(fs_image *img, const char *path, uint32_t start_block, uint32_t block_count){
+    pthread_mutex_lock(&img->dcache_lock);
+    if (img->dcache == NULL) {
+        img->dcache = (dentry_cache *)emalloc(sizeof(dentry_cache));
+        memset(img->dcache, 0, sizeof(dentry_cache));
+        img->dcache->bucket_count = 64;
+        img->dcache->buckets = (dentry **)calloc(img->dcache->bucket_count, sizeof(dentry *));
+        if (img->dcache->buckets == NULL) {
+            fprintf(stderr, "Error: Unable to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    dentry_cache *cache = img->dcache;
+    if (cache->entry_count >= cache->bucket_count) {
+        uint32_t bucket_count = cache->bucket_count * 2;
+        dentry **buckets = (dentry **)calloc(bucket_count, sizeof(dentry *));
+        if (buckets == NULL) {
+            fprintf(stderr, "Error: Unable to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+        for (uint32_t b = 0; b < cache->bucket_count; b++) {
+            dentry *d = cache->buckets[b];
+            while (d != NULL) {
+                dentry *next = d->next;
+                d->next = buckets[d->hash % bucket_count];
+                buckets[d->hash % bucket_count] = d;
+                d = next;
+            }
+        }
+        free(cache->buckets);
+        cache->buckets = buckets;
+        cache->bucket_count = bucket_count;
+    }
+    dentry *d = (dentry *)emalloc(sizeof(dentry));
+    d->path = strdup(path);
+    if (d->path == NULL) {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+    d->hash = path_hash(path);
+    d->start_block = start_block;
+    d->block_count = block_count;
+    d->next = cache->buckets[d->hash % cache->bucket_count];
+    cache->buckets[d->hash % cache->bucket_count] = d;
+    cache->entry_count++;
+    pthread_mutex_unlock(&img->dcache_lock);
+}
+
+/**
+ * Drops a directory and everything below it from the path cache of an image.
+ * 
+ * @param img The opened file system image.
+ * @param path The path of the directory, "" to empty the whole cache.
+ * 
+ * The cache only records where directories live, so it has to be invalidated whenever an operation
+ * moves a directory, changes its blocks or removes it. Adding or removing entries inside a directory does not.
+ */
+void dcache_invalidate(fs_image *img, const char *path){
+    pthread_mutex_lock(&img->dcache_lock);
+    dentry_cache *cache = img->dcache;
+    if (cache == NULL) {
+        pthread_mutex_unlock(&img->dcache_lock);
+        return;
+    }
+    char *normalized = normalize_path(path);
+    size_t length = strlen(normalized);
+    for (uint32_t b = 0; b < cache->bucket_count; b++) {
+        dentry **link = &cache->buckets[b];
+        while (*link != NULL) {
+            dentry *d = *link;
+            bool below = length == 0 || (strncmp(d->path, normalized, length) == 0 &&
+                                         (d->path[length] == '\0' || d->path[length] == '/'));
+            if (below) {
+                *link = d->next;
+                free(d->path);
+                free(d);
+                cache->entry_count--;
+            }else{
+                link = &d->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&img->dcache_lock);
+    free(normalized);
+}
+
+/**
+ * Releases a path cache.
+ */
+void dcache_free(dentry_cache *cache){
+    for (uint32_t b = 0; b < cache->bucket_count; b++) {
+        dentry *d = cache->buckets[b];
+        while (d != NULL) {
+            dentry *next = d->next;
+            free(d->path);
+            free(d);
+            d = next;
+        }
+    }
+    free(cache->buckets);
+    free(cache);
+}
+
+/**
+ * Returns the path of the journal of an image, the image path with ".journal" appended, to be freed by the caller.
+ */
+char *journal_path(const char *image_path){
+    char *path = (char *)emalloc(strlen(image_path) + sizeof(JOURNAL_SUFFIX));
+    sprintf(path, "%s%s", image_path, JOURNAL_SUFFIX);
+    return path;
+}
+
+/**
+ * Returns the 64-bit FNV-1a hash of a buffer, used to tell a complete journal from a torn one.
+ */
+uint64_t journal_checksum(const uint8_t *data, size_t len){
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * Applies the journal of an image left behind by a crash, before a writable open reads the image.
+ * 
+ * @param image_path The path of the image.
+ * @param image_fd The image, opened for writing.
+ * 
+ * A journal holds one committed transaction: the FAT blocks and directory entries of a flush (see journal_commit).
+ * If its header and checksum are intact, every record is written back in place and the image is synced, so a
+ * flush cut short by a crash is either completed or, when the journal itself was torn, never happened. Replaying a
+ * transaction that was already applied writes the same bytes again. The journal is then emptied.
+ * The journal is locked while it is replayed. A journal locked by a durable image that is still open (see
+ * journal_open) belongs to a live writer, not to a crash, and is left alone.
+ * 
+ * @return FSIMG_OK, FSIMG_BUSY if another process has the image open with a journal, or FSIMG_IO_ERROR if a
+ * complete journal is malformed or could not be applied. Nothing is written from a journal whose records do not
+ * all fit its payload.
+ */
+int replay_journal(const char *image_path, int image_fd){
+    char *path = journal_path(image_path);
+    int fd = open(path, O_RDWR);
+    stats_syscall(NULL, 0);
+    free(path);
+    if (fd < 0) {
+        return errno == ENOENT ? FSIMG_OK : FSIMG_IO_ERROR;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        int status = errno == EWOULDBLOCK ? FSIMG_BUSY : FSIMG_IO_ERROR;
+        close(fd);
+        return status;
+    }
+    struct stat st;
+    journal_header header;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(header) ||
+        pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0 || ntohl(header.version) != JOURNAL_VERSION ||
+        be64toh(header.payload_bytes) > (uint64_t)st.st_size - sizeof(header)) {
+        // Empty, or torn before its header was complete
+        close(fd);
+        return FSIMG_OK;
+    }
+    size_t payload_bytes = be64toh(header.payload_bytes);
+    uint8_t *payload = (uint8_t *)emalloc(payload_bytes + 1);
+    // A journal is at most the metadata of one flush, a regular file read in one call
+    if (pread(fd, payload, payload_bytes, sizeof(header)) != (ssize_t)payload_bytes ||
+        journal_checksum(payload, payload_bytes) != be64toh(header.checksum)) {
+        free(payload);
+        close(fd);
+        return FSIMG_OK;
+    }
+
+    // The checksum only shows the journal was written in full: every record, padding included, must also lie
+    // within the payload before anything is written
+    size_t position = 0;
+    for (uint32_t r = 0; r < ntohl(header.segment_count); r++) {
+        journal_record record;
+        if (payload_bytes - position < sizeof(record)) {
+            free(payload);
+            close(fd);
+            return FSIMG_IO_ERROR;
+        }
+        memcpy(&record, payload + position, sizeof(record));
+        position += sizeof(record);
+        size_t padded = ((size_t)ntohl(record.length) + 7) & ~(size_t)7;
+        if (padded > payload_bytes - position) {
+            free(payload);
+            close(fd);
+            return FSIMG_IO_ERROR;
+        }
+        position += padded;
+    }
+
+    int status = FSIMG_OK;
+    position = 0;
+    for (uint32_t r = 0; status == FSIMG_OK && r < ntohl(header.segment_count); r++) {
+        journal_record record;
+        memcpy(&record, payload + position, sizeof(record));
+        position += sizeof(record);
+        uint32_t length = ntohl(record.length);
+        ssize_t n = pwrite(image_fd, payload + position, length, (off_t)be64toh(record.offset));
+        stats_syscall(&stats.bytes_written, n);
+        if (n != (ssize_t)length) {
+            status = FSIMG_IO_ERROR;
+        }
+        position += ((size_t)length + 7) & ~(size_t)7;
+    }
+    if (status == FSIMG_OK && fdatasync(image_fd) != 0) {
+        status = FSIMG_IO_ERROR;
+    }
+    stats_syscall(NULL, 0);
+    if (status == FSIMG_OK && ftruncate(fd, 0) == 0) {
+        fdatasync(fd);
+    }
+    free(payload);
+    close(fd);
+    return status;
+}
+
+/**
+ * Makes the later flushes of a writable image crash consistent, by committing each one to a journal first.
+ * 
+ * @param img The file system image, opened for writing.
+ * 
+ * The journal is a file next to the image (see journal_path), created if needed. Creating it syncs the directory
+ * holding it, so that the journal cannot vanish in a crash after a transaction was committed to it. The journal
+ * stays locked until the image is closed, so that no other open replays or empties it in the meantime.
+ * 
+ * @return FSIMG_OK, FSIMG_BUSY if another process holds the journal, or FSIMG_IO_ERROR.
+ */
+int journal_open(fs_image *img){
+    char *path = journal_path(img->path);
+    bool created = true;
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0 && errno == EEXIST) {
+        created = false;
+        fd = open(path, O_RDWR);
+    }
+    stats_syscall(NULL, 0);
+    if (fd >= 0 && created) {
+        char *slash = strrchr(path, '/');
+        if (slash != NULL) {
+            *slash = '\0';
+        }
+        int dir_fd = open(slash != NULL ? (slash == path ? "/" : path) : ".", O_RDONLY | O_DIRECTORY);
+        if (dir_fd >= 0) {
+            fsync(dir_fd);
+            close(dir_fd);
+        }
+    }
+    free(path);
+    if (fd < 0) {
+        return FSIMG_IO_ERROR;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        int status = errno == EWOULDBLOCK ? FSIMG_BUSY : FSIMG_IO_ERROR;
+        close(fd);
+        return status;
+    }
+    img->journal_fd = fd;
+    return FSIMG_OK;
+}
+
+/**
+ * Commits the metadata of a flush to the journal of a durable image, before it is written in place.
+ * 
+ * @param img The file system image, with a journal.
+ * @param segments The FAT blocks, directory entries and super block fields of the flush, sorted by offset.
+ * @param segment_count The number of segments.
+ * 
+ * This is one group commit however many files the flush covers:
+ * - The image is synced, so the file data the metadata points to is on disk, together with the previous
+ *   transaction, which was written in place since.
+ * - The transaction (a header, then every segment as its offset, length and data) replaces the journal in one
+ *   write, and the journal is synced. This is the commit point.
+ * Once the journal is synced, a crash at any point of the in-place writes is completed by replay_journal on the
+ * next writable open. The journal is only emptied when the image is closed cleanly.
+ * A failure is recorded in image_error (when the image does not exit on errors), and the flush must then leave the
+ * metadata where it is: a journal that was not fully written fails its checksum and is never replayed.
+ */
+void journal_commit(fs_image *img, const meta_segment *segments, uint32_t segment_count){
+    uint64_t phase_start = stats_clock();
+    size_t payload_bytes = 0;
+    for (uint32_t i = 0; i < segment_count; i++) {
+        payload_bytes += sizeof(journal_record) + ((segments[i].length + 7) & ~(size_t)7);
+    }
+    uint8_t *buffer = (uint8_t *)calloc(1, sizeof(journal_header) + payload_bytes);
+    if (buffer == NULL) {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+    uint8_t *position = buffer + sizeof(journal_header);
+    for (uint32_t i = 0; i < segment_count; i++) {
+        journal_record record;
+        record.offset = htobe64((uint64_t)segments[i].offset);
+        record.length = htonl((uint32_t)segments[i].length);
+        record.reserved = 0;
+        memcpy(position, &record, sizeof(record));
+        memcpy(position + sizeof(record), segments[i].data, segments[i].length);
+        position += sizeof(record) + ((segments[i].length + 7) & ~(size_t)7);
+    }
+    journal_header header;
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.version = htonl(JOURNAL_VERSION);
+    header.segment_count = htonl(segment_count);
+    header.payload_bytes = htobe64(payload_bytes);
+    header.checksum = htobe64(journal_checksum(buffer + sizeof(journal_header), payload_bytes));
+    memcpy(buffer, &header, sizeof(header));
+
+    stats_syscall(NULL, 0);
+    if (fdatasync(img->fd) != 0) {
+        // Committing metadata whose data may not be on disk would let a replay point files at garbage
+        image_failed(img, "sync");
+        free(buffer);
+        stats_phase(PHASE_FLUSH, phase_start);
+        return;
+    }
+    size_t total = sizeof(journal_header) + payload_bytes;
+    size_t done = 0;
+    while (done < total) {
+        ssize_t n = pwrite(img->journal_fd, buffer + done, total - done, (off_t)done);
+        stats_syscall(&stats.bytes_written, n);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            image_failed(img, "write the journal of");
+            break;
+        }
+        done += n;
+    }
+    stats_syscall(NULL, 0);
+    if (done == total && fdatasync(img->journal_fd) != 0) {
+        image_failed(img, "write the journal of");
+    }
+    img->journal_dirty = true;
+    free(buffer);
+    stats_phase(PHASE_FLUSH, phase_start);
+}
+
+/**
+ * Empties the journal of a durable image once everything committed to it is on disk in place.
+ * 
+ * The image is synced first. A journal that cannot be emptied is replayed on the next open, which rewrites
+ * metadata that is already there.
+ */
+void journal_checkpoint(fs_image *img){
+    stats_syscall(NULL, 0);
+    if (img->journal_dirty && image_error == FSIMG_OK && fdatasync(img->fd) == 0 && ftruncate(img->journal_fd, 0) == 0) {
+        img->journal_dirty = false;
+    }
+}
+
+/**
+ * Releases the mapping, the FAT and the descriptor held by an image.
+ * 
+ * @param img The opened file system image.
+ */
+void close_image(fs_image *img){
+    if (img->journal_fd >= 0) {
+        journal_checkpoint(img);
+        close(img->journal_fd);
+    }
+    for (uint32_t c = 0; c < img->cursor_count; c++) {
+        free(img->cursors[c].it.buffer);
+        free(img->cursors[c].path);
+        free(img->cursors[c].returned);
+    }
+    free(img->cursors);
+    if (img->dcache != NULL) {
+        dcache_free(img->dcache);
+    }
+    pthread_mutex_destroy(&img->dcache_lock);
+    if (img->chain_cache != NULL) {
+        for (uint32_t c = 0; c < CHAIN_CACHE_SIZE; c++) {
+            free(img->chain_cache[c].extents);
+            free(img->chain_cache[c].first_blocks);
+        }
+        free(img->chain_cache);
+    }
+    pthread_mutex_destroy(&img->chain_lock);
+    if (img->free != NULL) {
+        free_free_map(img->free);
+    }
+    free(img->fat_dirty);
+    free(img->pending);
+    if (img->fat_owned) {
+        free(img->fat);
+    }
+    if (img->fat_map != NULL) {
+        munmap(img->fat_map, img->fat_map_size);
+    }
+    if (img->fat_windows != NULL) {
+        for (uint32_t w = 0; w < FAT_WINDOWS; w++) {
+            free(img->fat_windows[w].entries);
+        }
+        free(img->fat_windows);
+    }
+    pthread_mutex_destroy(&img->fat_lock);
+    if (img->map != NULL) {
+        munmap(img->map, img->map_size);
+    }
+    close(img->fd);
+    free(img->path);
+    free(img);
+}
+
+/**
+ * Opens a file system image and loads its super block and FAT once.
+ * 
+ * @param filename The name of the file system image.
+ * @param writable Whether the image will be modified.
+ * @param out Set to the opened image.
+ * 
+ * A writable open first replays a journal left by a crash during a durable flush (see replay_journal). A read-only
+ * open leaves the journal for the next writable one.
+ * The image is mapped read-only into memory so that the FAT and the blocks can be read without copying.
+ * If the mapping fails (or FSIMG_NO_MMAP is set), every read falls back to pread, and the FAT of a read-only image
+ * is read in windows of FAT_WINDOW_ENTRIES entries as they are needed instead of all at once.
+ * A writable image gets a private copy of the FAT, a copy-on-write mapping when the image is mapped and a heap copy
+ * otherwise. Changes to it and to directory entries are kept in memory and written back by flush_metadata.
+ * 
+ * @return FSIMG_OK, FSIMG_NOT_FOUND, FSIMG_BUSY, FSIMG_IO_ERROR or FSIMG_INVALID_IMAGE.
+ */
+int load_image(const char *filename, bool writable, fs_image **out){
+    uint64_t phase_start = stats_clock();
+    int fd = open(filename, writable ? O_RDWR : O_RDONLY);
+    stats_syscall(NULL, 0);
+    if (fd < 0) {
+        return errno == ENOENT ? FSIMG_NOT_FOUND : FSIMG_IO_ERROR;
+    }
+    fs_image *img = (fs_image *)emalloc(sizeof(fs_image));
+    memset(img, 0, sizeof(fs_image));
+    img->path = strdup(filename);
+    if (img->path == NULL) {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+    img->fd = fd;
+    img->writable = writable;
+    img->journal_fd = -1;
+    pthread_mutex_init(&img->dcache_lock, NULL);
+    pthread_mutex_init(&img->chain_lock, NULL);
+    pthread_mutex_init(&img->fat_lock, NULL);
+
+    // A read-only open never writes the image: a journal left by a crash waits for the next writable open
+    int status = writable ? replay_journal(filename, fd) : FSIMG_OK;
+    if (status != FSIMG_OK) {
+        close_image(img);
+        return status;
+    }
+
+    struct stat st;
+    stats_syscall(NULL, 0);
+    if (fstat(fd, &st) == 0 && st.st_size > 0 && getenv("FSIMG_NO_MMAP") == NULL) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        stats_syscall(NULL, 0);
+        if (map != MAP_FAILED) {
+            img->map = (uint8_t *)map;
+            img->map_size = st.st_size;
+        }
+    }
+    stats_phase(PHASE_OPEN, phase_start);
+
+    phase_start = stats_clock();
+    super_block *sb = &img->sb;
+    read_image(img, sb, sizeof(super_block), 0);
+    sb->block_size = htons(sb->block_size);
+    sb->file_system_block_count = htonl(sb->file_system_block_count);
+    sb->fat_start_block = htonl(sb->fat_start_block);
+    sb->fat_block_count = htonl(sb->fat_block_count);
+    sb->root_dir_start_block = htonl(sb->root_dir_start_block);
+    sb->root_dir_block_count = htonl(sb->root_dir_block_count);
+    if (image_error != FSIMG_OK || sb->block_size < sizeof(dir_entry_t) ||
+        (uint64_t)sb->fat_block_count * sb->block_size < (uint64_t)sb->file_system_block_count * sizeof(uint32_t)) {
+        int status = image_error != FSIMG_OK ? image_error : FSIMG_INVALID_IMAGE;
+        close_image(img);
+        return status;
+    }
+
+    stats_phase(PHASE_SUPER_BLOCK, phase_start);
+
+    phase_start = stats_clock();
+    size_t fat_size = (size_t)sb->fat_block_count * sb->block_size;
+    off_t fat_offset = block_offset(img, sb->fat_start_block);
+    bool fat_mapped = img->map != NULL && (uint64_t)fat_offset + fat_size <= img->map_size;
+    if (fat_mapped && !writable) {
+        img->fat = (uint32_t *)(img->map + fat_offset);
+    }else if (fat_mapped) {
+        // Only the pages of the FAT that change get copied
+        off_t map_start = fat_offset - fat_offset % sysconf(_SC_PAGESIZE);
+        size_t map_size = fat_size + (size_t)(fat_offset - map_start);
+        void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, map_start);
+        stats_syscall(NULL, 0);
+        if (map != MAP_FAILED) {
+            img->fat_map = (uint8_t *)map;
+            img->fat_map_size = map_size;
+            img->fat = (uint32_t *)(img->fat_map + (fat_offset - map_start));
+        }
+    }
+    if (img->fat == NULL && !writable) {
+        img->fat_windows = (fat_window *)calloc(FAT_WINDOWS, sizeof(fat_window));
+        if (img->fat_windows == NULL) {
+            fprintf(stderr, "Error: Unable to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }else if (img->fat == NULL) {
+        img->fat = (uint32_t *)emalloc(fat_size);
+        img->fat_owned = true;
+        read_image(img, img->fat, fat_size, fat_offset);
+    }
+    if (writable) {
+        img->free = build_free_map(img);
+        img->fat_dirty = (uint8_t *)calloc(sb->fat_block_count / 8 + 1, 1);
+        if (img->fat_dirty == NULL) {
+            fprintf(stderr, "Error: Unable to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    stats_phase(PHASE_FAT_LOAD, phase_start);
+    if (image_error != FSIMG_OK) {
+        int status = image_error;
+        close_image(img);
+        return status;
+    }
+    *out = img;
+    return FSIMG_OK;
+}
+
+/**
+ * Opens a file system image for one of the tools.
+ * 
+ * @param filename The name of the file system image.
+ * @param writable Whether the image will be modified.
+ * 
+ * Any later I/O error on the image prints an error message and exits the program.
+ * 
+ * @return fs_image* A pointer to the opened image, exits the program on error.
+ */
+fs_image *open_image(char *filename, bool writable){
+    fs_image *img;
+    int status = load_image(filename, writable, &img);
+    if (status == FSIMG_BUSY) {
+        fprintf(stderr, "Error: %s is being written by another process\n", filename);
+        exit(1);
+    }
+    if (status != FSIMG_OK && status != FSIMG_INVALID_IMAGE && status != FSIMG_NOT_FOUND) {
+        char *path = journal_path(filename);
+        struct stat st;
+        if (stat(path, &st) == 0 && st.st_size > 0) {
+            fprintf(stderr, "Error: Unable to replay the journal %s\n", path);
+            exit(1);
+        }
+        free(path);
+    }
+    if (status == FSIMG_INVALID_IMAGE) {
+        fprintf(stderr, "Error: Invalid super block in %s\n", filename);
+        exit(1);
+    }
+    if (status != FSIMG_OK) {
+        fprintf(stderr, "Error: Unable to open file %s\n", filename);
+        exit(1);
+    }
+    img->fail_fast = true;
+    return img;
+}
+
+/**
+ * Turns on the journal of an image opened by one of the tools, so that every later flush is crash consistent.
+ * Prints an error message and exits the program if the journal cannot be created.
+ */
+void open_journal(fs_image *img){
+    int status = journal_open(img);
+    if (status == FSIMG_BUSY) {
+        fprintf(stderr, "Error: %s is being written by another process\n", img->path);
+        exit(1);
+    }
+    if (status != FSIMG_OK) {
+        fprintf(stderr, "Error: Unable to create the journal of %s\n", img->path);
+        exit(1);
+    }
+}
+
+/**
+ * Sets the FAT value of a block of a writable image and marks the FAT block holding it as dirty.
+ * 
+ * @param img The file system image, opened for writing.
+ * @param block The block index.
+ * @param value The new FAT value, in host byte order.
+ */
+void fat_set(fs_image *img, uint32_t block, uint32_t value){
+    stats_add(&stats.fat_entries, 1);
+    img->fat[block] = htonl(value);
+    img->fat_generation++;
+    uint32_t fat_block = (uint32_t)(((uint64_t)block * sizeof(uint32_t)) / img->sb.block_size);
+    img->fat_dirty[fat_block / 8] |= 1 << (fat_block % 8);
+}
+
+/**
+ * Queues the update of a directory entry of a writable image until the next flush_metadata.
+ * 
+ * @param img The file system image, opened for writing.
+ * @param offset The offset of the entry in the image.
+ * @param entry The new entry, in on-disk byte order.
+ */
+void stage_dir_entry(fs_image *img, off_t offset, const dir_entry_t *entry){
+    if (img->pending_count == img->pending_capacity) {
+        img->pending_capacity = img->pending_capacity == 0 ? 64 : img->pending_capacity * 2;
+        pending_entry *grown = (pending_entry *)realloc(img->pending, img->pending_capacity * sizeof(pending_entry));
+        if (grown == NULL) {
+            fprintf(stderr, "Error: Unable to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+        img->pending = grown;
+    }
+    pending_entry *pending = &img->pending[img->pending_count++];
+    pending->offset = offset;
+    pending->sequence = img->pending_sequence++;
+    pending->entry = *entry;
+}
+
+/**
+ * Orders pending directory entries by offset, and updates of the same entry by age.
+ */
+int compare_pending_entry(const void *a, const void *b){
+    const pending_entry *x = (const pending_entry *)a;
+    const pending_entry *y = (const pending_entry *)b;
+    if (x->offset != y->offset) {
+        return x->offset < y->offset ? -1 : 1;
+    }
+    return x->sequence < y->sequence ? -1 : (x->sequence > y->sequence);
+}
+
+/**
+ * Writes a run of contiguous segments of the image with as few pwritev calls as possible.
+ * 
+ * @param img The file system image, opened for writing.
+ * @param segments The segments, each one starting where the previous one ends.
+ * @param segment_count The number of segments.
+ */
+void write_segments(fs_image *img, meta_segment *segments, uint32_t segment_count){
+    struct iovec iov[IOV_MAX];
+    uint32_t done = 0;
+    while (done < segment_count) {
+        uint32_t count = segment_count - done < IOV_MAX ? segment_count - done : IOV_MAX;
+        size_t total = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            iov[i].iov_base = (void *)segments[done + i].data;
+            iov[i].iov_len = segments[done + i].length;
+            total += segments[done + i].length;
+        }
+        stats_seek(segments[done].offset, total);
+        ssize_t n = pwritev(img->fd, iov, count, segments[done].offset);
+        stats_syscall(&stats.bytes_written, n);
+        img->meta_write_calls++;
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            image_failed(img, "write");
+            return;
+        }
+        img->meta_bytes_written += n;
+        if ((size_t)n < total) {
+            // Finish a short write segment by segment
+            size_t skip = n;
+            for (uint32_t i = 0; i < count; i++) {
+                if (skip >= segments[done + i].length) {
+                    skip -= segments[done + i].length;
+                    continue;
+                }
+                write_image(img, (const uint8_t *)segments[done + i].data + skip, segments[done + i].length - skip,
+                            segments[done + i].offset + skip);
+                img->meta_write_calls++;
+                img->meta_bytes_written += segments[done + i].length - skip;
+                skip = 0;
+            }
+        }
+        done += count;
+    }
+}
+
+/**
+ * Writes the dirty FAT blocks and the pending directory entries of a writable image back to the image.
+ * 
+ * @param img The file system image, opened for writing.
+ * 
+ * Only the FAT blocks changed since the last flush are written. Together with the directory entries they are sorted
+ * by offset and every run of contiguous pieces goes out in a single pwritev, so the bytes written grow with the size
+ * of the change rather than with the size of the FAT. A new root directory start or block count goes to the super
+ * block.
+ * On a durable image the whole flush is first committed to the journal (see journal_commit). If the commit fails,
+ * nothing is written in place and the dirty FAT blocks, pending entries and super block field are kept, so that a
+ * later flush writes them again.
+ */
+void flush_metadata(fs_image *img){
+    super_block sb = img->sb;
+    uint64_t phase_start = stats_clock();
+    uint32_t capacity = img->pending_count + 16;
+    uint32_t count = 0;
+    meta_segment *segments = (meta_segment *)emalloc(capacity * sizeof(meta_segment));
+    off_t fat_offset = block_offset(img, sb.fat_start_block);
+    for (uint32_t b = 0; b < sb.fat_block_count; b++) {
+        if ((img->fat_dirty[b / 8] & (1 << (b % 8))) == 0) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            meta_segment *grown = (meta_segment *)realloc(segments, capacity * sizeof(meta_segment));
+            if (grown == NULL) {
+                fprintf(stderr, "Error: Unable to allocate memory\n");
+                exit(EXIT_FAILURE);
+            }
+            segments = grown;
+        }
+        segments[count].offset = fat_offset + (off_t)b * sb.block_size;
+        segments[count].data = (uint8_t *)img->fat + (size_t)b * sb.block_size;
+        segments[count].length = sb.block_size;
+        count++;
+    }
+
+    // Only the latest update of every entry is written
+    qsort(img->pending, img->pending_count, sizeof(pending_entry), compare_pending_entry);
+    uint32_t fat_segments = count;
+    for (uint32_t p = 0; p < img->pending_count; p++) {
+        if (p + 1 < img->pending_count && img->pending[p + 1].offset == img->pending[p].offset) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            meta_segment *grown = (meta_segment *)realloc(segments, capacity * sizeof(meta_segment));
+            if (grown == NULL) {
+                fprintf(stderr, "Error: Unable to allocate memory\n");
+                exit(EXIT_FAILURE);
+            }
+            segments = grown;
+        }
+        segments[count].offset = img->pending[p].offset;
+        segments[count].data = &img->pending[p].entry;
+        segments[count].length = sizeof(dir_entry_t);
+        count++;
+    }
+
+    // The FAT segments and the entry segments are each sorted, merge them by offset after the super block field
+    meta_segment *sorted = (meta_segment *)emalloc((count + 2) * sizeof(meta_segment));
+    uint32_t root_segments = 0;
+    // The root directory fields sit side by side at the end of the super block and go out as one piece
+    uint32_t root_dir_fields[2] = { htonl(sb.root_dir_start_block), htonl(sb.root_dir_block_count) };
+    if (img->root_dirty) {
+        sorted[0].offset = offsetof(super_block, root_dir_start_block);
+        sorted[0].data = root_dir_fields;
+        sorted[0].length = sizeof(root_dir_fields);
+        root_segments = 1;
+    }
+    uint32_t f = 0;
+    uint32_t e = fat_segments;
+    for (uint32_t i = 0; i < count; i++) {
+        if (e >= count || (f < fat_segments && segments[f].offset < segments[e].offset)) {
+            sorted[root_segments + i] = segments[f++];
+        }else{
+            sorted[root_segments + i] = segments[e++];
+        }
+    }
+    count += root_segments;
+
+    if (img->journal_fd >= 0 && count > 0) {
+        journal_commit(img, sorted, count);
+        if (image_error != FSIMG_OK) {
+            free(sorted);
+            free(segments);
+            stats_phase(PHASE_FLUSH, phase_start);
+            return;
+        }
+    }
+
+    uint32_t run_start = 0;
+    for (uint32_t i = 1; i <= count; i++) {
+        if (i == count || sorted[i].offset != sorted[i - 1].offset + (off_t)sorted[i - 1].length) {
+            write_segments(img, sorted + run_start, i - run_start);
+            run_start = i;
+        }
+    }
+
+    memset(img->fat_dirty, 0, sb.fat_block_count / 8 + 1);
+    img->root_dirty = false;
+    img->pending_count = 0;
+    free(sorted);
+    free(segments);
+    stats_phase(PHASE_FLUSH, phase_start);
+}
+
+/**
+ * Converts the multi-byte fields of a directory entry from big-endian to host byte order.
+ * 
+ * @param entry The directory entry to convert in place.
+ */
+void decode_dir_entry(dir_entry_t *entry){
+    entry->start_block = ntohl(entry->start_block);
+    entry->block_count = ntohl(entry->block_count);
+    entry->size = ntohl(entry->size);
+    entry->create_time.year = ntohs(entry->create_time.year);
+    entry->modify_time.year = ntohs(entry->modify_time.year);
+}
+
+/**
+ * Converts the multi-byte fields of a directory entry from host byte order back to big-endian.
+ * 
+ * @param entry The directory entry to convert in place.
+ */
+void encode_dir_entry(dir_entry_t *entry){
+    entry->start_block = htonl(entry->start_block);
+    entry->block_count = htonl(entry->block_count);
+    entry->size = htonl(entry->size);
+    entry->create_time.year = htons(entry->create_time.year);
+    entry->modify_time.year = htons(entry->modify_time.year);
+}
+
+/**
+ * Starts iterating over the blocks of a directory.
+ * 
+ * @param it The iterator to initialize.
+ * @param img The opened file system image.
+ * @param start_block The first block of the directory.
+ * @param block_count The number of blocks of the directory.
+ * 
+ * The blocks are followed through the FAT. Each call to dir_iter_next loads one whole block.
+ */
+void dir_iter_init(dir_iter *it, fs_image *img, uint32_t start_block, uint32_t block_count){
+    it->img = img;
+    it->next_block = start_block;
+    it->blocks_left = block_count;
+    it->block = 0;
+    it->offset = 0;
+    it->entries = NULL;
+    it->entry_count = img->sb.block_size / sizeof(dir_entry_t);
+    it->buffer = NULL;
+}
+
+/**
+ * Loads the next block of a directory.
+ * 
+ * @param it The directory iterator.
+ * 
+ * The entries point straight into the image mapping when the block is mapped, otherwise the block is read into a buffer.
+ * 
+ * @return true if a block was loaded, false at the end of the directory.
+ */
+bool dir_iter_next(dir_iter *it){
+    fs_image *img = it->img;
+    if (it->blocks_left == 0 || it->next_block >= img->sb.file_system_block_count) {
+        return false;
+    }
+    it->block = it->next_block;
+    it->offset = block_offset(img, it->block);
+    stats_add(&stats.dir_slots, it->entry_count);
+    if (img->map != NULL && (uint64_t)it->offset + img->sb.block_size <= img->map_size) {
+        stats_seek(it->offset, img->sb.block_size);
+        stats_add(&stats.mapped_bytes, img->sb.block_size);
+        it->entries = (const dir_entry_t *)(img->map + it->offset);
+    }else{
+        if (it->buffer == NULL) {
+            it->buffer = (dir_entry_t *)emalloc(img->sb.block_size);
+        }
+        read_image(img, it->buffer, img->sb.block_size, it->offset);
+        it->entries = it->buffer;
+    }
+    it->blocks_left--;
+    it->next_block = fat_next(img, it->block);
+    return true;
+}
+
+/**
+ * Releases the buffer held by a directory iterator.
+ * 
+ * @param it The directory iterator.
+ */
+void dir_iter_end(dir_iter *it){
+    free(it->buffer);
+    it->buffer = NULL;
+}
+
+/**
+ * Returns the offset in the image of an entry of the current directory block.
+ * 
+ * @param it The directory iterator.
+ * @param index The index of the entry in the block.
+ */
+off_t dir_iter_entry_offset(dir_iter *it, uint32_t index){
+    return it->offset + (off_t)index * sizeof(dir_entry_t);
+}
+
+/**
+ * Checks whether the name of a directory entry is exactly name.
+ * 
+ * @param entry The directory entry.
+ * @param name The name to compare with.
+ * @param name_length The length of name.
+ */
+bool dir_name_equals(const dir_entry_t *entry, const char *name, size_t name_length){
+    if (name_length > sizeof(entry->filename)) {
+        return false;
+    }
+    if (memcmp(entry->filename, name, name_length) != 0) {
+        return false;
+    }
+    return name_length == sizeof(entry->filename) || entry->filename[name_length] == '\0';
+}
+
+/**
+ * Builds the word compared against the first four name bytes of each entry by dir_block_candidates,
+ * and the mask of the bytes that take part (the name and its terminating NUL when it is short).
+ */
+void dir_match_key(const char *name, size_t name_length, uint32_t *name_key, uint32_t *name_mask){
+    uint8_t key[4] = {0, 0, 0, 0};
+    uint8_t mask[4] = {0, 0, 0, 0};
+    size_t compared = name_length + 1 < 4 ? name_length + 1 : 4;
+    for (size_t i = 0; i < compared; i++) {
+        key[i] = i < name_length ? (uint8_t)name[i] : 0;
+        mask[i] = 0xFF;
+    }
+    memcpy(name_key, key, 4);
+    memcpy(name_mask, mask, 4);
+}
+
+/**
+ * Returns a bit mask of the entries of a block whose status and first name bytes match, one entry at a time.
+ */
+uint64_t dir_candidates_scalar(const dir_entry_t *entries, uint32_t begin, uint32_t count, uint8_t status,
+                               uint32_t name_key, uint32_t name_mask){
+    uint64_t candidates = 0;
+    for (uint32_t i = begin; i < count; i++) {
+        uint32_t name_word;
+        memcpy(&name_word, entries[i].filename, 4);
+        candidates |= (uint64_t)(entries[i].status == status && (name_word & name_mask) == name_key) << i;
+    }
+    return candidates;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * Returns a bit mask of the entries of a block whose status and first name bytes match,
+ * gathering the status and name words of eight entries at a time with AVX2.
+ */
+__attribute__((target("avx2")))
+uint64_t dir_candidates_avx2(const dir_entry_t *entries, uint32_t count, uint8_t status,
+                             uint32_t name_key, uint32_t name_mask){
+    const __m256i stride = _mm256_setr_epi32(0, 64, 128, 192, 256, 320, 384, 448);
+    const __m256i name_stride = _mm256_add_epi32(stride, _mm256_set1_epi32(offsetof(dir_entry_t, filename)));
+    const __m256i status_mask = _mm256_set1_epi32(0xFF);
+    const __m256i status_key = _mm256_set1_epi32(status);
+    const __m256i key = _mm256_set1_epi32(name_key);
+    const __m256i mask = _mm256_set1_epi32(name_mask);
+    const uint8_t *base = (const uint8_t *)entries;
+    uint64_t candidates = 0;
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const int *group = (const int *)(const void *)(base + i * sizeof(dir_entry_t));
+        __m256i status_word = _mm256_i32gather_epi32(group, stride, 1);
+        __m256i name_word = _mm256_i32gather_epi32(group, name_stride, 1);
+        __m256i match = _mm256_and_si256(
+            _mm256_cmpeq_epi32(_mm256_and_si256(status_word, status_mask), status_key),
+            _mm256_cmpeq_epi32(_mm256_and_si256(name_word, mask), key));
+        candidates |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(match)) << i;
+    }
+    return candidates | dir_candidates_scalar(entries, i, count, status, name_key, name_mask);
+}
+#endif
+
+/**
+ * Filters the entries of a directory block down to those that can be named name with the given status.
+ * 
+ * @param entries The entries of the block.
+ * @param count The number of entries in the block, at most 64.
+ * @param status The status to look for.
+ * @param name The name to look for.
+ * @param name_length The length of name.
+ * 
+ * Only the status and the first bytes of the name are compared, candidates still need a full compare.
+ * 
+ * @return One bit per candidate entry.
+ */
+uint64_t dir_block_candidates(const dir_entry_t *entries, uint32_t count, uint8_t status, const char *name, size_t name_length){
+    uint32_t name_key;
+    uint32_t name_mask;
+    dir_match_key(name, name_length, &name_key, &name_mask);
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) {
+        return dir_candidates_avx2(entries, count, status, name_key, name_mask);
+    }
+#endif
+    return dir_candidates_scalar(entries, 0, count, status, name_key, name_mask);
+}
+
+/**
+ * Looks for an entry with the given status and name in a directory.
+ * 
+ * @param img The opened file system image.
+ * @param start_block The first block of the directory.
+ * @param block_count The number of blocks of the directory.
+ * @param status The status of the entry (3 for a file, 5 for a directory).
+ * @param name The name of the entry.
+ * @param found Set to the decoded entry when it is found.
+ * 
+ * @return true if the entry was found, false otherwise.
+ */
+bool dir_lookup(fs_image *img, uint32_t start_block, uint32_t block_count, uint8_t status, const char *name, dir_entry_t *found){
+    size_t name_length = strlen(name);
+    if (name_length > sizeof(found->filename)) {
+        return false;
+    }
+    dir_iter it;
+    dir_iter_init(&it, img, start_block, block_count);
+    while (dir_iter_next(&it)) {
+        for (uint32_t first = 0; first < it.entry_count; first += 64) {
+            uint32_t count = it.entry_count - first < 64 ? it.entry_count - first : 64;
+            uint64_t candidates = dir_block_candidates(it.entries + first, count, status, name, name_length);
+            while (candidates != 0) {
+                const dir_entry_t *entry = &it.entries[first + __builtin_ctzll(candidates)];
+                if (dir_name_equals(entry, name, name_length)) {
+                    *found = *entry;
+                    decode_dir_entry(found);
+                    dir_iter_end(&it);
+                    return true;
+                }
+                candidates &= candidates - 1;
+            }
+        }
+    }
+    dir_iter_end(&it);
+    return false;
+}
+
+/**
+ * Finds where a directory lives, going through the path cache.
+ * 
+ * @param img The opened file system image.
+ * @param dir_path The path of the directory, left unchanged.
+ * @param start_block Set to the first block of the directory.
+ * @param block_count Set to the number of blocks of the directory.
+ * 
+ * The walk starts from the longest prefix of the path found in the cache (or the root directory),
+ * and every directory resolved on the way is added to the cache.
+ * 
+ * @return true if the directory was found, false otherwise.
+ */
+bool resolve_directory(fs_image *img, const char *dir_path, uint32_t *start_block, uint32_t *block_count){
+    char *path = normalize_path(dir_path);
+    size_t length = strlen(path);
+    uint32_t current_block = img->sb.root_dir_start_block;
+    uint32_t blocks_count = img->sb.root_dir_block_count;
+    size_t resolved = 0;
+
+    if (length > 0 && dcache_lookup(img, path, &current_block, &blocks_count)) {
+        resolved = length;
+    }
+    for (size_t cut = length; resolved == 0 && cut > 0; cut--) {
+        if (path[cut - 1] != '/') {
+            continue;
+        }
+        path[cut - 1] = '\0';
+        bool hit = dcache_lookup(img, path, &current_block, &blocks_count);
+        path[cut - 1] = '/';
+        if (hit) {
+            resolved = cut;
+        }
+    }
+
+    dir_entry_t entry;
+    while (resolved < length) {
+        char *part = path + resolved;
+        char *end = strchr(part, '/');
+        if (end != NULL) {
+            *end = '\0';
+        }
+        if (!dir_lookup(img, current_block, blocks_count, 5, part, &entry)) {
+            free(path);
+            return false;
+        }
+        current_block = entry.start_block;
+        blocks_count = entry.block_count;
+        dcache_insert(img, path, current_block, blocks_count);
+        if (end == NULL) {
+            break;
+        }
+        *end = '/';
+        resolved = end - path + 1;
+    }
+
+    free(path);
+    *start_block = current_block;
+    *block_count = blocks_count;
+    return true;
+}
+
+/**
+ * This function searches for a directory within a file system image.
+ * 
+ * @param img The opened file system image.
+ * @param dir_path The path of the directory to find, left unchanged.
+ * 
+ * The function resolves the parent of the directory through the path cache and looks the directory up in it.
+ * If a directory is not found, it returns NULL.
+ * 
+ * @return A pointer to the directory entry if found (to be freed by the caller), NULL otherwise.
+ */
+dir_entry_t *find_directory(fs_image *img, char *dir_path){
+    char *path = normalize_path(dir_path);
+    if (path[0] == '\0') {
+        free(path);
+        return NULL;
+    }
+    char *last_l = strrchr(path, '/');
+    char *name = path;
+    uint32_t current_block = img->sb.root_dir_start_block;
+    uint32_t blocks_count = img->sb.root_dir_block_count;
+    if (last_l != NULL) {
+        *last_l = '\0';
+        name = last_l + 1;
+        if (!resolve_directory(img, path, &current_block, &blocks_count)) {
+            free(path);
+            return NULL;
+        }
+    }
+    dir_entry_t *entry = (dir_entry_t*)emalloc(sizeof(dir_entry_t));
+    if (!dir_lookup(img, current_block, blocks_count, 5, name, entry)) {
+        free(entry);
+        entry = NULL;
+    }
+    free(path);
+    return entry;
+}
+
+/**
+ * This function searches for a file within a file system image.
+ * 
+ * @param img The opened file system image.
+ * @param file_path The path of the file to find.
+ * 
+ * It searches for a file withing a given file path 
+ * If the file is found, it creates a file entry object to return it.
+ * If the file is not found, it returns NULL.
+ * 
+ * @return A pointer to the file entry if found (to be freed by the caller), NULL otherwise.
+ */
+dir_entry_t *find_file(fs_image *img, char *file_path){
+    super_block sb = img->sb;
+    char *file_name;
+    char *dir_path;
+    if (strncmp(file_path, "./", 2) == 0) {
+        file_path += 2;
+    } else if (strncmp(file_path, "/", 1) == 0){
+        file_path += 1;
+    }
+    char *last_l = strrchr(file_path, '/');
+
+    uint32_t current_block;
+    uint32_t blocks_count;
+    if (last_l != NULL){
+        file_name = last_l + 1;
+        size_t dir_path_length = last_l - file_path;
+        dir_path = (char *)emalloc(dir_path_length + 1);
+        strncpy(dir_path, file_path, dir_path_length);
+        dir_path[dir_path_length] = '\0';
+        bool found_dir = resolve_directory(img, dir_path, &current_block, &blocks_count);
+        free(dir_path);
+        if (!found_dir){
+            return NULL;
+        }
+    }else{
+        file_name = file_path;
+        current_block = sb.root_dir_start_block;
+        blocks_count = sb.root_dir_block_count;
+    }
+
+    dir_entry_t *entry = (dir_entry_t*)emalloc(sizeof(dir_entry_t));
+    if (!dir_lookup(img, current_block, blocks_count, 3, file_name, entry)){
+        free(entry);
+        return NULL;
+    }
+    return entry;
+}
+
+/**
+ * Adds the free/used pattern of a group of consecutive FAT entries to the free run tracking of a census.
+ * 
+ * @param c The census being filled.
+ * @param free_mask One bit per entry, set when the entry is free.
+ * @param lanes The number of entries in the group.
+ */
+static inline void census_free_lanes(fat_census *c, uint32_t free_mask, uint32_t lanes){
+    uint32_t full = lanes == 32 ? 0xFFFFFFFFu : (1u << lanes) - 1;
+    if (free_mask == full) {
+        c->free_run += lanes;
+        return;
+    }
+    // The free run reaching into the group ends at its first used entry
+    c->free_run += __builtin_ctz(~free_mask);
+    if (!c->seen_used) {
+        c->leading_free_run = c->free_run;
+        c->seen_used = true;
+    }
+    if (c->free_run > c->largest_free_run) {
+        c->largest_free_run = c->free_run;
+    }
+    // Runs inside the group, found by shrinking every run by one until none is left
+    uint32_t inner = 0;
+    for (uint32_t bits = free_mask; bits != 0; bits &= bits >> 1) {
+        inner++;
+    }
+    if (inner > c->largest_free_run) {
+        c->largest_free_run = inner;
+    }
+    // The free run leaving the group starts after its last used entry
+    c->free_run = lanes - 1 - (31 - __builtin_clz(~free_mask & full));
+}
+
+/**
+ * Counts the FAT entries in [begin, end) one at a time.
+ * 
+ * @param fat FAT entries in on-disk (big-endian) order, starting with the entry of block base.
+ * @param base The block of the first entry of fat.
+ * @param begin The first block to count.
+ * @param end One past the last block to count.
+ * @param c The census to add the counts to.
+ */
+void census_scalar(const uint32_t *fat, uint32_t base, uint32_t begin, uint32_t end, fat_census *c){
+    for (uint32_t i = begin; i < end; i++) {
+        uint32_t entry = ntohl(fat[i - base]);
+        if (entry == 0) {
+            c->free_blocks++;
+        }
+        else if (entry == 1) {
+            c->reserved_blocks++;
+        }
+        else {
+            c->allocated_blocks++;
+            if (entry == 0xFFFFFFFF) {
+                c->chains++;
+            }
+            else if (entry != i + 1) {
+                c->jumps++;
+            }
+        }
+        census_free_lanes(c, entry == 0, 1);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * Counts the FAT entries in [begin, end) four at a time with SSE.
+ */
+__attribute__((target("sse4.2")))
+void census_sse42(const uint32_t *fat, uint32_t base, uint32_t begin, uint32_t end, fat_census *c){
+    const __m128i bswap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i last = _mm_set1_epi32(-1);
+    const __m128i step = _mm_set1_epi32(4);
+    __m128i next = _mm_setr_epi32(begin + 1, begin + 2, begin + 3, begin + 4);
+    uint32_t i = begin;
+    for (; i + 4 <= end; i += 4) {
+        __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(fat + (i - base))), bswap);
+        uint32_t free_mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, zero)));
+        uint32_t reserved_mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, one)));
+        uint32_t last_mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, last)));
+        uint32_t sequential_mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, next)));
+        uint32_t allocated_mask = ~(free_mask | reserved_mask) & 0xF;
+        c->free_blocks += __builtin_popcount(free_mask);
+        c->reserved_blocks += __builtin_popcount(reserved_mask);
+        c->allocated_blocks += __builtin_popcount(allocated_mask);
+        c->chains += __builtin_popcount(last_mask);
+        c->jumps += __builtin_popcount(allocated_mask & ~last_mask & ~sequential_mask);
+        census_free_lanes(c, free_mask, 4);
+        next = _mm_add_epi32(next, step);
+    }
+    census_scalar(fat, base, i, end, c);
+}
+
+/**
+ * Counts the FAT entries in [begin, end) eight at a time with AVX2.
+ */
+__attribute__((target("avx2")))
+void census_avx2(const uint32_t *fat, uint32_t base, uint32_t begin, uint32_t end, fat_census *c){
+    const __m256i bswap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                           3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i last = _mm256_set1_epi32(-1);
+    const __m256i step = _mm256_set1_epi32(8);
+    __m256i next = _mm256_setr_epi32(begin + 1, begin + 2, begin + 3, begin + 4,
+                                     begin + 5, begin + 6, begin + 7, begin + 8);
+    uint32_t i = begin;
+    for (; i + 8 <= end; i += 8) {
+        __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(fat + (i - base))), bswap);
+        uint32_t free_mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, zero)));
+        uint32_t reserved_mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, one)));
+        uint32_t last_mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, last)));
+        uint32_t sequential_mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, next)));
+        uint32_t allocated_mask = ~(free_mask | reserved_mask) & 0xFF;
+        c->free_blocks += __builtin_popcount(free_mask);
+        c->reserved_blocks += __builtin_popcount(reserved_mask);
+        c->allocated_blocks += __builtin_popcount(allocated_mask);
+        c->chains += __builtin_popcount(last_mask);
+        c->jumps += __builtin_popcount(allocated_mask & ~last_mask & ~sequential_mask);
+        census_free_lanes(c, free_mask, 8);
+        next = _mm256_add_epi32(next, step);
+    }
+    census_scalar(fat, base, i, end, c);
+}
+#endif
+
+/**
+ * Counts the FAT entries in [begin, end) with the widest kernel the CPU supports.
+ * 
+ * @param fat FAT entries in on-disk (big-endian) order, starting with the entry of block base.
+ * @param base The block of the first entry of fat, 0 for the whole FAT.
+ * @param begin The first block to count.
+ * @param end One past the last block to count.
+ * @param c The census to fill.
+ */
+void census_range(const uint32_t *fat, uint32_t base, uint32_t begin, uint32_t end, fat_census *c){
+    memset(c, 0, sizeof(fat_census));
+    c->length = end - begin;
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) {
+        census_avx2(fat, base, begin, end, c);
+    }
+    else if (__builtin_cpu_supports("sse4.2")) {
+        census_sse42(fat, base, begin, end, c);
+    }
+    else {
+        census_scalar(fat, base, begin, end, c);
+    }
+#else
+    census_scalar(fat, base, begin, end, c);
+#endif
+    if (c->free_run > c->largest_free_run) {
+        c->largest_free_run = c->free_run;
+    }
+    if (!c->seen_used) {
+        c->leading_free_run = c->free_run;
+    }
+}
+
+/**
+ * Appends the census of the following range to a census.
+ * 
+ * @param c The census of the first range, updated in place.
+ * @param next The census of the range right after it.
+ */
+void census_merge(fat_census *c, fat_census *next){
+    c->free_blocks += next->free_blocks;
+    c->reserved_blocks += next->reserved_blocks;
+    c->allocated_blocks += next->allocated_blocks;
+    c->chains += next->chains;
+    c->jumps += next->jumps;
+    uint32_t joined = c->free_run + next->leading_free_run;
+    if (joined > c->largest_free_run) {
+        c->largest_free_run = joined;
+    }
+    if (next->largest_free_run > c->largest_free_run) {
+        c->largest_free_run = next->largest_free_run;
+    }
+    if (!c->seen_used) {
+        c->leading_free_run = joined;
+    }
+    c->free_run = next->seen_used ? next->free_run : joined;
+    c->seen_used = c->seen_used || next->seen_used;
+    c->length += next->length;
+}
+
+typedef struct census_task {
+    const uint32_t *fat;
+    uint32_t begin;
+    uint32_t end;
+    fat_census census;
+} census_task;
+
+void *census_worker(void *arg){
+    census_task *task = (census_task *)arg;
+    census_range(task->fat, 0, task->begin, task->end, &task->census);
+    return NULL;
+}
+
+/**
+ * Counts free, reserved and allocated FAT entries, chains, links that jump and the largest free run in a single pass.
+ * 
+ * @param img The opened file system image.
+ * @param c The census to fill.
+ * 
+ * Large FATs are split in contiguous slices counted on separate threads, and the slices are merged in order.
+ * A FAT read in windows is streamed through a buffer instead, so it is never held in memory whole.
+ */
+void fat_census_of(fs_image *img, fat_census *c){
+    uint32_t block_count = img->sb.file_system_block_count;
+    uint64_t phase_start = stats_clock();
+    stats_add(&stats.fat_entries, block_count);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t thread_count = 1;
+    if (block_count >= CENSUS_THREAD_MIN_BLOCKS && cpus > 1) {
+        thread_count = cpus < CENSUS_MAX_THREADS ? (uint32_t)cpus : CENSUS_MAX_THREADS;
+    }
+    if (img->fat == NULL) {
+        // Stream the FAT through one buffer of all the windows, counting each piece as it arrives
+        uint32_t piece_entries = FAT_WINDOW_ENTRIES * FAT_WINDOWS;
+        uint32_t *piece = (uint32_t *)emalloc((size_t)piece_entries * sizeof(uint32_t));
+        off_t fat_offset = block_offset(img, img->sb.fat_start_block);
+        memset(c, 0, sizeof(fat_census));
+        for (uint64_t begin = 0; begin < block_count; begin += piece_entries) {
+            uint32_t end = block_count - begin > piece_entries ? (uint32_t)begin + piece_entries : block_count;
+            read_image(img, piece, (size_t)(end - begin) * sizeof(uint32_t), fat_offset + (off_t)begin * sizeof(uint32_t));
+            fat_census part;
+            census_range(piece, (uint32_t)begin, (uint32_t)begin, end, &part);
+            census_merge(c, &part);
+        }
+        free(piece);
+        stats_phase(PHASE_SCAN, phase_start);
+        return;
+    }
+    if (thread_count == 1) {
+        census_range(img->fat, 0, 0, block_count, c);
+        stats_phase(PHASE_SCAN, phase_start);
+        return;
+    }
+
+    census_task tasks[CENSUS_MAX_THREADS];
+    pthread_t threads[CENSUS_MAX_THREADS];
+    uint32_t slice = (block_count + thread_count - 1) / thread_count;
+    for (uint32_t t = 0; t < thread_count; t++) {
+        tasks[t].fat = img->fat;
+        tasks[t].begin = t * slice < block_count ? t * slice : block_count;
+        tasks[t].end = tasks[t].begin + slice < block_count ? tasks[t].begin + slice : block_count;
+        if (pthread_create(&threads[t], NULL, census_worker, &tasks[t]) != 0) {
+            census_worker(&tasks[t]);
+            threads[t] = 0;
+        }
+    }
+    for (uint32_t t = 0; t < thread_count; t++) {
+        if (threads[t] != 0) {
+            pthread_join(threads[t], NULL);
+        }
+        if (t == 0) {
+            *c = tasks[0].census;
+        }else{
+            census_merge(c, &tasks[t].census);
+        }
+    }
+    stats_phase(PHASE_SCAN, phase_start);
+}
+
+/**
+ * This function displays information about a file system image.
+ * 
+ * @param img The opened file system image.
+ *
+ * It then prints the metadata found in superblock.
+ * It also prints the FAT information, counted in one vectorized pass over the FAT.
+ */
+void diskinfo(fs_image *img){
+    super_block sb = img->sb;
+
+    fat_census census;
+    fat_census_of(img, &census);
+    uint32_t links = census.allocated_blocks - census.chains;
+
+    assert(census.free_blocks + census.reserved_blocks + census.allocated_blocks == sb.file_system_block_count);
+    printf("Super block information\n");
+    printf("Block size: %u\n", sb.block_size);
+    printf("Block Count: %u\n", sb.file_system_block_count);
+    printf("FAT starts: %u\n", sb.fat_start_block);
+    printf("FAT blocks: %u\n", sb.fat_block_count);
+    printf("Root directory starts: %u\n", sb.root_dir_start_block);
+    printf("Root directory blocks: %u\n", sb.root_dir_block_count);
+
+    printf("\nFAT information\n");
+    printf("Free blocks: %u\n", census.free_blocks);
+    printf("Reserved blocks: %u\n", census.reserved_blocks);
+    printf("Allocated blocks: %u\n", census.allocated_blocks);  
+    printf("Largest free run: %u\n", census.largest_free_run);
+    printf("Chains: %u\n", census.chains);
+    printf("Fragmentation: %.2f%%\n", links == 0 ? 0.0 : 100.0 * census.jumps / links);
+}
+
+/**
+ * Prints one line of a directory listing: its type, size, name and creation time.
+ * 
+ * @param entry The directory entry, in host byte order.
+ */
+void print_dir_entry(const dir_entry_t *entry){
+    if (entry->status == 5) {
+        printf("D ");
+    }
+    else {
+        printf("F ");
+    }
+    printf("%10u ", entry->size);
+    printf("%30s ", entry->filename);
+    printf("%4u/%02u/%02u %02u:%02u:%02u", entry->create_time.year, entry->create_time.month, entry->create_time.day, entry->create_time.hour, entry->create_time.minute, entry->create_time.second);
+    printf("\n");
+}
+
+/**
+ * Writes a whole buffer to a descriptor, a file, a pipe or a socket.
+ * 
+ * @return true if every byte was written, false otherwise.
+ */
+bool write_full(int fd, const void *buf, size_t len){
+    const uint8_t *src = (const uint8_t *)buf;
+    while (len > 0) {
+        ssize_t n = write(fd, src, len);
+        stats_syscall(&stats.bytes_written, n);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        src += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * Starts an output buffer on a descriptor.
+ * 
+ * @param out The buffer to initialize.
+ * @param fd The descriptor the buffer is flushed to.
+ */
+void out_init(out_buffer *out, int fd){
+    out->fd = fd;
+    out->capacity = OUT_BUFFER_SIZE;
+    out->data = (char *)emalloc(out->capacity);
+    out->length = 0;
+    out->lock = NULL;
+    out->held = false;
+    out->started = NULL;
+}
+
+/**
+ * Writes the buffered bytes out and empties the buffer, exits the program if the write fails.
+ * 
+ * A buffer sharing its descriptor takes the shared lock first and keeps it until out_release,
+ * so that a record split over several flushes is not interleaved with another thread's output.
+ * When the buffer holds elements of a shared JSON array, the ',' before the very first element is dropped.
+ */
+void out_flush(out_buffer *out){
+    if (out->length == 0) {
+        return;
+    }
+    if (out->lock != NULL && !out->held) {
+        pthread_mutex_lock(out->lock);
+        out->held = true;
+    }
+    const char *data = out->data;
+    size_t length = out->length;
+    if (out->started != NULL) {
+        if (!*out->started && data[0] == ',') {
+            data++;
+            length--;
+        }
+        *out->started = true;
+    }
+    if (!write_full(out->fd, data, length)) {
+        fprintf(stderr, "Error: Unable to write output\n");
+        exit(1);
+    }
+    out->length = 0;
+}
+
+/**
+ * Gives back the shared lock taken by out_flush.
+ */
+void out_release(out_buffer *out){
+    if (out->held) {
+        out->held = false;
+        pthread_mutex_unlock(out->lock);
+    }
+}
+
+/**
+ * Makes room for len bytes at the end of an output buffer, growing it if len is larger than the whole buffer.
+ * 
+ * @return char* Where the bytes go. The caller adds what it wrote to length.
+ */
+char *out_reserve(out_buffer *out, size_t len){
+    if (out->length + len > out->capacity) {
+        out_flush(out);
+    }
+    if (len > out->capacity) {
+        free(out->data);
+        out->capacity = len;
+        out->data = (char *)emalloc(out->capacity);
+    }
+    return out->data + out->length;
+}
+
+/**
+ * Appends len bytes to an output buffer.
+ */
+void out_bytes(out_buffer *out, const char *data, size_t len){
+    if (len > out->capacity) {
+        out_flush(out);
+        if (!write_full(out->fd, data, len)) {
+            fprintf(stderr, "Error: Unable to write output\n");
+            exit(1);
+        }
+        return;
+    }
+    memcpy(out_reserve(out, len), data, len);
+    out->length += len;
+}
+
+/**
+ * Flushes and releases an output buffer.
+ */
+void out_end(out_buffer *out){
+    out_flush(out);
+    out_release(out);
+    free(out->data);
+    out->data = NULL;
+}
+
+/**
+ * Writes an unsigned number in decimal, right-aligned in width characters like printf's "%*u".
+ * 
+ * @param dst Where the number goes.
+ * @param value The number.
+ * @param width The least number of characters written.
+ * @param pad The padding character, ' ' or '0'.
+ * @return char* The end of what was written.
+ */
+char *format_uint(char *dst, uint64_t value, int width, char pad){
+    char digits[20];
+    int count = 0;
+    do {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    while (width-- > count) {
+        *dst++ = pad;
+    }
+    while (count > 0) {
+        *dst++ = digits[--count];
+    }
+    return dst;
+}
+
+/**
+ * Writes a date and time as "YYYY/MM/DD HH:MM:SS", or "YYYY-MM-DDTHH:MM:SS" when iso is set.
+ * 
+ * @return char* The end of what was written.
+ */
+char *format_date(char *dst, const struct dir_entry_timedate_t *t, bool iso){
+    dst = format_uint(dst, t->year, 4, iso ? '0' : ' ');
+    *dst++ = iso ? '-' : '/';
+    dst = format_uint(dst, t->month, 2, '0');
+    *dst++ = iso ? '-' : '/';
+    dst = format_uint(dst, t->day, 2, '0');
+    *dst++ = iso ? 'T' : ' ';
+    dst = format_uint(dst, t->hour, 2, '0');
+    *dst++ = ':';
+    dst = format_uint(dst, t->minute, 2, '0');
+    *dst++ = ':';
+    dst = format_uint(dst, t->second, 2, '0');
+    return dst;
+}
+
+/**
+ * Returns the length of the well-formed UTF-8 sequence at the start of a byte string.
+ * 
+ * @param s The bytes, starting with a byte of 0x80 or more.
+ * @param length The number of bytes available.
+ * 
+ * Overlong forms, surrogates and code points past U+10FFFF are not well formed.
+ * 
+ * @return The length of the sequence, 2 to 4, or 0 if the bytes are not well-formed UTF-8.
+ */
+size_t utf8_sequence_length(const uint8_t *s, size_t length){
+    uint8_t c = s[0];
+    size_t n;
+    uint8_t low = 0x80;
+    uint8_t high = 0xBF;
+    if (c >= 0xC2 && c <= 0xDF) {
+        n = 2;
+    }else if (c >= 0xE0 && c <= 0xEF) {
+        n = 3;
+        low = c == 0xE0 ? 0xA0 : 0x80;
+        high = c == 0xED ? 0x9F : 0xBF;
+    }else if (c >= 0xF0 && c <= 0xF4) {
+        n = 4;
+        low = c == 0xF0 ? 0x90 : 0x80;
+        high = c == 0xF4 ? 0x8F : 0xBF;
+    }else{
+        return 0;
+    }
+    if (length < n || s[1] < low || s[1] > high) {
+        return 0;
+    }
+    for (size_t i = 2; i < n; i++) {
+        if (s[i] < 0x80 || s[i] > 0xBF) {
+            return 0;
+        }
+    }
+    return n;
+}
+
+/**
+ * Writes characters for the inside of a JSON string, escaping quotes, backslashes and control characters.
+ * 
+ * Names on disk carry no encoding, so well-formed UTF-8 is copied as it is and every other byte of 0x80 or more
+ * is written as \u00XX, which keeps the output valid JSON.
+ * 
+ * @return char* The end of what was written, at most 6 * length characters.
+ */
+char *format_json_chars(char *dst, const uint8_t *name, size_t length){
+    static const char hex[] = "0123456789abcdef";
+    for (size_t i = 0; i < length; i++) {
+        uint8_t c = name[i];
+        size_t sequence = c >= 0x80 ? utf8_sequence_length(name + i, length - i) : 0;
+        if (sequence > 0) {
+            memcpy(dst, name + i, sequence);
+            dst += sequence;
+            i += sequence - 1;
+        }else if (c == '"' || c == '\\') {
+            *dst++ = '\\';
+            *dst++ = (char)c;
+        }else if (c < 0x20 || c >= 0x80) {
+            memcpy(dst, "\\u00", 4);
+            dst[4] = hex[c >> 4];
+            dst[5] = hex[c & 15];
+            dst += 6;
+        }else{
+            *dst++ = (char)c;
+        }
+    }
+    return dst;
+}
+
+/**
+ * Writes a file name as a JSON string.
+ * 
+ * @return char* The end of what was written, at most 2 + 6 * length characters.
+ */
+char *format_json_string(char *dst, const uint8_t *name, size_t length){
+    *dst++ = '"';
+    dst = format_json_chars(dst, name, length);
+    *dst++ = '"';
+    return dst;
+}
+
+/**
+ * Writes the path of an entry, dir_path + '/' + name, without doubling the '/' of the root directory.
+ * 
+ * @return char* The end of what was written.
+ */
+char *format_entry_path(char *dst, const char *dir_path, size_t dir_path_length, const uint8_t *name, size_t name_length){
+    memcpy(dst, dir_path, dir_path_length);
+    dst += dir_path_length;
+    if (dir_path_length == 0 || dir_path[dir_path_length - 1] != '/') {
+        *dst++ = '/';
+    }
+    memcpy(dst, name, name_length);
+    return dst + name_length;
+}
+
+/**
+ * Adds one entry of a directory listing to an output buffer.
+ * 
+ * @param out The output buffer.
+ * @param entry The directory entry, in host byte order.
+ * @param format LIST_HUMAN, LIST_JSON or LIST_NUL.
+ * @param first Whether this is the first entry of the listing, for the JSON separators.
+ * @param dir_path The path of the directory holding the entry in a recursive listing, NULL otherwise.
+ * 
+ * LIST_HUMAN prints the same line as print_dir_entry. LIST_NUL prints the type, size, creation time and name
+ * separated by tabs and ended by a NUL byte, the name last so that it may hold any character.
+ * LIST_JSON prints one object per line inside a single array.
+ * In a recursive listing, LIST_NUL prints the full path instead of the name and LIST_JSON adds a "path" field.
+ */
+void format_dir_entry(out_buffer *out, const dir_entry_t *entry, int format, bool first, const char *dir_path){
+    size_t name_length = strnlen((const char *)entry->filename, sizeof(entry->filename));
+    size_t dir_path_length = dir_path != NULL ? strlen(dir_path) : 0;
+    char *start = out_reserve(out, 256 + 6 * (sizeof(entry->filename) + dir_path_length + 1));
+    char *dst = start;
+    if (format == LIST_JSON) {
+        if (!first) {
+            *dst++ = ',';
+        }
+        memcpy(dst, "\n{\"type\":\"", 10);
+        dst += 10;
+        memcpy(dst, entry->status == 5 ? "dir\"" : "file\"", entry->status == 5 ? 4 : 5);
+        dst += entry->status == 5 ? 4 : 5;
+        if (dir_path != NULL) {
+            memcpy(dst, ",\"path\":\"", 9);
+            dst = format_json_chars(dst + 9, (const uint8_t *)dir_path, dir_path_length);
+            if (dir_path_length == 0 || dir_path[dir_path_length - 1] != '/') {
+                *dst++ = '/';
+            }
+            dst = format_json_chars(dst, entry->filename, name_length);
+            *dst++ = '"';
+        }
+        memcpy(dst, ",\"name\":", 8);
+        dst = format_json_string(dst + 8, entry->filename, name_length);
+        memcpy(dst, ",\"size\":", 8);
+        dst = format_uint(dst + 8, entry->size, 0, ' ');
+        memcpy(dst, ",\"start_block\":", 15);
+        dst = format_uint(dst + 15, entry->start_block, 0, ' ');
+        memcpy(dst, ",\"block_count\":", 15);
+        dst = format_uint(dst + 15, entry->block_count, 0, ' ');
+        memcpy(dst, ",\"created\":\"", 12);
+        dst = format_date(dst + 12, &entry->create_time, true);
+        memcpy(dst, "\",\"modified\":\"", 14);
+        dst = format_date(dst + 14, &entry->modify_time, true);
+        memcpy(dst, "\"}", 2);
+        dst += 2;
+    }else if (format == LIST_NUL) {
+        *dst++ = entry->status == 5 ? 'D' : 'F';
+        *dst++ = '\t';
+        dst = format_uint(dst, entry->size, 0, ' ');
+        *dst++ = '\t';
+        dst = format_date(dst, &entry->create_time, false);
+        *dst++ = '\t';
+        if (dir_path != NULL) {
+            dst = format_entry_path(dst, dir_path, dir_path_length, entry->filename, name_length);
+        }else{
+            memcpy(dst, entry->filename, name_length);
+            dst += name_length;
+        }
+        *dst++ = '\0';
+    }else{
+        *dst++ = entry->status == 5 ? 'D' : 'F';
+        *dst++ = ' ';
+        dst = format_uint(dst, entry->size, 10, ' ');
+        *dst++ = ' ';
+        for (size_t i = name_length; i < 30; i++) {
+            *dst++ = ' ';
+        }
+        memcpy(dst, entry->filename, name_length);
+        dst += name_length;
+        *dst++ = ' ';
+        dst = format_date(dst, &entry->create_time, false);
+        *dst++ = '\n';
+    }
+    out->length += dst - start;
+}
+
+/**
+ * Orders directory entries by name.
+ */
+int compare_entry_name(const void *a, const void *b){
+    const dir_entry_t *x = (const dir_entry_t *)a;
+    const dir_entry_t *y = (const dir_entry_t *)b;
+    return strncmp((const char *)x->filename, (const char *)y->filename, sizeof(x->filename));
+}
+
+/**
+ * Orders directory entries by size, then by name.
+ */
+int compare_entry_size(const void *a, const void *b){
+    const dir_entry_t *x = (const dir_entry_t *)a;
+    const dir_entry_t *y = (const dir_entry_t *)b;
+    if (x->size != y->size) {
+        return x->size < y->size ? -1 : 1;
+    }
+    return compare_entry_name(a, b);
+}
+
+/**
+ * Packs a date and time into one number that orders like the date.
+ */
+uint64_t date_key(const struct dir_entry_timedate_t *t){
+    return ((uint64_t)t->year << 40) | ((uint64_t)t->month << 32) | ((uint64_t)t->day << 24) |
+           ((uint64_t)t->hour << 16) | ((uint64_t)t->minute << 8) | t->second;
+}
+
+/**
+ * Orders directory entries by modification time, then by name.
+ */
+int compare_entry_mtime(const void *a, const void *b){
+    uint64_t x = date_key(&((const dir_entry_t *)a)->modify_time);
+    uint64_t y = date_key(&((const dir_entry_t *)b)->modify_time);
+    if (x != y) {
+        return x < y ? -1 : 1;
+    }
+    return compare_entry_name(a, b);
+}
+
+/**
+ * This function lists the contents of a directory in a file system image.
+ * 
+ * @param img The opened file system image.
+ * @param subdir The path of the directory to list.
+ * @param format LIST_HUMAN, LIST_JSON or LIST_NUL.
+ * @param sort LIST_UNSORTED to print the entries in directory order, or LIST_BY_NAME, LIST_BY_SIZE or LIST_BY_MTIME.
+ * 
+ * If a directory path is provided, it finds the directory in the file system image.
+ * If no directory path is provided, it lists the contents of the root directory.
+ * The entries are formatted into one large output buffer that is written out whenever it fills up.
+ * Unsorted listings stream straight from the directory blocks; sorted ones gather the entries in one array first.
+ * 
+ * The function does not return a value.
+ */
+void disklist(fs_image *img, char *subdir, int format, int sort){
+    super_block sb = img->sb;
+    uint32_t current_block;
+    uint32_t blocks_count;
+    if (strncmp(subdir, "./", 2) == 0) {
+        subdir += 2;
+    }else if (strncmp(subdir, "/", 1) == 0){
+        subdir += 1;
+    }
+    uint64_t phase_start = stats_clock();
+    if (strlen(subdir) > 0){
+        if (!resolve_directory(img, subdir, &current_block, &blocks_count)){
+            printf("Directory not found.\n");
+            exit(1);
+        }
+    }else{
+        current_block = sb.root_dir_start_block;
+        blocks_count = sb.root_dir_block_count;
+    }
+    stats_phase(PHASE_LOOKUP, phase_start);
+
+    phase_start = stats_clock();
+    out_buffer out;
+    out_init(&out, STDOUT_FILENO);
+    if (format == LIST_JSON) {
+        out_bytes(&out, "[", 1);
+    }
+    dir_entry_t *entries = NULL;
+    uint32_t count = 0;
+    uint32_t capacity = 0;
+    dir_iter it;
+    dir_iter_init(&it, img, current_block, blocks_count);
+    while (dir_iter_next(&it)) {
+        for (uint32_t i = 0; i < it.entry_count; i++) {
+            if (it.entries[i].status == 0) {
+                continue;
+            }
+            dir_entry_t entry = it.entries[i];
+            decode_dir_entry(&entry);
+            if (sort == LIST_UNSORTED) {
+                format_dir_entry(&out, &entry, format, count++ == 0, NULL);
+                continue;
+            }
+            if (count == capacity) {
+                capacity = capacity == 0 ? 1024 : capacity * 2;
+                dir_entry_t *grown = (dir_entry_t *)realloc(entries, capacity * sizeof(dir_entry_t));
+                if (grown == NULL) {
+                    fprintf(stderr, "Error: Unable to allocate memory\n");
+                    exit(EXIT_FAILURE);
+                }
+                entries = grown;
+            }
+            entries[count++] = entry;
+        }
+    }
+    dir_iter_end(&it);
+
+    if (sort != LIST_UNSORTED) {
+        int (*compare)(const void *, const void *) = sort == LIST_BY_SIZE ? compare_entry_size :
+                                                     sort == LIST_BY_MTIME ? compare_entry_mtime : compare_entry_name;
+        qsort(entries, count, sizeof(dir_entry_t), compare);
+        for (uint32_t i = 0; i < count; i++) {
+            format_dir_entry(&out, &entries[i], format, i == 0, NULL);
+        }
+        free(entries);
+    }
+    if (format == LIST_JSON) {
+        out_bytes(&out, count > 0 ? "\n]\n" : "]\n", count > 0 ? 3 : 2);
+    }
+    out_end(&out);
+    stats_phase(PHASE_SCAN, phase_start);
+}
+
+/**
+ * Returns the node of a directory tree walk with the given index.
+ */
+tree_node *tree_node_at(tree_walk *walk, uint32_t index){
+    return &walk->chunks[index / TREE_CHUNK_NODES][index % TREE_CHUNK_NODES];
+}
+
+/**
+ * Adds a directory to a tree walk.
+ * 
+ * @param walk The tree walk.
+ * @param path The path of the directory, copied.
+ * @param parent The index of the parent node, the first node is its own parent.
+ * @param start_block The first block of the directory.
+ * @param block_count The number of blocks of the directory.
+ * 
+ * Nodes live in fixed-size chunks that never move, so threads can add nodes while others read theirs.
+ * 
+ * @return uint32_t The index of the new node.
+ */
+uint32_t tree_add_node(tree_walk *walk, const char *path, uint32_t parent, uint32_t start_block, uint32_t block_count){
+    uint32_t index = __atomic_fetch_add(&walk->node_count, 1, __ATOMIC_RELAXED);
+    tree_node **chunk = &walk->chunks[index / TREE_CHUNK_NODES];
+    if (__atomic_load_n(chunk, __ATOMIC_ACQUIRE) == NULL) {
+        tree_node *fresh = (tree_node *)calloc(TREE_CHUNK_NODES, sizeof(tree_node));
+        if (fresh == NULL) {
+            fprintf(stderr, "Error: Unable to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+        tree_node *expected = NULL;
+        if (!__atomic_compare_exchange_n(chunk, &expected, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            free(fresh);
+        }
+    }
+    tree_node *node = tree_node_at(walk, index);
+    node->path = strdup(path);
+    if (node->path == NULL) {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+    node->parent = parent;
+    node->start_block = start_block;
+    node->block_count = block_count;
+    return index;
+}
+
+/**
+ * Queues a directory on the deque of a worker.
+ */
+void tree_push(tree_deque *deque, uint32_t index){
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->capacity) {
+        // Reclaim the room left by stolen items before growing
+        memmove(deque->items, deque->items + deque->head, (deque->tail - deque->head) * sizeof(uint32_t));
+        deque->tail -= deque->head;
+        deque->head = 0;
+        if (deque->tail == deque->capacity) {
+            deque->capacity = deque->capacity == 0 ? 64 : deque->capacity * 2;
+            uint32_t *grown = (uint32_t *)realloc(deque->items, deque->capacity * sizeof(uint32_t));
+            if (grown == NULL) {
+                fprintf(stderr, "Error: Unable to allocate memory\n");
+                exit(EXIT_FAILURE);
+            }
+            deque->items = grown;
+        }
+    }
+    deque->items[deque->tail++] = index;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+/**
+ * Takes a directory from a deque: the newest one for its owner, the oldest one for a thief.
+ * 
+ * @return true if a directory was taken.
+ */
+bool tree_take(tree_deque *deque, bool steal, uint32_t *index){
+    pthread_mutex_lock(&deque->lock);
+    bool taken = deque->head < deque->tail;
+    if (taken) {
+        *index = steal ? deque->items[deque->head++] : deque->items[--deque->tail];
+    }
+    if (deque->head == deque->tail) {
+        deque->head = 0;
+        deque->tail = 0;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return taken;
+}
+
+/**
+ * Walks one directory of a tree walk: counts its files, queues its subdirectories and lists it.
+ * 
+ * @param worker The worker walking the directory.
+ * @param index The node of the directory.
+ * 
+ * Every directory block is claimed in the visited bitmap as it is walked. A subdirectory whose first block
+ * was already claimed is skipped, and a directory stops at the first block already claimed, so cycles and
+ * cross-linked directories in a corrupt image are walked once.
+ */
+void tree_walk_directory(tree_worker *worker, uint32_t index){
+    tree_walk *walk = worker->walk;
+    fs_image *img = walk->img;
+    tree_node *node = tree_node_at(walk, index);
+    uint32_t block_count = node->block_count;
+    if (block_count > img->sb.file_system_block_count) {
+        block_count = img->sb.file_system_block_count;
+    }
+    size_t path_length = strlen(node->path);
+    char *child_path = (char *)emalloc(path_length + sizeof(((dir_entry_t *)0)->filename) + 2);
+    uint32_t count = 0;
+    dir_iter it;
+    dir_iter_init(&it, img, node->start_block, block_count);
+    while (dir_iter_next(&it)) {
+        // The first block was claimed when the directory was queued
+        if (node->blocks > 0 &&
+            (__atomic_fetch_or(&walk->visited[it.block / 8], (uint8_t)(1 << (it.block % 8)), __ATOMIC_RELAXED) & (1 << (it.block % 8)))) {
+            break;
+        }
+        node->blocks++;
+        for (uint32_t i = 0; i < it.entry_count; i++) {
+            if (it.entries[i].status != 3 && it.entries[i].status != 5) {
+                continue;
+            }
+            dir_entry_t entry = it.entries[i];
+            decode_dir_entry(&entry);
+            if (count == worker->capacity) {
+                worker->capacity = worker->capacity == 0 ? 1024 : worker->capacity * 2;
+                dir_entry_t *grown = (dir_entry_t *)realloc(worker->entries, worker->capacity * sizeof(dir_entry_t));
+                if (grown == NULL) {
+                    fprintf(stderr, "Error: Unable to allocate memory\n");
+                    exit(EXIT_FAILURE);
+                }
+                worker->entries = grown;
+            }
+            worker->entries[count++] = entry;
+            if (entry.status == 3) {
+                node->files++;
+                node->bytes += entry.size;
+                node->blocks += entry.block_count;
+                continue;
+            }
+            uint32_t block = entry.start_block;
+            if (block >= img->sb.file_system_block_count ||
+                (__atomic_fetch_or(&walk->visited[block / 8], (uint8_t)(1 << (block % 8)), __ATOMIC_RELAXED) & (1 << (block % 8)))) {
+                continue;
+            }
+            size_t name_length = strnlen((const char *)entry.filename, sizeof(entry.filename));
+            *format_entry_path(child_path, node->path, path_length, entry.filename, name_length) = '\0';
+            uint32_t child = tree_add_node(walk, child_path, index, entry.start_block, entry.block_count);
+            __atomic_fetch_add(&walk->pending, 1, __ATOMIC_RELAXED);
+            tree_push(&walk->deques[worker->id], child);
+            __atomic_fetch_add(&walk->queued, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&walk->idle, __ATOMIC_SEQ_CST) > 0) {
+                pthread_mutex_lock(&walk->idle_lock);
+                pthread_cond_signal(&walk->work_cond);
+                pthread_mutex_unlock(&walk->idle_lock);
+            }
+        }
+    }
+    dir_iter_end(&it);
+    free(child_path);
+
+    if (walk->du) {
+        return;
+    }
+    if (walk->sort != LIST_UNSORTED) {
+        int (*compare)(const void *, const void *) = walk->sort == LIST_BY_SIZE ? compare_entry_size :
+                                                     walk->sort == LIST_BY_MTIME ? compare_entry_mtime : compare_entry_name;
+        qsort(worker->entries, count, sizeof(dir_entry_t), compare);
+    }
+    out_buffer *out = &worker->out;
+    if (walk->format == LIST_HUMAN) {
+        char *dst = out_reserve(out, path_length + 2);
+        memcpy(dst, node->path, path_length);
+        dst[path_length] = ':';
+        dst[path_length + 1] = '\n';
+        out->length += path_length + 2;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        format_dir_entry(out, &worker->entries[i], walk->format, false, walk->format == LIST_HUMAN ? NULL : node->path);
+    }
+    if (walk->format == LIST_HUMAN) {
+        out_bytes(out, "\n", 1);
+    }
+    // A directory goes out in one piece; small ones are batched until the buffer is half full
+    if (out->held || out->length >= out->capacity / 2) {
+        out_flush(out);
+        out_release(out);
+    }
+}
+
+/**
+ * Runs one worker of a tree walk until every directory has been walked.
+ * 
+ * The worker takes the newest directory of its own deque, which keeps the walk close to depth first,
+ * and steals the oldest directory of another worker when its deque is empty. When no deque has anything left
+ * but other workers are still walking, it sleeps until a directory is queued or the walk is over, so a narrow
+ * or deep tree keeps one core busy rather than all of them.
+ */
+void *tree_worker_main(void *arg){
+    tree_worker *worker = (tree_worker *)arg;
+    tree_walk *walk = worker->walk;
+    while (true) {
+        uint32_t index;
+        bool found = tree_take(&walk->deques[worker->id], false, &index);
+        for (uint32_t w = 1; !found && w < walk->worker_count; w++) {
+            found = tree_take(&walk->deques[(worker->id + w) % walk->worker_count], true, &index);
+        }
+        if (found) {
+            __atomic_fetch_sub(&walk->queued, 1, __ATOMIC_SEQ_CST);
+            tree_walk_directory(worker, index);
+            if (__atomic_fetch_sub(&walk->pending, 1, __ATOMIC_SEQ_CST) == 1) {
+                pthread_mutex_lock(&walk->idle_lock);
+                pthread_cond_broadcast(&walk->work_cond);
+                pthread_mutex_unlock(&walk->idle_lock);
+            }
+            continue;
+        }
+        // Announcing the sleep before looking again pairs with the pushers, which count a directory before they
+        // look for sleepers, so a directory queued in between is either seen here or wakes this worker
+        pthread_mutex_lock(&walk->idle_lock);
+        __atomic_fetch_add(&walk->idle, 1, __ATOMIC_SEQ_CST);
+        bool done = __atomic_load_n(&walk->pending, __ATOMIC_SEQ_CST) == 0;
+        if (!done && __atomic_load_n(&walk->queued, __ATOMIC_SEQ_CST) == 0) {
+            pthread_cond_wait(&walk->work_cond, &walk->idle_lock);
+        }
+        __atomic_fetch_sub(&walk->idle, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&walk->idle_lock);
+        if (done) {
+            break;
+        }
+    }
+    out_flush(&worker->out);
+    out_release(&worker->out);
+    return NULL;
+}
+
+/**
+ * Orders tree nodes by path.
+ */
+int compare_tree_path(const void *a, const void *b){
+    return strcmp((*(tree_node *const *)a)->path, (*(tree_node *const *)b)->path);
+}
+
+/**
+ * Prints the usage of every directory of a walked tree, subdirectories included, sorted by path.
+ * 
+ * @param walk The finished tree walk.
+ * 
+ * LIST_HUMAN prints the bytes, files and blocks of every directory and its path, LIST_NUL the same fields
+ * separated by tabs and ended by a NUL byte, and LIST_JSON one object per directory with both its own counts
+ * and the totals of its subtree.
+ */
+void tree_print_usage(tree_walk *walk){
+    uint32_t node_count = walk->node_count;
+    // A child is always added after its parent, so one backward pass adds every subtree into its parent
+    for (uint32_t i = 0; i < node_count; i++) {
+        tree_node *node = tree_node_at(walk, i);
+        node->total_files = node->files;
+        node->total_bytes = node->bytes;
+        node->total_blocks = node->blocks;
+    }
+    for (uint32_t i = node_count; i-- > 1;) {
+        tree_node *node = tree_node_at(walk, i);
+        tree_node *parent = tree_node_at(walk, node->parent);
+        parent->total_files += node->total_files;
+        parent->total_bytes += node->total_bytes;
+        parent->total_blocks += node->total_blocks;
+    }
+    tree_node **order = (tree_node **)emalloc((node_count + 1) * sizeof(tree_node *));
+    for (uint32_t i = 0; i < node_count; i++) {
+        order[i] = tree_node_at(walk, i);
+    }
+    qsort(order, node_count, sizeof(tree_node *), compare_tree_path);
+
+    out_buffer out;
+    out_init(&out, STDOUT_FILENO);
+    if (walk->format == LIST_HUMAN) {
+        out_bytes(&out, "       Bytes      Files     Blocks  Directory\n", 46);
+    }else if (walk->format == LIST_JSON) {
+        out_bytes(&out, "[", 1);
+    }
+    for (uint32_t i = 0; i < node_count; i++) {
+        tree_node *node = order[i];
+        size_t path_length = strlen(node->path);
+        char *start = out_reserve(&out, 256 + 6 * path_length);
+        char *dst = start;
+        if (walk->format == LIST_JSON) {
+            memcpy(dst, i == 0 ? "\n{\"path\":\"" : ",\n{\"path\":\"", i == 0 ? 10 : 11);
+            dst = format_json_chars(dst + (i == 0 ? 10 : 11), (const uint8_t *)node->path, path_length);
+            memcpy(dst, "\",\"files\":", 10);
+            dst = format_uint(dst + 10, node->files, 0, ' ');
+            memcpy(dst, ",\"bytes\":", 9);
+            dst = format_uint(dst + 9, node->bytes, 0, ' ');
+            memcpy(dst, ",\"blocks\":", 10);
+            dst = format_uint(dst + 10, node->blocks, 0, ' ');
+            memcpy(dst, ",\"total_files\":", 15);
+            dst = format_uint(dst + 15, node->total_files, 0, ' ');
+            memcpy(dst, ",\"total_bytes\":", 15);
+            dst = format_uint(dst + 15, node->total_bytes, 0, ' ');
+            memcpy(dst, ",\"total_blocks\":", 16);
+            dst = format_uint(dst + 16, node->total_blocks, 0, ' ');
+            *dst++ = '}';
+        }else{
+            char separator = walk->format == LIST_NUL ? '\t' : ' ';
+            dst = format_uint(dst, node->total_bytes, walk->format == LIST_NUL ? 0 : 12, ' ');
+            *dst++ = separator;
+            dst = format_uint(dst, node->total_files, walk->format == LIST_NUL ? 0 : 10, ' ');
+            *dst++ = separator;
+            dst = format_uint(dst, node->total_blocks, walk->format == LIST_NUL ? 0 : 10, ' ');
+            *dst++ = separator;
+            if (walk->format == LIST_HUMAN) {
+                *dst++ = ' ';
+            }
+            memcpy(dst, node->path, path_length);
+            dst += path_length;
+            *dst++ = walk->format == LIST_NUL ? '\0' : '\n';
+        }
+        out.length += dst - start;
+    }
+    if (walk->format == LIST_JSON) {
+        out_bytes(&out, node_count > 0 ? "\n]\n" : "]\n", node_count > 0 ? 3 : 2);
+    }
+    out_end(&out);
+    free(order);
+}
+
+/**
+ * Lists a whole directory tree of a file system image, or prints its disk usage.
+ * 
+ * @param img The opened file system image.
+ * @param subdir The path of the directory at the top of the tree.
+ * @param format LIST_HUMAN, LIST_JSON or LIST_NUL.
+ * @param sort The order of the entries within each directory, as for disklist.
+ * @param du Print the usage summary of tree_print_usage instead of the entries.
+ * 
+ * The directories are walked by a pool of threads sharing the image mapping and its FAT read-only.
+ * Each directory is listed as soon as it is walked, so the order of the directories depends on the threads,
+ * while the entries of one directory always come out together.
+ */
+void disklist_tree(fs_image *img, char *subdir, int format, int sort, bool du){
+    uint32_t start_block;
+    uint32_t block_count;
+    char *path = normalize_path(subdir);
+    uint64_t phase_start = stats_clock();
+    if (!resolve_directory(img, path, &start_block, &block_count)) {
+        printf("Directory not found.\n");
+        exit(1);
+    }
+    stats_phase(PHASE_LOOKUP, phase_start);
+
+    phase_start = stats_clock();
+    tree_walk walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.img = img;
+    walk.format = format;
+    walk.sort = sort;
+    walk.du = du;
+    walk.chunks = (tree_node **)calloc(img->sb.file_system_block_count / TREE_CHUNK_NODES + 2, sizeof(tree_node *));
+    walk.visited = (uint8_t *)calloc(img->sb.file_system_block_count / 8 + 1, 1);
+    if (walk.chunks == NULL || walk.visited == NULL) {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&walk.out_lock, NULL);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    walk.worker_count = cpus <= 1 ? 1 : (cpus < TREE_MAX_THREADS ? (uint32_t)cpus : TREE_MAX_THREADS);
+    walk.deques = (tree_deque *)calloc(walk.worker_count, sizeof(tree_deque));
+    tree_worker *workers = (tree_worker *)calloc(walk.worker_count, sizeof(tree_worker));
+    if (walk.deques == NULL || workers == NULL) {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Every node path starts with '/', the top of the tree included
+    char *top = (char *)emalloc(strlen(path) + 2);
+    sprintf(top, "/%s", path);
+    free(path);
+    if (start_block < img->sb.file_system_block_count) {
+        walk.visited[start_block / 8] |= 1 << (start_block % 8);
+    }
+    uint32_t root = tree_add_node(&walk, top, 0, start_block, block_count);
+    free(top);
+    walk.pending = 1;
+    walk.queued = 1;
+    pthread_mutex_init(&walk.idle_lock, NULL);
+    pthread_cond_init(&walk.work_cond, NULL);
+    for (uint32_t w = 0; w < walk.worker_count; w++) {
+        pthread_mutex_init(&walk.deques[w].lock, NULL);
+        workers[w].walk = &walk;
+        workers[w].id = w;
+        out_init(&workers[w].out, STDOUT_FILENO);
+        workers[w].out.lock = &walk.out_lock;
+        workers[w].out.started = format == LIST_JSON ? &walk.out_started : NULL;
+    }
+    tree_push(&walk.deques[0], root);
+
+    if (!du && format == LIST_JSON) {
+        write_full(STDOUT_FILENO, "[", 1);
+    }
+    pthread_t threads[TREE_MAX_THREADS];
+    for (uint32_t w = 1; w < walk.worker_count; w++) {
+        if (pthread_create(&threads[w], NULL, tree_worker_main, &workers[w]) != 0) {
+            threads[w] = 0;
+        }
+    }
+    tree_worker_main(&workers[0]);
+    for (uint32_t w = 1; w < walk.worker_count; w++) {
+        if (threads[w] != 0) {
+            pthread_join(threads[w], NULL);
+        }
+    }
+    if (du) {
+        tree_print_usage(&walk);
+    }else if (format == LIST_JSON) {
+        write_full(STDOUT_FILENO, walk.out_started ? "\n]\n" : "]\n", walk.out_started ? 3 : 2);
+    }
+
+    for (uint32_t w = 0; w < walk.worker_count; w++) {
+        out_end(&workers[w].out);
+        free(workers[w].entries);
+        free(walk.deques[w].items);
+        pthread_mutex_destroy(&walk.deques[w].lock);
+    }
+    for (uint32_t i = 0; i < walk.node_count; i++) {
+        free(tree_node_at(&walk, i)->path);
+    }
+    for (uint32_t c = 0; c * TREE_CHUNK_NODES < walk.node_count; c++) {
+        free(walk.chunks[c]);
+    }
+    pthread_mutex_destroy(&walk.out_lock);
+    pthread_mutex_destroy(&walk.idle_lock);
+    pthread_cond_destroy(&walk.work_cond);
+    free(walk.chunks);
+    free(walk.visited);
+    free(walk.deques);
+    free(workers);
+    stats_phase(PHASE_SCAN, phase_start);
+}
+
+/**
+ * Returns the number of blocks a file of the given size takes, an empty file still has one block.
+ */
+uint32_t fsck_file_blocks(uint32_t size, uint16_t block_size){
+    return size == 0 ? 1 : (uint32_t)(((uint64_t)size + block_size - 1) / block_size);
+}
+
+/**
+ * Checks whether block is one of the first count blocks of the chain starting at start_block.
+ * 
+ * The count blocks must already have been walked, so every link followed is known to be good.
+ */
+bool fsck_chain_contains(fs_image *img, uint32_t start_block, uint32_t count, uint32_t block){
+    uint32_t current_block = start_block;
+    for (uint32_t i = 0; i < count; i++) {
+        if (current_block == block) {
+            return true;
+        }
+        current_block = fat_next(img, current_block);
+    }
+    return false;
+}
+
+/**
+ * Adds an entry to check.
+ * 
+ * @param st The checker state.
+ * @param path The path of the entry, copied.
+ * @param offset The offset of the directory entry in the image, -1 for the root directory.
+ * @param entry The entry, in host byte order.
+ */
+void fsck_add_entry(fsck_state *st, const char *path, off_t offset, const dir_entry_t *entry){
+    if (st->entry_count == st->capacity) {
+        st->capacity = st->capacity == 0 ? 1024 : st->capacity * 2;
+        fsck_entry *grown = (fsck_entry *)realloc(st->entries, st->capacity * sizeof(fsck_entry));
+        if (grown == NULL) {
+            fprintf(stderr, "Error: Unable to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+        st->entries = grown;
+    }
+    fsck_entry *e = &st->entries[st->entry_count++];
+    memset(e, 0, sizeof(fsck_entry));
+    e->path = strdup(path);
+    if (e->path == NULL) {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+    e->offset = offset;
+    e->entry = *entry;
+    e->last_block = 0xFFFFFFFF;
+    e->owner = 0xFFFFFFFF;
+    e->owner_last_block = 0xFFFFFFFF;
+}
+
+/**
+ * Follows the chain of an entry and claims its blocks in the visited bitmap.
+ * 
+ * @param st The checker state.
+ * @param e The entry.
+ * 
+ * The walk stops at the end of the chain or at the first broken link: a block outside the image, a free or
+ * reserved block, or a block already claimed. A claimed block is part of a cycle if this chain walked it
+ * before and cross-linked otherwise. Each block is claimed once by the whole check, so every chain together
+ * costs one pass over the blocks in use whatever the image looks like.
+ */
+void fsck_walk_chain(fsck_state *st, fsck_entry *e){
+    fs_image *img = st->img;
+    uint32_t block = e->entry.start_block;
+    while (true) {
+        if (block >= img->sb.file_system_block_count) {
+            e->chain = FSCK_OUT_OF_RANGE;
+            break;
+        }
+        uint32_t next = fat_next(img, block);
+        if (next == 0) {
+            e->chain = FSCK_FREE_BLOCK;
+            break;
+        }
+        if (next == 1) {
+            e->chain = FSCK_RESERVED_BLOCK;
+            break;
+        }
+        uint64_t bit = 1ULL << (block % 64);
+        if (__atomic_fetch_or(&st->claimed[block / 64], bit, __ATOMIC_RELAXED) & bit) {
+            e->chain = fsck_chain_contains(img, e->entry.start_block, e->blocks, block) ? FSCK_CYCLE : FSCK_CROSS_LINK;
+            break;
+        }
+        e->blocks++;
+        e->last_block = block;
+        if (next == 0xFFFFFFFF) {
+            return;
+        }
+        block = next;
+    }
+    e->bad_block = block;
+}
+
+/**
+ * Walks the directory tree from the root directory, checking the chain of every directory and adding
+ * every used entry to the checker state.
+ * 
+ * @param st The checker state, holding the root directory.
+ * 
+ * Directories are walked in the order they were added, so the tree is walked breadth first on this thread
+ * and directory blocks are claimed before any file chain. Only the blocks of a directory before its first
+ * broken link are read.
+ */
+void fsck_walk_directories(fsck_state *st){
+    fs_image *img = st->img;
+    for (uint32_t d = 0; d < st->entry_count; d++) {
+        if (st->entries[d].entry.status != 5) {
+            continue;
+        }
+        fsck_walk_chain(st, &st->entries[d]);
+        st->entries[d].first_child = st->entry_count;
+        // The entries may move while children are added
+        fsck_entry dir = st->entries[d];
+        size_t path_length = strlen(dir.path);
+        char *child_path = (char *)emalloc(path_length + sizeof(dir.entry.filename) + 2);
+        dir_iter it;
+        dir_iter_init(&it, img, dir.entry.start_block, dir.blocks);
+        while (dir_iter_next(&it)) {
+            for (uint32_t i = 0; i < it.entry_count; i++) {
+                if (it.entries[i].status == 0) {
+                    continue;
+                }
+                dir_entry_t entry = it.entries[i];
+                decode_dir_entry(&entry);
+                size_t name_length = strnlen((const char *)entry.filename, sizeof(entry.filename));
+                *format_entry_path(child_path, dir.path, path_length, entry.filename, name_length) = '\0';
+                fsck_add_entry(st, child_path, dir_iter_entry_offset(&it, i), &entry);
+            }
+        }
+        dir_iter_end(&it);
+        free(child_path);
+        st->entries[d].child_count = st->entry_count - st->entries[d].first_child;
+    }
+}
+
+/**
+ * Checks the chains of files, FSCK_JOB_ENTRIES entries at a time, until every entry has been handed out.
+ */
+void *fsck_worker(void *arg){
+    fsck_state *st = (fsck_state *)arg;
+    while (true) {
+        uint32_t first = __atomic_fetch_add(&st->next, FSCK_JOB_ENTRIES, __ATOMIC_RELAXED);
+        if (first >= st->entry_count) {
+            break;
+        }
+        uint32_t last = st->entry_count - first < FSCK_JOB_ENTRIES ? st->entry_count : first + FSCK_JOB_ENTRIES;
+        for (uint32_t i = first; i < last; i++) {
+            if (st->entries[i].entry.status == 3) {
+                fsck_walk_chain(st, &st->entries[i]);
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Orders block indices.
+ */
+int compare_block(const void *a, const void *b){
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : (x > y);
+}
+
+/**
+ * Finds, for every cross-linked chain, the entry that claimed the block it ran into and where that block is
+ * in the owner's chain.
+ * 
+ * @param st The checker state, after every chain has been walked.
+ * 
+ * Only runs when there are cross-links. The shared blocks are marked in a second bitmap and the good part
+ * of every chain is walked again, so the cost is one more pass over the blocks in use.
+ */
+void fsck_find_owners(fsck_state *st){
+    fs_image *img = st->img;
+    uint32_t shared_count = 0;
+    for (uint32_t i = 0; i < st->entry_count; i++) {
+        shared_count += st->entries[i].chain == FSCK_CROSS_LINK;
+    }
+    if (shared_count == 0) {
+        return;
+    }
+    uint64_t *shared = (uint64_t *)calloc(img->sb.file_system_block_count / 64 + 1, sizeof(uint64_t));
+    uint32_t *blocks = (uint32_t *)emalloc(shared_count * sizeof(uint32_t));
+    uint32_t *owners = (uint32_t *)emalloc(shared_count * sizeof(uint32_t));
+    uint32_t *positions = (uint32_t *)emalloc(shared_count * sizeof(uint32_t));
+    uint32_t *previous = (uint32_t *)emalloc(shared_count * sizeof(uint32_t));
+    if (shared == NULL) {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+    shared_count = 0;
+    for (uint32_t i = 0; i < st->entry_count; i++) {
+        uint32_t block = st->entries[i].bad_block;
+        if (st->entries[i].chain == FSCK_CROSS_LINK && (shared[block / 64] & (1ULL << (block % 64))) == 0) {
+            shared[block / 64] |= 1ULL << (block % 64);
+            blocks[shared_count++] = block;
+        }
+    }
+    qsort(blocks, shared_count, sizeof(uint32_t), compare_block);
+
+    for (uint32_t i = 0; i < st->entry_count; i++) {
+        uint32_t block = st->entries[i].entry.start_block;
+        uint32_t before = 0xFFFFFFFF;
+        for (uint32_t walked = 0; walked < st->entries[i].blocks; walked++) {
+            if (shared[block / 64] & (1ULL << (block % 64))) {
+                uint32_t *found = (uint32_t *)bsearch(&block, blocks, shared_count, sizeof(uint32_t), compare_block);
+                owners[found - blocks] = i;
+                positions[found - blocks] = walked;
+                previous[found - blocks] = before;
+            }
+            before = block;
+            block = fat_next(img, block);
+        }
+    }
+    for (uint32_t i = 0; i < st->entry_count; i++) {
+        if (st->entries[i].chain == FSCK_CROSS_LINK) {
+            uint32_t *found = (uint32_t *)bsearch(&st->entries[i].bad_block, blocks, shared_count, sizeof(uint32_t), compare_block);
+            st->entries[i].owner = owners[found - blocks];
+            st->entries[i].owner_blocks = positions[found - blocks];
+            st->entries[i].owner_last_block = previous[found - blocks];
+        }
+    }
+    free(shared);
+    free(blocks);
+    free(owners);
+    free(positions);
+    free(previous);
+}
+
+/**
+ * Returns the number of blocks the chain of an entry should have: what the size of a file needs, or the
+ * block_count of a directory.
+ */
+uint32_t fsck_expected_blocks(fsck_state *st, const fsck_entry *e){
+    return e->entry.status == 3 ? fsck_file_blocks(e->entry.size, st->img->sb.block_size) : e->entry.block_count;
+}
+
+/**
+ * Decides which entry the blocks shared by two cross-linked chains belong to, whichever chain was walked first.
+ * 
+ * @param st The checker state, after fsck_find_owners.
+ * 
+ * A cross-linked chain runs into a block of the owner's chain and shares the rest of it. Those blocks stay with
+ * the owner when its chain has the length its entry expects (see fsck_expected_blocks) and the other chain
+ * would not with them. When it is the other way around they move to the other entry, and the owner becomes the
+ * chain that is cross-linked, so repair cuts the owner instead. When both or neither would match, or the owner's
+ * chain is broken itself, both entries are marked unresolved and are reported but not repaired.
+ * Runs on one thread after every chain has been walked, so the outcome does not depend on the order the checker
+ * threads claimed the blocks in.
+ */
+void fsck_resolve_cross_links(fsck_state *st){
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < st->entry_count; i++) {
+        count += st->entries[i].chain == FSCK_CROSS_LINK;
+    }
+    if (count == 0) {
+        return;
+    }
+    uint32_t *linked = (uint32_t *)emalloc(count * sizeof(uint32_t));
+    count = 0;
+    for (uint32_t i = 0; i < st->entry_count; i++) {
+        if (st->entries[i].chain == FSCK_CROSS_LINK) {
+            linked[count++] = i;
+        }
+    }
+    for (uint32_t k = 0; k < count; k++) {
+        uint32_t index = linked[k];
+        fsck_entry *e = &st->entries[index];
+        if (e->chain != FSCK_CROSS_LINK || e->owner >= st->entry_count) {
+            continue;
+        }
+        uint32_t owner_index = e->owner;
+        fsck_entry *owner = &st->entries[owner_index];
+        uint32_t tail = owner->blocks - e->owner_blocks;
+        bool owner_matches = owner->chain == FSCK_CHAIN_OK && owner->blocks == fsck_expected_blocks(st, owner);
+        bool entry_matches = owner->chain == FSCK_CHAIN_OK && e->blocks + tail == fsck_expected_blocks(st, e);
+        if (owner_matches && !entry_matches) {
+            continue;
+        }
+        if (owner_matches == entry_matches) {
+            e->unresolved = true;
+            owner->unresolved = true;
+            continue;
+        }
+
+        // Other chains that ran into the blocks that move now run into this entry's chain
+        for (uint32_t j = 0; j < count; j++) {
+            fsck_entry *other = &st->entries[linked[j]];
+            if (other != e && other->chain == FSCK_CROSS_LINK && other->owner == owner_index &&
+                other->owner_blocks >= e->owner_blocks) {
+                if (other->owner_blocks == e->owner_blocks) {
+                    other->owner_last_block = e->last_block;
+                }
+                other->owner = index;
+                other->owner_blocks = e->blocks + other->owner_blocks - e->owner_blocks;
+            }
+        }
+        uint32_t blocks = e->blocks;
+        uint32_t last_block = e->last_block;
+        e->blocks = blocks + tail;
+        e->last_block = owner->last_block;
+        e->chain = FSCK_CHAIN_OK;
+        e->owner = 0xFFFFFFFF;
+        owner->chain = FSCK_CROSS_LINK;
+        owner->bad_block = e->bad_block;
+        owner->blocks = e->owner_blocks;
+        owner->last_block = e->owner_last_block;
+        owner->owner = index;
+        owner->owner_blocks = blocks;
+        owner->owner_last_block = last_block;
+    }
+    free(linked);
+}
+
+/**
+ * Prints the problems of one checked entry.
+ * 
+ * @param st The checker state.
+ * @param e The entry.
+ * 
+ * A broken chain is reported on its own. Otherwise the block_count of the entry, and the size of a file,
+ * are compared with the length of the chain.
+ * 
+ * @return uint32_t The number of problems printed.
+ */
+uint32_t fsck_report(fsck_state *st, fsck_entry *e){
+    const dir_entry_t *entry = &e->entry;
+    if (entry->status != 3 && entry->status != 5) {
+        printf("%s: unknown status %u\n", e->path, entry->status);
+        return 1;
+    }
+    const char *link = e->blocks == 0 ? "starts at" : "links to";
+    switch (e->chain) {
+        case FSCK_OUT_OF_RANGE:
+            printf("%s: chain %s block %u, outside the image\n", e->path, link, e->bad_block);
+            return 1;
+        case FSCK_FREE_BLOCK:
+            printf("%s: chain %s free block %u\n", e->path, link, e->bad_block);
+            return 1;
+        case FSCK_RESERVED_BLOCK:
+            printf("%s: chain %s reserved block %u\n", e->path, link, e->bad_block);
+            return 1;
+        case FSCK_CYCLE:
+            printf("%s: chain loops back to block %u\n", e->path, e->bad_block);
+            return 1;
+        case FSCK_CROSS_LINK:
+            printf("%s: chain %s block %u, also used by %s%s\n", e->path, link, e->bad_block,
+                   e->owner < st->entry_count ? st->entries[e->owner].path : "another chain",
+                   e->unresolved ? ", owner unknown, left as is" : "");
+            return 1;
+    }
+    uint32_t problems = 0;
+    if (entry->block_count != e->blocks) {
+        printf("%s: block_count is %u but the chain has %u blocks\n", e->path, entry->block_count, e->blocks);
+        problems++;
+    }
+    if (entry->status == 3 && fsck_file_blocks(entry->size, st->img->sb.block_size) != e->blocks) {
+        printf("%s: size is %u bytes but the chain has %u blocks\n", e->path, entry->size, e->blocks);
+        problems++;
+    }
+    return problems;
+}
+
+/**
+ * Repairs the problems of one checked entry in a writable image.
+ * 
+ * @param st The checker state.
+ * @param e The entry, with at least one problem.
+ * 
+ * An entry with an unknown status or a chain broken at its first block is removed. Any other broken chain
+ * ends at its last good block. The blocks of a file past what its size needs are freed, a size larger than
+ * the chain holds is cut down, and block_count is set to the length of the chain.
+ * Entries that share blocks with another chain without either being the owner (see fsck_resolve_cross_links)
+ * are not touched.
+ * 
+ * @return true if the entry was repaired, false for an unresolved entry or a root directory that cannot be.
+ */
+bool fsck_repair(fsck_state *st, fsck_entry *e){
+    fs_image *img = st->img;
+    uint16_t block_size = img->sb.block_size;
+    dir_entry_t entry = e->entry;
+    if (e->unresolved) {
+        return false;
+    }
+    if ((entry.status != 3 && entry.status != 5) || (e->chain != FSCK_CHAIN_OK && e->blocks == 0)) {
+        if (e->offset < 0) {
+            return false;
+        }
+        encode_dir_entry(&entry);
+        entry.status = 0;
+        stage_dir_entry(img, e->offset, &entry);
+        return true;
+    }
+    if (e->chain != FSCK_CHAIN_OK) {
+        fat_set(img, e->last_block, 0xFFFFFFFF);
+    }
+    if (entry.status == 3) {
+        uint32_t needed = fsck_file_blocks(entry.size, block_size);
+        if (e->blocks > needed) {
+            uint32_t block = entry.start_block;
+            for (uint32_t i = 1; i < needed; i++) {
+                block = fat_next(img, block);
+            }
+            uint32_t next = fat_next(img, block);
+            fat_set(img, block, 0xFFFFFFFF);
+            for (uint32_t i = needed; i < e->blocks; i++) {
+                uint32_t after = fat_next(img, next);
+                fat_set(img, next, 0);
+                next = after;
+            }
+            e->blocks = needed;
+        }
+        if ((uint64_t)entry.size > (uint64_t)e->blocks * block_size) {
+            entry.size = e->blocks * block_size;
+        }
+    }
+    entry.block_count = e->blocks;
+    if (e->offset < 0) {
+        img->sb.root_dir_block_count = entry.block_count;
+        img->root_dirty = true;
+        return true;
+    }
+    encode_dir_entry(&entry);
+    stage_dir_entry(img, e->offset, &entry);
+    return true;
+}
+
+/**
+ * Walks every chain of an image once, claiming its blocks in the visited bitmap of the checker state.
+ * 
+ * @param img The opened file system image.
+ * @param st The checker state to fill, released with fsck_free.
+ * 
+ * The directory tree is walked first, then the chains of all files are walked on one thread per core,
+ * and finally the owners of cross-linked blocks are looked up and settled. Nothing is printed.
+ */
+void fsck_walk_image(fs_image *img, fsck_state *st){
+    super_block sb = img->sb;
+    uint64_t phase_start = stats_clock();
+    memset(st, 0, sizeof(fsck_state));
+    st->img = img;
+    st->claimed = (uint64_t *)calloc(sb.file_system_block_count / 64 + 1, sizeof(uint64_t));
+    if (st->claimed == NULL) {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+    dir_entry_t root;
+    memset(&root, 0, sizeof(root));
+    root.status = 5;
+    root.start_block = sb.root_dir_start_block;
+    root.block_count = sb.root_dir_block_count;
+    fsck_add_entry(st, "/", -1, &root);
+    fsck_walk_directories(st);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t thread_count = 1;
+    if (st->entry_count > FSCK_JOB_ENTRIES && cpus > 1) {
+        thread_count = cpus < FSCK_MAX_THREADS ? (uint32_t)cpus : FSCK_MAX_THREADS;
+    }
+    pthread_t threads[FSCK_MAX_THREADS];
+    for (uint32_t t = 1; t < thread_count; t++) {
+        if (pthread_create(&threads[t], NULL, fsck_worker, st) != 0) {
+            threads[t] = 0;
+        }
+    }
+    fsck_worker(st);
+    for (uint32_t t = 1; t < thread_count; t++) {
+        if (threads[t] != 0) {
+            pthread_join(threads[t], NULL);
+        }
+    }
+    fsck_find_owners(st);
+    fsck_resolve_cross_links(st);
+    stats_phase(PHASE_SCAN, phase_start);
+}
+
+/**
+ * Releases the entries and the bitmap of a checker state.
+ */
+void fsck_free(fsck_state *st){
+    for (uint32_t i = 0; i < st->entry_count; i++) {
+        free(st->entries[i].path);
+    }
+    free(st->entries);
+    free(st->claimed);
+}
+
+/**
+ * This function checks the consistency of a file system image, and optionally repairs it.
+ * 
+ * @param img The opened file system image, opened for writing when repair is set.
+ * @param repair Whether to fix the problems found.
+ * 
+ * Every chain claims its blocks in a visited bitmap, which finds cross-linked blocks, cycles, links to free,
+ * reserved or missing blocks, and afterwards the allocated blocks no chain reached. block_count and size are
+ * compared with the chains as walked. The FAT is read once, and besides the entries themselves the check only
+ * needs one bit per block.
+ * Repairs end broken chains at their last good block, remove entries that cannot be followed at all, free the
+ * orphaned blocks and fix block_count and size, then write the FAT blocks and entries changed back at once.
+ * 
+ * @return true if the image is consistent, or was made consistent.
+ */
+bool diskfsck(fs_image *img, bool repair){
+    super_block sb = img->sb;
+    fsck_state st;
+    fsck_walk_image(img, &st);
+
+    uint32_t problems = 0;
+    uint32_t fixed = 0;
+    uint32_t directories = 0;
+    uint32_t files = 0;
+    uint64_t used = 0;
+    for (uint32_t i = 0; i < st.entry_count; i++) {
+        fsck_entry *e = &st.entries[i];
+        directories += e->entry.status == 5;
+        files += e->entry.status == 3;
+        used += e->blocks;
+        uint32_t found = fsck_report(&st, e);
+        problems += found;
+        if (found > 0 && repair && fsck_repair(&st, e)) {
+            fixed += found;
+        }
+    }
+
+    // Allocated blocks that no chain claimed, reported as runs
+    uint32_t orphans = 0;
+    uint32_t run_length = 0;
+    for (uint32_t block = 0; block <= sb.file_system_block_count; block++) {
+        if (block < sb.file_system_block_count && fat_next(img, block) > 1 &&
+            (st.claimed[block / 64] & (1ULL << (block % 64))) == 0) {
+            if (repair) {
+                fat_set(img, block, 0);
+            }
+            run_length++;
+            continue;
+        }
+        if (run_length == 0) {
+            continue;
+        }
+        if (run_length == 1) {
+            printf("Orphaned block %u\n", block - 1);
+        }else{
+            printf("Orphaned blocks %u-%u\n", block - run_length, block - 1);
+        }
+        orphans += run_length;
+        problems++;
+        fixed += repair;
+        run_length = 0;
+    }
+
+    if (fixed > 0) {
+        flush_metadata(img);
+    }
+    printf("%u directories, %u files, %llu blocks in chains, %u orphaned blocks\n", directories, files,
+           (unsigned long long)used, orphans);
+    if (problems == 0) {
+        printf("No problems found.\n");
+    }else if (repair) {
+        printf("%u problems found, %u fixed.\n", problems, fixed);
+    }else{
+        printf("%u problems found.\n", problems);
+    }
+    fsck_free(&st);
+    return problems == fixed;
+}
+
+/**
+ * Checks that every entry walked by fsck_walk_image has a known status and an intact chain,
+ * and that every allocated block belongs to one of those chains.
+ */
+bool fsck_chains_intact(fsck_state *st){
+    for (uint32_t i = 0; i < st->entry_count; i++) {
+        uint8_t status = st->entries[i].entry.status;
+        if ((status != 3 && status != 5) || st->entries[i].chain != FSCK_CHAIN_OK) {
+            return false;
+        }
+    }
+    for (uint32_t block = 0; block < st->img->sb.file_system_block_count; block++) {
+        if (fat_next(st->img, block) > 1 && (st->claimed[block / 64] & (1ULL << (block % 64))) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Returns the first block at or after block that is not reserved, where the new layout may put data.
+ */
+uint32_t defrag_next_slot(fs_image *img, uint32_t block){
+    while (block < img->sb.file_system_block_count && fat_next(img, block) == 1) {
+        block++;
+    }
+    return block;
+}
+
+/**
+ * Moves a run of blocks to its place in the new layout.
+ * 
+ * @param ds The defragmenter state.
+ * @param dest The first position of the run in the new layout.
+ * @param src The current position of the run, usually after dest.
+ * @param length The number of blocks of the run.
+ * 
+ * Everything before dest is already in place, except the slack slots the layout skipped in front of reserved
+ * blocks, where a block of a later chain may still sit. The data at [dest, dest + length) that is not part of the
+ * run itself moves into the positions the run leaves: a rotation of [dest, src + length) when the run starts
+ * inside that range, otherwise a plain swap of the two ranges. A run below dest always comes from skipped slots,
+ * which end at a reserved block, so it never overlaps [dest, dest + length) and is swapped. Either way it takes
+ * one or two large reads and writes, and the displaced data is only read when some of it belongs to a chain.
+ */
+void defrag_move(defrag_state *ds, uint32_t dest, uint32_t src, uint32_t length){
+    fs_image *img = ds->img;
+    size_t block_size = img->sb.block_size;
+    uint32_t displaced_count = (src > dest && src - dest < length) ? src - dest : length;
+    uint32_t displaced_to = src + length - displaced_count;
+    bool keep_displaced = false;
+    for (uint32_t k = 0; k < displaced_count && !keep_displaced; k++) {
+        uint32_t block = ds->occupant[dest + k];
+        keep_displaced = (ds->used[block / 64] & (1ULL << (block % 64))) != 0;
+    }
+
+    uint8_t *run = ds->buffer + (size_t)displaced_count * block_size;
+    size_t run_bytes = (size_t)length * block_size;
+    size_t displaced_bytes = (size_t)displaced_count * block_size;
+    if (keep_displaced && dest + displaced_count == src) {
+        // Overlapping ranges, read [dest, src + length) at once
+        if (!ds->dry_run) {
+            read_image(img, ds->buffer, displaced_bytes + run_bytes, block_offset(img, dest));
+        }
+        ds->io_calls++;
+        ds->bytes_read += displaced_bytes + run_bytes;
+    }else{
+        if (!ds->dry_run) {
+            read_image(img, run, run_bytes, block_offset(img, src));
+            if (keep_displaced) {
+                read_image(img, ds->buffer, displaced_bytes, block_offset(img, dest));
+            }
+        }
+        ds->io_calls += keep_displaced ? 2 : 1;
+        ds->bytes_read += run_bytes + (keep_displaced ? displaced_bytes : 0);
+    }
+    if (!ds->dry_run) {
+        write_image(img, run, run_bytes, block_offset(img, dest));
+        if (keep_displaced) {
+            write_image(img, ds->buffer, displaced_bytes, block_offset(img, displaced_to));
+        }
+    }
+    ds->io_calls += keep_displaced ? 2 : 1;
+    ds->bytes_written += run_bytes + (keep_displaced ? displaced_bytes : 0);
+    ds->blocks_moved += length;
+
+    // When the ranges overlap, position dest + k is only overwritten after src + k has been read
+    memcpy(ds->displaced, ds->occupant + dest, displaced_count * sizeof(uint32_t));
+    for (uint32_t k = 0; k < length; k++) {
+        uint32_t block = ds->occupant[src + k];
+        ds->occupant[dest + k] = block;
+        ds->where[block] = dest + k;
+    }
+    for (uint32_t k = 0; k < displaced_count; k++) {
+        ds->occupant[displaced_to + k] = ds->displaced[k];
+        ds->where[ds->displaced[k]] = displaced_to + k;
+    }
+}
+
+/**
+ * This function rewrites a file system image so that every chain is contiguous.
+ * 
+ * @param img The opened file system image, opened for writing unless dry_run is set.
+ * @param dry_run Whether to only print the plan and the I/O it would take.
+ * 
+ * The image is first checked like diskfsck does, and left alone unless it is consistent. The new layout takes the
+ * tree depth first: every directory, then its files, then its subdirectories, packed from the first block that is
+ * not reserved. A chain that would straddle reserved blocks starts after them while there are free blocks to spare.
+ * The blocks are then moved in the order of the new layout in runs of up to MAX_IO_SIZE bytes, each
+ * run going to its final place in one pass, and the FAT, the directory entries and the root directory start in the
+ * super block are rewritten at the end.
+ * The fragmentation before and after is measured like diskinfo does, as the share of links that jump.
+ */
+void diskdefrag(fs_image *img, bool dry_run){
+    super_block sb = img->sb;
+    fsck_state st;
+    fsck_walk_image(img, &st);
+    if (!fsck_chains_intact(&st)) {
+        fprintf(stderr, "Error: %s is not consistent, repair it with diskfsck -r first\n", img->path);
+        exit(1);
+    }
+
+    // Depth first: a directory, its files, then each of its subdirectories in turn
+    uint32_t *order = (uint32_t *)emalloc(st.entry_count * sizeof(uint32_t));
+    uint32_t *stack = (uint32_t *)emalloc(st.entry_count * sizeof(uint32_t));
+    uint32_t order_count = 0;
+    uint32_t stack_count = 0;
+    stack[stack_count++] = 0;
+    while (stack_count > 0) {
+        fsck_entry *dir = &st.entries[stack[--stack_count]];
+        order[order_count++] = (uint32_t)(dir - st.entries);
+        for (uint32_t i = dir->first_child; i < dir->first_child + dir->child_count; i++) {
+            if (st.entries[i].entry.status == 3) {
+                order[order_count++] = i;
+            }
+        }
+        for (uint32_t i = dir->first_child + dir->child_count; i-- > dir->first_child;) {
+            if (st.entries[i].entry.status == 5) {
+                stack[stack_count++] = i;
+            }
+        }
+    }
+    free(stack);
+
+    defrag_state ds;
+    memset(&ds, 0, sizeof(ds));
+    ds.img = img;
+    ds.used = st.claimed;
+    ds.dry_run = dry_run;
+    ds.max_run = MAX_IO_SIZE / sb.block_size;
+    ds.where = (uint32_t *)emalloc((size_t)sb.file_system_block_count * sizeof(uint32_t));
+    ds.occupant = (uint32_t *)emalloc((size_t)sb.file_system_block_count * sizeof(uint32_t));
+    ds.displaced = (uint32_t *)emalloc(ds.max_run * sizeof(uint32_t));
+    ds.buffer = dry_run ? NULL : (uint8_t *)emalloc(2 * (size_t)ds.max_run * sb.block_size);
+    for (uint32_t block = 0; block < sb.file_system_block_count; block++) {
+        ds.where[block] = block;
+        ds.occupant[block] = block;
+    }
+
+    uint64_t links = 0;
+    uint64_t jumps_before = 0;
+    uint64_t jumps_after = 0;
+    uint32_t fragmented_before = 0;
+    uint32_t fragmented_after = 0;
+    uint32_t slot = defrag_next_slot(img, 0);
+    // Slots the layout may leave empty, so that a chain need not straddle reserved blocks
+    uint64_t slack = 0;
+    for (uint32_t block = slot; block < sb.file_system_block_count; block++) {
+        slack += fat_next(img, block) != 1 && (st.claimed[block / 64] & (1ULL << (block % 64))) == 0;
+    }
+    uint64_t phase_start = stats_clock();
+    uint32_t run_dest = 0;
+    uint32_t run_src = 0;
+    uint32_t run_length = 0;
+    for (uint32_t o = 0; o < order_count; o++) {
+        fsck_entry *e = &st.entries[order[o]];
+        uint32_t fit = slot;
+        while (fit < sb.file_system_block_count && fit - slot < e->blocks) {
+            if (fat_next(img, fit) != 1) {
+                fit++;
+                continue;
+            }
+            uint32_t after = defrag_next_slot(img, fit);
+            if (fit - slot > slack) {
+                break;
+            }
+            slack -= fit - slot;
+            slot = after;
+            fit = after;
+        }
+        uint32_t block = e->entry.start_block;
+        uint32_t new_start = slot;
+        uint32_t previous_slot = slot;
+        uint32_t extents_before = 1;
+        uint32_t extents_after = 1;
+        for (uint32_t k = 0; k < e->blocks; k++) {
+            slot = defrag_next_slot(img, slot);
+            uint32_t next = fat_next(img, block);
+            if (k + 1 < e->blocks && next != block + 1) {
+                extents_before++;
+            }
+            if (k > 0 && slot != previous_slot + 1) {
+                extents_after++;
+            }
+            if (run_length > 0 && run_length < ds.max_run && slot == run_dest + run_length &&
+                ds.where[block] == run_src + run_length) {
+                run_length++;
+            }else{
+                if (run_length > 0) {
+                    defrag_move(&ds, run_dest, run_src, run_length);
+                }
+                run_length = 0;
+                if (ds.where[block] != slot) {
+                    run_dest = slot;
+                    run_src = ds.where[block];
+                    run_length = 1;
+                }
+            }
+            previous_slot = slot;
+            slot++;
+            block = next;
+        }
+        links += e->blocks - 1;
+        jumps_before += extents_before - 1;
+        jumps_after += extents_after - 1;
+        fragmented_before += extents_before > 1;
+        fragmented_after += extents_after > 1;
+        if (dry_run) {
+            printf("%s: %u blocks in %u extents at %u -> %u-%u\n", e->path, e->blocks, extents_before,
+                   e->entry.start_block, new_start, previous_slot);
+        }
+    }
+    if (run_length > 0) {
+        defrag_move(&ds, run_dest, run_src, run_length);
+    }
+    stats_phase(PHASE_DATA_COPY, phase_start);
+
+    if (!dry_run) {
+        // Every chain now starts where its first block went and runs over the following free slots
+        for (uint32_t block = 0; block < sb.file_system_block_count; block++) {
+            if (fat_next(img, block) != 1) {
+                fat_set(img, block, 0);
+            }
+        }
+        for (uint32_t o = 0; o < order_count; o++) {
+            fsck_entry *e = &st.entries[order[o]];
+            uint32_t current_slot = ds.where[e->entry.start_block];
+            for (uint32_t k = 0; k < e->blocks; k++) {
+                uint32_t next_slot = defrag_next_slot(img, current_slot + 1);
+                fat_set(img, current_slot, k + 1 < e->blocks ? next_slot : 0xFFFFFFFF);
+                current_slot = next_slot;
+            }
+            dir_entry_t entry = e->entry;
+            entry.start_block = ds.where[e->entry.start_block];
+            if (e->offset < 0) {
+                img->sb.root_dir_start_block = entry.start_block;
+                img->root_dirty = true;
+                continue;
+            }
+            // The entry moved along with its directory block
+            off_t offset = block_offset(img, ds.where[e->offset / sb.block_size]) + e->offset % sb.block_size;
+            encode_dir_entry(&entry);
+            stage_dir_entry(img, offset, &entry);
+        }
+        flush_metadata(img);
+    }
+
+    printf("Before: %.2f%% of links jump, %u of %u chains fragmented\n", links == 0 ? 0.0 : 100.0 * jumps_before / links,
+           fragmented_before, order_count);
+    printf("After: %.2f%% of links jump, %u of %u chains fragmented\n", links == 0 ? 0.0 : 100.0 * jumps_after / links,
+           fragmented_after, order_count);
+    printf("%s%llu blocks moved, %llu bytes read and %llu bytes written in %llu calls\n", dry_run ? "Estimated: " : "",
+           (unsigned long long)ds.blocks_moved, (unsigned long long)ds.bytes_read,
+           (unsigned long long)ds.bytes_written, (unsigned long long)ds.io_calls);
+
+    free(order);
+    free(ds.where);
+    free(ds.occupant);
+    free(ds.displaced);
+    free(ds.buffer);
+    fsck_free(&st);
+}
+
+/**
+ * Turns the chain starting at start_block into a list of contiguous extents.
+ * 
+ * @param img The opened file system image.
+ * @param start_block The first block of the chain.
+ * @param max_blocks The largest number of blocks to follow.
+ * @param extent_count Set to the number of extents found.
+ * 
+ * The walk stops at the end of the chain, after max_blocks blocks, or at a block outside the image.
+ * 
+ * @return extent* The extents in chain order, to be freed by the caller.
+ */
+extent *chain_extents(fs_image *img, uint32_t start_block, uint32_t max_blocks, uint32_t *extent_count){
+    uint32_t capacity = 16;
+    uint32_t count = 0;
+    extent *extents = (extent *)emalloc(capacity * sizeof(extent));
+    uint32_t current_block = start_block;
+    uint32_t walked = 0;
+    while (current_block < img->sb.file_system_block_count && walked < max_blocks) {
+        if (count > 0 && extents[count - 1].start + extents[count - 1].length == current_block) {
+            extents[count - 1].length++;
+        }else{
+            if (count == capacity) {
+                capacity *= 2;
+                extent *grown = (extent *)realloc(extents, capacity * sizeof(extent));
+                if (grown == NULL) {
+                    fprintf(stderr, "Error: Unable to allocate memory\n");
+                    exit(EXIT_FAILURE);
+                }
+                extents = grown;
+            }
+            extents[count].start = current_block;
+            extents[count].length = 1;
+            count++;
+        }
+        walked++;
+        current_block = fat_next(img, current_block);
+    }
+    *extent_count = count;
+    return extents;
+}
+
+/**
+ * Builds the extent index of a chain: its extents and the file block at which each one starts.
+ * 
+ * @param img The opened file system image.
+ * @param index The index to fill, its previous arrays already released.
+ * @param start_block The first block of the chain.
+ * @param max_blocks The largest number of blocks to follow, the file's block count.
+ */
+void chain_index_build(fs_image *img, chain_index *index, uint32_t start_block, uint32_t max_blocks){
+    index->start_block = start_block;
+    index->max_blocks = max_blocks;
+    index->fat_generation = img->fat_generation;
+    index->extents = chain_extents(img, start_block, max_blocks, &index->extent_count);
+    index->first_blocks = (uint32_t *)emalloc((index->extent_count + 1) * sizeof(uint32_t));
+    uint32_t file_block = 0;
+    for (uint32_t e = 0; e < index->extent_count; e++) {
+        index->first_blocks[e] = file_block;
+        file_block += index->extents[e].length;
+    }
+}
+
+/**
+ * Finds the extent of an index that holds a block of the file.
+ * 
+ * @return The position of the last extent starting at or before file_block, by binary search.
+ */
+uint32_t chain_index_find(const chain_index *index, uint32_t file_block){
+    uint32_t low = 0;
+    uint32_t high = index->extent_count;
+    while (high - low > 1) {
+        uint32_t middle = low + (high - low) / 2;
+        if (index->first_blocks[middle] <= file_block) {
+            low = middle;
+        }else{
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/**
+ * Turns a byte range of a file into the segments of the image that hold it.
+ * 
+ * @param img The opened file system image.
+ * @param start_block The first block of the file.
+ * @param size The size of the file.
+ * @param offset The first byte of the range.
+ * @param length The length of the range, cut at the end of the file.
+ * @param segment_count Set to the number of segments.
+ * 
+ * Each segment has the image descriptor as its source, the offset in the image and the offset in the range as
+ * its destination, and dest_fd set to -1. A whole file is mapped with a single walk of its chain. A partial range
+ * goes through the extent index of the chain instead, kept in a small per-image cache, so that the block it
+ * starts in is found by binary search and only the first range read of a file walks its chain. A cached index is
+ * rebuilt once the FAT has changed.
+ * A broken chain maps fewer bytes than asked for.
+ * 
+ * @return io_segment* The segments in range order, to be freed by the caller. NULL for an empty range.
+ */
+io_segment *map_file_range(fs_image *img, uint32_t start_block, uint32_t size, uint64_t offset, uint64_t length,
+                           uint32_t *segment_count){
+    *segment_count = 0;
+    if (offset >= size || length == 0) {
+        return NULL;
+    }
+    if (length > size - offset) {
+        length = size - offset;
+    }
+    uint32_t block_size = img->sb.block_size;
+    uint32_t max_blocks = (uint32_t)(((uint64_t)size + block_size - 1) / block_size);
+    chain_index whole;
+    chain_index *index = &whole;
+    bool cached = offset > 0 || length < size;
+    if (cached) {
+        pthread_mutex_lock(&img->chain_lock);
+        if (img->chain_cache == NULL) {
+            img->chain_cache = (chain_index *)calloc(CHAIN_CACHE_SIZE, sizeof(chain_index));
+            if (img->chain_cache == NULL) {
+                fprintf(stderr, "Error: Unable to allocate memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        index = &img->chain_cache[start_block % CHAIN_CACHE_SIZE];
+        if (index->extents != NULL && index->start_block == start_block && index->max_blocks == max_blocks &&
+            index->fat_generation == img->fat_generation) {
+            stats_add(&stats.index_hits, 1);
+        }else{
+            stats_add(&stats.index_misses, 1);
+            free(index->extents);
+            free(index->first_blocks);
+            chain_index_build(img, index, start_block, max_blocks);
+        }
+    }else{
+        chain_index_build(img, index, start_block, max_blocks);
+    }
+
+    uint32_t first = chain_index_find(index, (uint32_t)(offset / block_size));
+    io_segment *segments = (io_segment *)emalloc((index->extent_count - first + 1) * sizeof(io_segment));
+    uint64_t position = offset;
+    uint64_t end = offset + length;
+    for (uint32_t e = first; e < index->extent_count && position < end; e++) {
+        uint64_t extent_start = (uint64_t)index->first_blocks[e] * block_size;
+        uint64_t extent_end = extent_start + (uint64_t)index->extents[e].length * block_size;
+        if (extent_end <= position) {
+            continue;
+        }
+        uint64_t segment_end = extent_end < end ? extent_end : end;
+        io_segment *segment = &segments[(*segment_count)++];
+        segment->src_fd = img->fd;
+        segment->dest_fd = -1;
+        segment->src_offset = block_offset(img, index->extents[e].start) + (off_t)(position - extent_start);
+        segment->dest_offset = (off_t)(position - offset);
+        segment->length = segment_end - position;
+        segment->tag = 0;
+        position = segment_end;
+    }
+
+    if (cached) {
+        pthread_mutex_unlock(&img->chain_lock);
+    }else{
+        free(whole.extents);
+        free(whole.first_blocks);
+    }
+    return segments;
+}
+
+/**
+ * Releases the ring and the buffers of an I/O engine.
+ */
+void io_engine_free(io_engine *io){
+    if (io->buffers != NULL) {
+        munmap(io->buffers, (size_t)io->depth * IO_CHUNK_SIZE);
+    }
+    if (io->sqes != NULL) {
+        munmap(io->sqes, io->sqes_size);
+    }
+    if (io->cq_ring != NULL && io->cq_ring != io->sq_ring) {
+        munmap(io->cq_ring, io->cq_ring_size);
+    }
+    if (io->sq_ring != NULL) {
+        munmap(io->sq_ring, io->sq_ring_size);
+    }
+    if (io->ring_fd >= 0) {
+        close(io->ring_fd);
+    }
+    free(io->slots);
+    free(io->free_slots);
+    memset(io, 0, sizeof(io_engine));
+    io->kind = IO_PSYNC;
+    io->ring_fd = -1;
+}
+
+#ifdef HAVE_IO_URING
+/**
+ * Asks the kernel whether the io_uring of an engine supports the plain (unregistered) reads and writes.
+ * 
+ * @return true if IORING_OP_READ and IORING_OP_WRITE are supported. Kernels older than the probe (before 5.6) have
+ *         neither, so a failed probe is a no.
+ */
+bool uring_supports_plain_io(io_engine *io){
+    uint32_t op_count = 256;
+    struct io_uring_probe *probe = (struct io_uring_probe *)calloc(1, sizeof(struct io_uring_probe) +
+                                                                      op_count * sizeof(struct io_uring_probe_op));
+    if (probe == NULL) {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+    bool supported = false;
+    if (syscall(__NR_io_uring_register, io->ring_fd, IORING_REGISTER_PROBE, probe, op_count) == 0) {
+        supported = probe->ops_len > IORING_OP_READ && probe->ops_len > IORING_OP_WRITE &&
+                    (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) != 0 &&
+                    (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED) != 0;
+    }
+    free(probe);
+    return supported;
+}
+#endif
+
+/**
+ * Sets up the io_uring of an engine: the rings, depth chunk buffers and, if the kernel allows it, their registration.
+ * 
+ * The registered buffers are used with IORING_OP_READ_FIXED and IORING_OP_WRITE_FIXED, which every io_uring has.
+ * When they cannot be registered (too little locked memory, see RLIMIT_MEMLOCK) the plain reads and writes are
+ * needed instead, and a kernel that does not have them (before 5.6) gets no ring at all, so the callers keep
+ * their blocking copies rather than fail on every request.
+ * 
+ * @return true if the ring is ready, false if io_uring is not available or cannot copy.
+ */
+bool uring_setup(io_engine *io){
+#ifdef HAVE_IO_URING
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    io->ring_fd = (int)syscall(__NR_io_uring_setup, io->depth, &params);
+    if (io->ring_fd < 0) {
+        return false;
+    }
+    io->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    io->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_map = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_map && io->cq_ring_size > io->sq_ring_size) {
+        io->sq_ring_size = io->cq_ring_size;
+    }
+    void *sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        return false;
+    }
+    io->sq_ring = (uint8_t *)sq_ring;
+    io->cq_ring = io->sq_ring;
+    if (!single_map) {
+        void *cq_ring = mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            io->cq_ring = NULL;
+            return false;
+        }
+        io->cq_ring = (uint8_t *)cq_ring;
+    }
+    io->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        return false;
+    }
+    io->sqes = sqes;
+    io->sq_tail = (uint32_t *)(io->sq_ring + params.sq_off.tail);
+    io->sq_mask = (uint32_t *)(io->sq_ring + params.sq_off.ring_mask);
+    io->sq_array = (uint32_t *)(io->sq_ring + params.sq_off.array);
+    io->cq_head = (uint32_t *)(io->cq_ring + params.cq_off.head);
+    io->cq_tail = (uint32_t *)(io->cq_ring + params.cq_off.tail);
+    io->cq_mask = (uint32_t *)(io->cq_ring + params.cq_off.ring_mask);
+    io->cqes = io->cq_ring + params.cq_off.cqes;
+
+    void *buffers = mmap(NULL, (size_t)io->depth * IO_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers == MAP_FAILED) {
+        return false;
+    }
+    io->buffers = (uint8_t *)buffers;
+    // Registered buffers are pinned once instead of on every request, which needs enough locked memory
+    struct iovec *iov = (struct iovec *)emalloc(io->depth * sizeof(struct iovec));
+    for (uint32_t s = 0; s < io->depth; s++) {
+        iov[s].iov_base = io->buffers + (size_t)s * IO_CHUNK_SIZE;
+        iov[s].iov_len = IO_CHUNK_SIZE;
+    }
+    io->fixed = syscall(__NR_io_uring_register, io->ring_fd, IORING_REGISTER_BUFFERS, iov, io->depth) == 0;
+    free(iov);
+    return io->fixed || uring_supports_plain_io(io);
+#else
+    return false;
+#endif
+}
+
+/**
+ * Prepares an I/O engine for one thread.
+ * 
+ * @param io The engine to initialize.
+ * 
+ * FSIMG_IO=uring selects io_uring, with FSIMG_IO_DEPTH chunks in flight (IO_DEFAULT_DEPTH by default).
+ * Otherwise, or when the kernel has no io_uring, the engine is IO_PSYNC and the callers keep their blocking copies.
+ */
+void io_engine_init(io_engine *io){
+    memset(io, 0, sizeof(io_engine));
+    io->kind = IO_PSYNC;
+    io->ring_fd = -1;
+    const char *kind = getenv("FSIMG_IO");
+    if (kind == NULL || strcmp(kind, "uring") != 0) {
+        return;
+    }
+    const char *depth = getenv("FSIMG_IO_DEPTH");
+    io->depth = depth != NULL ? (uint32_t)atoi(depth) : IO_DEFAULT_DEPTH;
+    if (io->depth == 0 || io->depth > IO_MAX_DEPTH) {
+        io->depth = IO_DEFAULT_DEPTH;
+    }
+    if (!uring_setup(io)) {
+        io_engine_free(io);
+        return;
+    }
+    io->slots = (io_slot *)emalloc(io->depth * sizeof(io_slot));
+    io->free_slots = (uint32_t *)emalloc(io->depth * sizeof(uint32_t));
+    io->kind = IO_URING;
+}
+
+#ifdef HAVE_IO_URING
+/**
+ * Queues the next read or write of a slot on the submission ring.
+ * 
+ * @param io The engine.
+ * @param s The slot. A read fills its buffer from the source of the chunk, a write empties it into the destination,
+ *          both from where the previous partial transfer stopped.
+ */
+void uring_queue(io_engine *io, uint32_t s){
+    io_slot *slot = &io->slots[s];
+    uint32_t tail = *io->sq_tail;
+    uint32_t index = tail & *io->sq_mask;
+    struct io_uring_sqe *sqe = &((struct io_uring_sqe *)io->sqes)[index];
+    memset(sqe, 0, sizeof(*sqe));
+    if (slot->writing) {
+        sqe->opcode = io->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->fd = slot->segment->dest_fd;
+        sqe->off = slot->segment->dest_offset + slot->offset + slot->done;
+    }else{
+        sqe->opcode = io->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->fd = slot->segment->src_fd;
+        sqe->off = slot->segment->src_offset + slot->offset + slot->done;
+    }
+    sqe->addr = (uint64_t)(uintptr_t)(io->buffers + (size_t)s * IO_CHUNK_SIZE + slot->done);
+    sqe->len = (uint32_t)(slot->length - slot->done);
+    sqe->buf_index = (uint16_t)s;
+    sqe->user_data = s;
+    io->sq_array[index] = index;
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    io->to_submit++;
+}
+#endif
+
+/**
+ * Copies segments between descriptors through the io_uring of an engine.
+ * 
+ * @param io The engine, of kind IO_URING.
+ * @param segments The segments to copy, each from a source descriptor and offset to a destination descriptor and offset.
+ * @param segment_count The number of segments.
+ * 
+ * The segments are cut in chunks of IO_CHUNK_SIZE bytes. Each chunk is read into a free buffer and written out of it
+ * as soon as the read completes, with up to depth chunks in flight. Everything queued between two waits goes to the
+ * kernel in a single io_uring_enter, which also waits for the next completion. Short transfers are resubmitted.
+ * 
+ * @return true if every byte was copied. Otherwise failed points to the first segment that could not be read
+ *         (a source ending early included) or, when failed_write is set, written.
+ */
+bool uring_copy(io_engine *io, const io_segment *segments, uint32_t segment_count){
+#ifdef HAVE_IO_URING
+    uint32_t free_count = io->depth;
+    for (uint32_t s = 0; s < io->depth; s++) {
+        io->free_slots[s] = io->depth - 1 - s;
+    }
+    io->failed = NULL;
+    io->failed_write = false;
+    uint32_t next_segment = 0;
+    size_t segment_done = 0;
+    uint32_t in_flight = 0;
+    while (true) {
+        while (io->failed == NULL && free_count > 0 && next_segment < segment_count) {
+            const io_segment *segment = &segments[next_segment];
+            if (segment_done == segment->length) {
+                next_segment++;
+                segment_done = 0;
+                continue;
+            }
+            uint32_t s = io->free_slots[--free_count];
+            io_slot *slot = &io->slots[s];
+            slot->segment = segment;
+            slot->offset = segment_done;
+            slot->length = segment->length - segment_done < IO_CHUNK_SIZE ? segment->length - segment_done : IO_CHUNK_SIZE;
+            slot->done = 0;
+            slot->writing = false;
+            segment_done += slot->length;
+            uring_queue(io, s);
+            in_flight++;
+        }
+        if (in_flight == 0) {
+            break;
+        }
+        int submitted = (int)syscall(__NR_io_uring_enter, io->ring_fd, io->to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        stats_syscall(NULL, 0);
+        if (submitted < 0 && errno != EINTR) {
+            // The ring cannot be trusted with the buffers any more
+            if (io->failed == NULL) {
+                io->failed = segments;
+            }
+            io->kind = IO_PSYNC;
+            return false;
+        }
+        if (submitted > 0) {
+            io->to_submit -= (uint32_t)submitted;
+        }
+
+        uint32_t head = *io->cq_head;
+        while (head != __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &((struct io_uring_cqe *)io->cqes)[head & *io->cq_mask];
+            uint32_t s = (uint32_t)cqe->user_data;
+            int res = cqe->res;
+            head++;
+            io_slot *slot = &io->slots[s];
+            if (res == -EINTR || res == -EAGAIN) {
+                uring_queue(io, s);
+                continue;
+            }
+            if (res <= 0 && io->failed == NULL) {
+                io->failed = slot->segment;
+                io->failed_write = slot->writing;
+            }
+            if (res <= 0 || io->failed != NULL) {
+                io->free_slots[free_count++] = s;
+                in_flight--;
+                continue;
+            }
+            stats_add(slot->writing ? &stats.bytes_written : &stats.bytes_read, res);
+            if (!slot->writing && slot->done == 0) {
+                stats_seek(slot->segment->src_offset + slot->offset, slot->length);
+            }
+            slot->done += res;
+            if (slot->done < slot->length) {
+                uring_queue(io, s);
+            }else if (!slot->writing) {
+                slot->writing = true;
+                slot->done = 0;
+                uring_queue(io, s);
+            }else{
+                io->free_slots[free_count++] = s;
+                in_flight--;
+            }
+        }
+        __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return io->failed == NULL;
+#else
+    (void)segments;
+    (void)segment_count;
+    io->failed = NULL;
+    return false;
+#endif
+}
+
+/**
+ * Copies len bytes at offset src_offset of the image to offset dest_offset of a host file.
+ * 
+ * @param img The opened file system image.
+ * @param dest_fd The destination descriptor.
+ * @param src_offset The offset in the image to copy from.
+ * @param dest_offset The offset in the destination to copy to, or -1 to append to a pipe or socket.
+ * @param len The number of bytes to copy.
+ * @param copy_mode The copy method to try first, lowered when a method is not supported.
+ * 
+ * The bytes are moved by copy_file_range when the kernel supports it between the two files,
+ * then by sendfile, and last by writing straight out of the image mapping (or a pread buffer).
+ * 
+ * @return true if all the bytes were copied, false if a write failed.
+ */
+bool copy_to_file(fs_image *img, int dest_fd, off_t src_offset, off_t dest_offset, size_t len, int *copy_mode){
+    bool stream = dest_offset < 0;
+    stats_seek(src_offset, len);
+    if (stream && *copy_mode == COPY_FILE_RANGE) {
+        *copy_mode = COPY_SENDFILE;
+    }
+    while (len > 0 && *copy_mode == COPY_FILE_RANGE) {
+        loff_t in = src_offset;
+        loff_t out = dest_offset;
+        ssize_t n = copy_file_range(img->fd, &in, dest_fd, &out, len, 0);
+        stats_syscall(&stats.bytes_read, n);
+        stats_add(&stats.bytes_written, n > 0 ? n : 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            *copy_mode = COPY_SENDFILE;
+            break;
+        }
+        src_offset += n;
+        dest_offset += n;
+        len -= n;
+    }
+    if (len > 0 && *copy_mode == COPY_SENDFILE) {
+        stats_syscall(NULL, 0);
+        if (!stream && lseek(dest_fd, dest_offset, SEEK_SET) < 0) {
+            *copy_mode = COPY_READ_WRITE;
+        }
+        while (len > 0 && *copy_mode == COPY_SENDFILE) {
+            off_t in = src_offset;
+            ssize_t n = sendfile(dest_fd, img->fd, &in, len);
+            stats_syscall(&stats.bytes_read, n);
+            stats_add(&stats.bytes_written, n > 0 ? n : 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                *copy_mode = COPY_READ_WRITE;
+                break;
+            }
+            src_offset += n;
+            if (!stream) {
+                dest_offset += n;
+            }
+            len -= n;
+        }
+    }
+    uint8_t *buffer = NULL;
+    while (len > 0) {
+        size_t chunk = len < MAX_IO_SIZE ? len : MAX_IO_SIZE;
+        const uint8_t *data;
+        if (img->map != NULL && (uint64_t)src_offset + chunk <= img->map_size) {
+            data = img->map + src_offset;
+            stats_add(&stats.mapped_bytes, chunk);
+        }else{
+            if (buffer == NULL) {
+                buffer = (uint8_t *)emalloc(MAX_IO_SIZE);
+            }
+            read_image(img, buffer, chunk, src_offset);
+            data = buffer;
+        }
+        ssize_t n = stream ? write(dest_fd, data, chunk) : pwrite(dest_fd, data, chunk, dest_offset);
+        stats_syscall(&stats.bytes_written, n);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            free(buffer);
+            return false;
+        }
+        src_offset += n;
+        if (!stream) {
+            dest_offset += n;
+        }
+        len -= n;
+    }
+    free(buffer);
+    return true;
+}
+
+/**
+ * Copies the data of a file entry of the image, or a byte range of it, to a host file.
+ * 
+ * @param img The opened file system image.
+ * @param file The decoded directory entry of the file.
+ * @param dest_file_path The path of the destination file in the local file system.
+ * @param offset The first byte to copy.
+ * @param length The number of bytes to copy, cut at the end of the file.
+ * @param io The I/O engine of the calling thread.
+ * 
+ * The range is turned into contiguous segments of the image (see map_file_range) and each segment is copied to the
+ * destination file in one go, without staging the data in a user buffer when the kernel can copy it directly. With
+ * an io_uring engine all the segments are submitted at once instead, and read and written in chunks with many
+ * requests in flight.
+ * The destination file ends up exactly the size of the range, the size recorded in the directory entry for a
+ * whole file.
+ * A destination of "-" is standard output, written in order so that it can be a pipe or a terminal.
+ * Only positional I/O is used on the image, so several threads can extract files at the same time.
+ * 
+ * @return The number of bytes copied.
+ */
+uint64_t extract_file(fs_image *img, const dir_entry_t *file, const char *dest_file_path, uint64_t offset,
+                      uint64_t length, io_engine *io){
+    uint64_t phase_start = stats_clock();
+    bool to_stdout = strcmp(dest_file_path, "-") == 0;
+    int dest_fd = to_stdout ? STDOUT_FILENO : open(dest_file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    stats_syscall(NULL, 0);
+    if (dest_fd < 0) {
+        fprintf(stderr, "Error: Unable to open file %s\n", dest_file_path);
+        exit(1);
+    }
+
+    uint32_t segment_count;
+    io_segment *segments = map_file_range(img, file->start_block, file->size, offset, length, &segment_count);
+
+    int copy_mode = COPY_FILE_RANGE;
+    off_t dest_offset = 0;
+    if (io->kind == IO_URING && !to_stdout && segment_count > 0) {
+        for (uint32_t i = 0; i < segment_count; i++) {
+            segments[i].dest_fd = dest_fd;
+        }
+        if (!uring_copy(io, segments, segment_count)) {
+            if (io->failed_write) {
+                fprintf(stderr, "Error: Unable to write file %s\n", dest_file_path);
+            }else{
+                fprintf(stderr, "Error: Unable to read file %s\n", img->path);
+            }
+            exit(1);
+        }
+        dest_offset = segments[segment_count - 1].dest_offset + segments[segment_count - 1].length;
+        segment_count = 0;
+    }
+    for (uint32_t i = 0; i < segment_count; i++) {
+        if (!copy_to_file(img, dest_fd, segments[i].src_offset, to_stdout ? -1 : dest_offset, segments[i].length,
+                          &copy_mode)) {
+            fprintf(stderr, "Error: Unable to write file %s\n", dest_file_path);
+            exit(1);
+        }
+        dest_offset += segments[i].length;
+    }
+    free(segments);
+    if (to_stdout) {
+        stats_phase(PHASE_DATA_COPY, phase_start);
+        return dest_offset;
+    }
+    stats_syscall(NULL, 0);
+    if (ftruncate(dest_fd, dest_offset) != 0) {
+        fprintf(stderr, "Error: Unable to write file %s\n", dest_file_path);
+        exit(1);
+    }
+
+    close(dest_fd);
+    stats_phase(PHASE_DATA_COPY, phase_start);
+    return dest_offset;
+}
+
+/**
+ * This function copies a file, or a byte range of it, from a file system image to the local file system.
+ * 
+ * @param img The opened file system image.
+ * @param file_path The path of the file to copy in the file system image.
+ * @param dest_file_path The path of the destination file in the local file system.
+ * @param offset The first byte to copy, 0 for the whole file.
+ * @param length The number of bytes to copy, UINT64_MAX for everything up to the end of the file.
+ * 
+ * The function first finds the file in the file system image.
+ * If the file is not found, it prints an error message and exits the program.
+ * It then copies the file's extents to the destination file. A range past the end of the file copies nothing.
+ * 
+ * The function does not return a value.
+ */
+void diskget(fs_image *img, char *file_path, char *dest_file_path, uint64_t offset, uint64_t length){
+    uint64_t phase_start = stats_clock();
+    dir_entry_t *file = find_file(img, file_path);
+    stats_phase(PHASE_LOOKUP, phase_start);
+    if (file == NULL){
+        printf("File not found.\n");
+        exit(1);
+    }
+    io_engine io;
+    io_engine_init(&io);
+    extract_file(img, file, dest_file_path, offset, length, &io);
+    io_engine_free(&io);
+    free(file);
+}
+
+/**
+ * Takes the byte range options of a read out of the arguments.
+ * 
+ * @param argc The number of arguments, decreased by the options removed.
+ * @param argv The arguments.
+ * @param offset Set to the value of "--offset <bytes>", 0 without it.
+ * @param length Set to the value of "--length <bytes>", UINT64_MAX (up to the end of the file) without it.
+ * 
+ * Prints an error message and exits the program if a value is not a number of bytes.
+ * 
+ * @return true if either option was given.
+ */
+bool range_option(int *argc, char *argv[], uint64_t *offset, uint64_t *length){
+    bool given = false;
+    *offset = 0;
+    *length = UINT64_MAX;
+    for (int i = 1; i < *argc; i++) {
+        bool is_offset = strcmp(argv[i], "--offset") == 0;
+        if (!is_offset && strcmp(argv[i], "--length") != 0) {
+            continue;
+        }
+        char *end;
+        errno = 0;
+        unsigned long long value = i + 1 < *argc ? strtoull(argv[i + 1], &end, 10) : 0;
+        if (i + 1 == *argc || argv[i + 1][0] < '0' || argv[i + 1][0] > '9' || *end != '\0' || errno != 0) {
+            fprintf(stderr, "Error: Invalid %s\n", is_offset ? "offset" : "length");
+            exit(1);
+        }
+        *(is_offset ? offset : length) = value;
+        given = true;
+        memmove(&argv[i], &argv[i + 2], (*argc - i - 1) * sizeof(char *));
+        *argc -= 2;
+        i--;
+    }
+    return given;
+}
+
+/**
+ * Returns the time of the monotonic clock in seconds.
+ */
+double monotonic_seconds(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Checks that a directory entry name can be used as a single host path component.
+ */
+bool safe_host_name(const char *name){
+    return name[0] != '\0' && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 && strchr(name, '/') == NULL;
+}
+
+/**
+ * Creates the host directories of a subtree of the image and collects the files to extract from it.
+ * 
+ * @param img The opened file system image.
+ * @param start_block The first block of the directory.
+ * @param block_count The number of blocks of the directory.
+ * @param host_dir The host directory matching it, already created.
+ * @param visited One bit per block, set for the first block of every directory already walked.
+ * @param job_list The list of files to extract, grown as files are found.
+ * 
+ * A directory whose first block was already walked is skipped, so a corrupt image with a cycle cannot loop forever.
+ */
+void collect_export_jobs(fs_image *img, uint32_t start_block, uint32_t block_count, const char *host_dir,
+                         uint8_t *visited, export_job_list *job_list){
+    if (start_block >= img->sb.file_system_block_count || (visited[start_block / 8] & (1 << (start_block % 8)))) {
+        return;
+    }
+    visited[start_block / 8] |= 1 << (start_block % 8);
+
+    size_t host_dir_length = strlen(host_dir);
+    dir_iter it;
+    dir_iter_init(&it, img, start_block, block_count);
+    while (dir_iter_next(&it)) {
+        for (uint32_t i = 0; i < it.entry_count; i++) {
+            if (it.entries[i].status != 3 && it.entries[i].status != 5) {
+                continue;
+            }
+            dir_entry_t entry = it.entries[i];
+            decode_dir_entry(&entry);
+            char name[sizeof(entry.filename) + 1];
+            memcpy(name, entry.filename, sizeof(entry.filename));
+            name[sizeof(entry.filename)] = '\0';
+            if (!safe_host_name(name)) {
+                continue;
+            }
+            char *host_path = (char *)emalloc(host_dir_length + strlen(name) + 2);
+            sprintf(host_path, "%s/%s", host_dir, name);
+            if (entry.status == 5) {
+                if (mkdir(host_path, 0755) != 0 && errno != EEXIST) {
+                    fprintf(stderr, "Error: Unable to create directory %s\n", host_path);
+                    exit(1);
+                }
+                collect_export_jobs(img, entry.start_block, entry.block_count, host_path, visited, job_list);
+                free(host_path);
+                continue;
+            }
+            if (job_list->count == job_list->capacity) {
+                job_list->capacity = job_list->capacity == 0 ? 64 : job_list->capacity * 2;
+                export_job *grown = (export_job *)realloc(job_list->jobs, job_list->capacity * sizeof(export_job));
+                if (grown == NULL) {
+                    fprintf(stderr, "Error: Unable to allocate memory\n");
+                    exit(EXIT_FAILURE);
+                }
+                job_list->jobs = grown;
+            }
+            job_list->jobs[job_list->count].entry = entry;
+            job_list->jobs[job_list->count].host_path = host_path;
+            job_list->count++;
+        }
+    }
+    dir_iter_end(&it);
+}
+
+/**
+ * Orders export jobs by decreasing size, so that the largest files start first and the threads finish together.
+ */
+int compare_export_size(const void *a, const void *b){
+    const export_job *x = (const export_job *)a;
+    const export_job *y = (const export_job *)b;
+    return x->entry.size < y->entry.size ? 1 : (x->entry.size > y->entry.size ? -1 : 0);
+}
+
+void *export_worker(void *arg){
+    export_worker_state *worker = (export_worker_state *)arg;
+    export_job_list *job_list = worker->job_list;
+    double start = monotonic_seconds();
+    io_engine io;
+    io_engine_init(&io);
+    while (true) {
+        uint32_t j = __atomic_fetch_add(&job_list->next, 1, __ATOMIC_RELAXED);
+        if (j >= job_list->count) {
+            break;
+        }
+        const dir_entry_t *entry = &job_list->jobs[j].entry;
+        worker->bytes += extract_file(worker->img, entry, job_list->jobs[j].host_path, 0, entry->size, &io);
+        worker->files++;
+    }
+    io_engine_free(&io);
+    worker->seconds = monotonic_seconds() - start;
+    return NULL;
+}
+
+/**
+ * This function copies a whole directory tree from a file system image to the local file system.
+ * 
+ * @param img The opened file system image.
+ * @param dir_path The path of the directory to copy in the file system image, "" or "/" for the root directory.
+ * @param dest_dir_path The host directory to copy it into, created if needed.
+ * 
+ * The subtree is walked once to create the host directories and list the files (status 3) and directories (status 5).
+ * The files are then extracted by one thread per core, all reading the same image mapping with positional I/O.
+ * The files, bytes and throughput of every thread are printed at the end.
+ */
+void diskget_tree(fs_image *img, char *dir_path, char *dest_dir_path){
+    uint32_t start_block;
+    uint32_t block_count;
+    uint64_t phase_start = stats_clock();
+    if (!resolve_directory(img, dir_path, &start_block, &block_count)){
+        printf("Directory not found.\n");
+        exit(1);
+    }
+    stats_phase(PHASE_LOOKUP, phase_start);
+    if (mkdir(dest_dir_path, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: Unable to create directory %s\n", dest_dir_path);
+        exit(1);
+    }
+
+    double start = monotonic_seconds();
+    uint8_t *visited = (uint8_t *)calloc(img->sb.file_system_block_count / 8 + 1, 1);
+    if (visited == NULL) {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+    export_job_list job_list = {NULL, 0, 0, 0};
+    phase_start = stats_clock();
+    collect_export_jobs(img, start_block, block_count, dest_dir_path, visited, &job_list);
+    stats_phase(PHASE_SCAN, phase_start);
+    free(visited);
+    qsort(job_list.jobs, job_list.count, sizeof(export_job), compare_export_size);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t thread_count = cpus > 0 ? (uint32_t)cpus : 1;
+    if (thread_count > job_list.count) {
+        thread_count = job_list.count > 0 ? job_list.count : 1;
+    }
+    export_worker_state *workers = (export_worker_state *)calloc(thread_count, sizeof(export_worker_state));
+    pthread_t *threads = (pthread_t *)emalloc(thread_count * sizeof(pthread_t));
+    if (workers == NULL) {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t t = 0; t < thread_count; t++) {
+        workers[t].img = img;
+        workers[t].job_list = &job_list;
+        if (t > 0 && pthread_create(&threads[t], NULL, export_worker, &workers[t]) != 0) {
+            threads[t] = 0;
+        }
+    }
+    export_worker(&workers[0]);
+    uint64_t total_bytes = 0;
+    uint32_t total_files = 0;
+    for (uint32_t t = 0; t < thread_count; t++) {
+        if (t > 0 && threads[t] != 0) {
+            pthread_join(threads[t], NULL);
+        }
+        total_bytes += workers[t].bytes;
+        total_files += workers[t].files;
+    }
+    double elapsed = monotonic_seconds() - start;
+
+    for (uint32_t t = 0; t < thread_count; t++) {
+        printf("Thread %u: %u files, %.1f MB, %.1f MB/s\n", t, workers[t].files, workers[t].bytes / 1048576.0,
+               workers[t].seconds > 0 ? workers[t].bytes / 1048576.0 / workers[t].seconds : 0.0);
+    }
+    printf("Total: %u files, %.1f MB in %.3f s, %.1f MB/s\n", total_files, total_bytes / 1048576.0, elapsed,
+           elapsed > 0 ? total_bytes / 1048576.0 / elapsed : 0.0);
+
+    for (uint32_t j = 0; j < job_list.count; j++) {
+        free(job_list.jobs[j].host_path);
+    }
+    free(job_list.jobs);
+    free(workers);
+    free(threads);
+}
+
+/**
+ * This function finds a free block in the FAT (File Allocation Table) and marks it as used.
+ * 
+ * @param img The file system image, opened for writing.
+ * 
+ * The function asks the free-space bitmap for the lowest free block. It marks the block as used in the bitmap and in the FAT (i.e., sets its value to 1) and returns the index of the block.
+ * If no free block is found, it prints an error message and exits the program.
+ * 
+ * @return The index of the free block found, or exits the program if no free block is found.
+ */
+uint32_t get_free_block(fs_image *img) {
+    uint32_t block = free_map_next(img->free);
+    if (block == 0xFFFFFFFF) {
+        fprintf(stderr, "Error: No free blocks available.\n");
+        exit(1);
+    }
+    free_map_take(img->free, block, 1);
+    fat_set(img, block, 1);  // Mark the block as used
+    return block;
+}
+
+/**
+ * Orders extents by decreasing length, used to pick the largest free runs first.
+ */
+int compare_extent_length(const void *a, const void *b){
+    const extent *x = (const extent *)a;
+    const extent *y = (const extent *)b;
+    if (x->length != y->length) {
+        return x->length > y->length ? -1 : 1;
+    }
+    return x->start < y->start ? -1 : (x->start > y->start);
+}
+
+/**
+ * Orders extents by increasing start block.
+ */
+int compare_extent_start(const void *a, const void *b){
+    const extent *x = (const extent *)a;
+    const extent *y = (const extent *)b;
+    return x->start < y->start ? -1 : (x->start > y->start);
+}
+
+/**
+ * Reserves block_count free blocks as a few contiguous runs as possible.
+ * 
+ * @param img The file system image, opened for writing.
+ * @param block_count The number of blocks to reserve.
+ * @param extent_count Set to the number of extents reserved.
+ * 
+ * A single free run large enough for all the blocks is used when there is one.
+ * Otherwise the largest free runs are taken until enough blocks are reserved, and they are returned in block order
+ * so that the data is written and later read sequentially.
+ * The blocks are taken from the free-space bitmap, the FAT is left to link_extents.
+ * If there are not enough free blocks, it prints an error message and exits the program.
+ * 
+ * @return extent* The reserved extents, to be freed by the caller.
+ */
+extent *allocate_extents(fs_image *img, uint32_t block_count, uint32_t *extent_count){
+    free_map *fm = img->free;
+    if (fm->free_count < block_count) {
+        fprintf(stderr, "Error: No free blocks available.\n");
+        exit(1);
+    }
+    extent *extents;
+    uint32_t count = 0;
+    uint32_t start;
+    if (free_map_find_run(fm, block_count, &start)) {
+        extents = (extent *)emalloc(sizeof(extent));
+        extents[0].start = start;
+        extents[0].length = block_count;
+        count = 1;
+    }else{
+        uint32_t run_count;
+        extents = free_map_runs(fm, &run_count);
+        qsort(extents, run_count, sizeof(extent), compare_extent_length);
+        uint32_t remaining = block_count;
+        while (remaining > 0) {
+            if (extents[count].length > remaining) {
+                extents[count].length = remaining;
+            }
+            remaining -= extents[count].length;
+            count++;
+        }
+        qsort(extents, count, sizeof(extent), compare_extent_start);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        free_map_take(fm, extents[i].start, extents[i].length);
+    }
+    *extent_count = count;
+    return extents;
+}
+
+/**
+ * Links a list of extents into a single chain in the FAT.
+ * 
+ * @param img The file system image, opened for writing.
+ * @param extents The extents making up the chain, in chain order.
+ * @param extent_count The number of extents.
+ */
+void link_extents(fs_image *img, extent *extents, uint32_t extent_count){
+    for (uint32_t e = 0; e < extent_count; e++) {
+        uint32_t last = extents[e].start + extents[e].length - 1;
+        for (uint32_t block = extents[e].start; block < last; block++) {
+            fat_set(img, block, block + 1);
+        }
+        fat_set(img, last, e + 1 < extent_count ? extents[e + 1].start : 0xFFFFFFFF);
+    }
+}
+
+/**
+ * Reads exactly len bytes from a descriptor.
+ * 
+ * @return true if len bytes were read, false on error or early end of file.
+ */
+bool read_full(int fd, void *buf, size_t len){
+    uint8_t *dst = (uint8_t *)buf;
+    while (len > 0) {
+        ssize_t n = read(fd, dst, len);
+        stats_syscall(&stats.bytes_read, n);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        dst += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * Copies size bytes from a descriptor into the given extents of the image.
+ * 
+ * @param img The file system image, opened for writing.
+ * @param src_fd The descriptor to read the data from, a file, a pipe or a socket.
+ * @param extents The extents to fill, in chain order.
+ * @param extent_count The number of extents.
+ * @param size The number of bytes to copy.
+ * 
+ * Each extent is written with one pwrite, or with one pwrite per MAX_IO_SIZE bytes for very large extents.
+ * 
+ * @return true if size bytes were copied, false if the source ended early or could not be read.
+ */
+bool write_extents(fs_image *img, int src_fd, extent *extents, uint32_t extent_count, uint64_t size){
+    uint32_t block_size = img->sb.block_size;
+    size_t buffer_size = MAX_IO_SIZE - MAX_IO_SIZE % block_size;
+    if (size < buffer_size) {
+        buffer_size = size;
+    }
+    uint8_t *buffer = (uint8_t *)emalloc(buffer_size > 0 ? buffer_size : 1);
+    for (uint32_t e = 0; e < extent_count && size > 0; e++) {
+        uint64_t extent_bytes = (uint64_t)extents[e].length * block_size;
+        off_t offset = block_offset(img, extents[e].start);
+        while (extent_bytes > 0 && size > 0) {
+            size_t chunk = buffer_size;
+            if (chunk > extent_bytes) {
+                chunk = extent_bytes;
+            }
+            if (chunk > size) {
+                chunk = size;
+            }
+            if (!read_full(src_fd, buffer, chunk)) {
+                free(buffer);
+                return false;
+            }
+            write_image(img, buffer, chunk, offset);
+            offset += chunk;
+            extent_bytes -= chunk;
+            size -= chunk;
+        }
+    }
+    free(buffer);
+    return true;
+}
+
+/**
+ * Reads a source ahead of its writer, into a ring of STREAM_BUFFERS chunks.
+ * 
+ * @param arg The stream_reader.
+ * 
+ * The reader fills the next free chunk while the writer is still busy with the older ones, and stops at the end of
+ * the source or on the first error.
+ */
+void *stream_reader_main(void *arg){
+    stream_reader *sr = (stream_reader *)arg;
+    uint32_t tail = 0;
+    bool done = false;
+    while (!done) {
+        pthread_mutex_lock(&sr->lock);
+        while (sr->filled == STREAM_BUFFERS) {
+            pthread_cond_wait(&sr->changed, &sr->lock);
+        }
+        pthread_mutex_unlock(&sr->lock);
+
+        uint8_t *buffer = sr->buffers[tail];
+        size_t length = 0;
+        bool failed = false;
+        while (length < sr->chunk_size) {
+            ssize_t n = read(sr->fd, buffer + length, sr->chunk_size - length);
+            stats_syscall(&stats.bytes_read, n);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                failed = n < 0;
+                done = true;
+                break;
+            }
+            length += n;
+        }
+
+        pthread_mutex_lock(&sr->lock);
+        if (length > 0) {
+            sr->lengths[tail] = length;
+            sr->filled++;
+            tail = (tail + 1) % STREAM_BUFFERS;
+        }
+        sr->done = done;
+        sr->failed = failed;
+        pthread_cond_broadcast(&sr->changed);
+        pthread_mutex_unlock(&sr->lock);
+    }
+    return NULL;
+}
+
+/**
+ * Waits for the next chunk of a stream.
+ * 
+ * @param sr The stream.
+ * @param data Set to the chunk.
+ * @param length Set to the length of the chunk.
+ * 
+ * @return true if a chunk is ready, to be handed back with stream_release, false at the end of the stream.
+ */
+bool stream_next(stream_reader *sr, const uint8_t **data, size_t *length){
+    pthread_mutex_lock(&sr->lock);
+    while (sr->filled == 0 && !sr->done) {
+        pthread_cond_wait(&sr->changed, &sr->lock);
+    }
+    bool ready = sr->filled > 0;
+    if (ready) {
+        *data = sr->buffers[sr->head];
+        *length = sr->lengths[sr->head];
+    }
+    pthread_mutex_unlock(&sr->lock);
+    return ready;
+}
+
+/**
+ * Hands the chunk returned by stream_next back to the reader.
+ */
+void stream_release(stream_reader *sr){
+    pthread_mutex_lock(&sr->lock);
+    sr->head = (sr->head + 1) % STREAM_BUFFERS;
+    sr->filled--;
+    pthread_cond_broadcast(&sr->changed);
+    pthread_mutex_unlock(&sr->lock);
+}
+
+/**
+ * Reserves block_count more blocks at the end of a put request's extents.
+ * 
+ * @param img The file system image, opened for writing.
+ * @param req The request, whose extents grow.
+ * @param block_count The number of blocks to add.
+ * @param capacity The allocated length of req->extents.
+ * 
+ * The last extent is extended in place while the blocks after it are free, so a stream that is not competing for
+ * space ends up in one run. Otherwise the first free run large enough for the rest is used, or failing that the
+ * lowest free runs one after another.
+ * If there are not enough free blocks, it prints an error message and exits the program.
+ */
+void extend_extents(fs_image *img, put_request *req, uint32_t block_count, uint32_t *capacity){
+    free_map *fm = img->free;
+    if (fm->free_count < block_count) {
+        fprintf(stderr, "Error: No free blocks available.\n");
+        exit(1);
+    }
+    while (block_count > 0) {
+        extent *last = req->extent_count > 0 ? &req->extents[req->extent_count - 1] : NULL;
+        if (last != NULL) {
+            uint32_t grow = free_map_run_length(fm, last->start + last->length, block_count);
+            if (grow > 0) {
+                free_map_take(fm, last->start + last->length, grow);
+                last->length += grow;
+                block_count -= grow;
+                continue;
+            }
+        }
+        uint32_t start;
+        uint32_t length = block_count;
+        if (!free_map_find_run(fm, block_count, &start)) {
+            start = free_map_next(fm);
+            length = free_map_run_length(fm, start, block_count);
+        }
+        if (req->extent_count == *capacity) {
+            *capacity *= 2;
+            extent *grown = (extent *)realloc(req->extents, *capacity * sizeof(extent));
+            if (grown == NULL) {
+                fprintf(stderr, "Error: Unable to allocate memory\n");
+                exit(EXIT_FAILURE);
+            }
+            req->extents = grown;
+        }
+        free_map_take(fm, start, length);
+        req->extents[req->extent_count].start = start;
+        req->extents[req->extent_count].length = length;
+        req->extent_count++;
+        block_count -= length;
+    }
+}
+
+/**
+ * Copies a source of unknown size, such as a pipe, into newly allocated blocks of the image.
+ * 
+ * @param img The file system image, opened for writing.
+ * @param req The request, with its directory slot reserved. Its extents, size and entry are filled in.
+ * @param src_fd The descriptor to read the data from, read to its end.
+ * 
+ * A reader thread reads the source in chunks of up to MAX_IO_SIZE bytes, up to STREAM_BUFFERS chunks ahead, while
+ * this thread writes the chunks it already has to the image. Blocks are reserved one chunk at a time as the data
+ * arrives. The FAT and the directory entry are left to the caller.
+ * Prints an error message and exits the program if the file grows past 4 GB or the image runs out of space.
+ * 
+ * @return true if the whole source was copied, false if it could not be read.
+ */
+bool put_stream(fs_image *img, put_request *req, int src_fd){
+    uint32_t block_size = img->sb.block_size;
+    stream_reader sr;
+    memset(&sr, 0, sizeof(sr));
+    sr.fd = src_fd;
+    sr.chunk_size = MAX_IO_SIZE - MAX_IO_SIZE % block_size;
+    for (uint32_t b = 0; b < STREAM_BUFFERS; b++) {
+        sr.buffers[b] = (uint8_t *)emalloc(sr.chunk_size);
+    }
+    pthread_mutex_init(&sr.lock, NULL);
+    pthread_cond_init(&sr.changed, NULL);
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, stream_reader_main, &sr) != 0) {
+        fprintf(stderr, "Error: Unable to create thread\n");
+        exit(1);
+    }
+
+    uint32_t capacity = 16;
+    req->extents = (extent *)emalloc(capacity * sizeof(extent));
+    req->extent_count = 0;
+    uint64_t size = 0;
+    uint32_t write_extent = 0;      // Where the next chunk goes: an extent and a block within it, the last extent may still grow
+    uint32_t write_block = 0;
+    const uint8_t *data;
+    size_t length;
+    while (stream_next(&sr, &data, &length)) {
+        if (size + length > UINT32_MAX) {
+            fprintf(stderr, "Error: File %s is too large\n", req->src_path);
+            exit(1);
+        }
+        extend_extents(img, req, (uint32_t)((length + block_size - 1) / block_size), &capacity);
+        size += length;
+        while (length > 0) {
+            if (write_block == req->extents[write_extent].length) {
+                write_extent++;
+                write_block = 0;
+            }
+            extent *e = &req->extents[write_extent];
+            uint64_t room = (uint64_t)(e->length - write_block) * block_size;
+            size_t chunk = length < room ? length : room;
+            write_image(img, data, chunk, block_offset(img, e->start + write_block));
+            data += chunk;
+            length -= chunk;
+            write_block += (uint32_t)((chunk + block_size - 1) / block_size);
+        }
+        stream_release(&sr);
+    }
+    pthread_join(reader, NULL);
+    pthread_mutex_destroy(&sr.lock);
+    pthread_cond_destroy(&sr.changed);
+    for (uint32_t b = 0; b < STREAM_BUFFERS; b++) {
+        free(sr.buffers[b]);
+    }
+    if (sr.failed) {
+        return false;
+    }
+
+    if (req->extent_count == 0) {
+        extend_extents(img, req, 1, &capacity);
+    }
+    req->size = (uint32_t)size;
+    req->block_count = size == 0 ? 1 : (uint32_t)((size + block_size - 1) / block_size);
+    req->entry.size = htonl(req->size);
+    req->entry.block_count = htonl(req->block_count);
+    req->entry.start_block = htonl(req->extents[0].start);
+    return true;
+}
+
+/**
+ * Copies the sources of several put requests into their extents through the io_uring of an engine, then closes them.
+ * 
+ * @param img The file system image, opened for writing.
+ * @param io The engine, of kind IO_URING.
+ * @param requests The requests, with their extents allocated.
+ * @param src_fds The open source of every request, regular files read at their own offsets.
+ * @param count The number of requests.
+ * 
+ * The extents of every file go out in one submission, so small files are copied many at a time.
+ * Prints an error message and exits the program if a source is short or the image cannot be written.
+ */
+void put_files_async(fs_image *img, io_engine *io, put_request **requests, int *src_fds, uint32_t count){
+    uint32_t capacity = 0;
+    for (uint32_t r = 0; r < count; r++) {
+        capacity += requests[r]->extent_count;
+    }
+    io_segment *segments = (io_segment *)calloc(capacity + 1, sizeof(io_segment));
+    if (segments == NULL) {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t segment_count = 0;
+    for (uint32_t r = 0; r < count; r++) {
+        put_request *req = requests[r];
+        uint64_t remaining = req->size;
+        off_t src_offset = 0;
+        for (uint32_t e = 0; e < req->extent_count && remaining > 0; e++) {
+            uint64_t len = (uint64_t)req->extents[e].length * img->sb.block_size;
+            if (len > remaining) {
+                len = remaining;
+            }
+            io_segment *segment = &segments[segment_count++];
+            segment->src_fd = src_fds[r];
+            segment->dest_fd = img->fd;
+            segment->src_offset = src_offset;
+            segment->dest_offset = block_offset(img, req->extents[e].start);
+            segment->length = len;
+            segment->tag = r;
+            src_offset += len;
+            remaining -= len;
+        }
+    }
+    if (!uring_copy(io, segments, segment_count)) {
+        if (io->failed_write) {
+            fprintf(stderr, "Error: Unable to write file %s\n", img->path);
+        }else{
+            fprintf(stderr, "Error: Unable to read file %s\n", requests[io->failed->tag]->src_path);
+        }
+        exit(1);
+    }
+    for (uint32_t r = 0; r < count; r++) {
+        close(src_fds[r]);
+    }
+    free(segments);
+}
+
+/**
+ * Returns the next free slot of a directory, resuming where the previous call on the same cursor stopped.
+ * 
+ * @param cursor The free-slot cursor of the directory.
+ * @param address Set to the offset of the slot in the image.
+ * @param slot Set to the current contents of the slot.
+ * 
+ * Slots handed out are not written until the end of the batch, so the cursor never goes back over them. Nothing but
+ * puts adds entries to a directory, so the cursor stays valid across batches and the next put into the directory
+ * starts where the last one stopped instead of rescanning the full blocks. Slots given back by failed puts
+ * (see return_free_slot) come first.
+ * 
+ * @return true if a free slot was found, false if the directory is full.
+ */
+bool next_free_slot(slot_cursor *cursor, off_t *address, dir_entry_t *slot){
+    if (cursor->returned_count > 0) {
+        *address = cursor->returned[--cursor->returned_count];
+        memset(slot, 0, sizeof(dir_entry_t));
+        return true;
+    }
+    while (true) {
+        if (!cursor->loaded) {
+            if (!dir_iter_next(&cursor->it)) {
+                return false;
+            }
+            cursor->loaded = true;
+            cursor->index = 0;
+            cursor->last_block = cursor->it.block;
+        }
+        while (cursor->index < cursor->it.entry_count) {
+            uint32_t i = cursor->index++;
+            if (cursor->it.entries[i].status == 0) {
+                *slot = cursor->it.entries[i];
+                *address = dir_iter_entry_offset(&cursor->it, i);
+                return true;
+            }
+        }
+        cursor->loaded = false;
+    }
+}
+
+/**
+ * Gives a slot handed out by next_free_slot back to its cursor, for a put that failed before the slot was staged.
+ * 
+ * @param cursor The free-slot cursor the slot came from.
+ * @param address The offset of the slot in the image.
+ */
+void return_free_slot(slot_cursor *cursor, off_t address){
+    if (cursor->returned_count == cursor->returned_capacity) {
+        cursor->returned_capacity = cursor->returned_capacity == 0 ? 8 : cursor->returned_capacity * 2;
+        off_t *grown = (off_t *)realloc(cursor->returned, cursor->returned_capacity * sizeof(off_t));
+        if (grown == NULL) {
+            fprintf(stderr, "Error: Unable to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+        cursor->returned = grown;
+    }
+    cursor->returned[cursor->returned_count++] = address;
+}
+
+/**
+ * Finds the entry of a directory in its parent directory.
+ * 
+ * @param img The opened file system image.
+ * @param path The normalized path of the directory, not the root directory.
+ * @param offset Set to the offset of the entry in the image.
+ * @param entry Set to the entry, in on-disk byte order.
+ * 
+ * @return true if the entry was found, false otherwise.
+ */
+bool find_dir_entry(fs_image *img, const char *path, off_t *offset, dir_entry_t *entry){
+    const char *name = strrchr(path, '/');
+    uint32_t start_block = img->sb.root_dir_start_block;
+    uint32_t block_count = img->sb.root_dir_block_count;
+    if (name != NULL) {
+        char *parent_path = strndup(path, name - path);
+        if (parent_path == NULL) {
+            fprintf(stderr, "Error: Unable to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+        bool found = resolve_directory(img, parent_path, &start_block, &block_count);
+        free(parent_path);
+        if (!found) {
+            return false;
+        }
+        name++;
+    }else{
+        name = path;
+    }
+    size_t name_length = strlen(name);
+    dir_iter it;
+    dir_iter_init(&it, img, start_block, block_count);
+    while (dir_iter_next(&it)) {
+        for (uint32_t i = 0; i < it.entry_count; i++) {
+            if (it.entries[i].status == 5 && dir_name_equals(&it.entries[i], name, name_length)) {
+                *offset = dir_iter_entry_offset(&it, i);
+                *entry = it.entries[i];
+                dir_iter_end(&it);
+                return true;
+            }
+        }
+    }
+    dir_iter_end(&it);
+    return false;
+}
+
+/**
+ * Adds empty blocks to the end of a full directory.
+ * 
+ * @param img The file system image, opened for writing.
+ * @param cursor The free-slot cursor of the directory, walked to its end.
+ * @param keep The free blocks to leave for the file that needs the slot.
+ * 
+ * The directory grows by as many blocks as it already has, up to DIR_GROW_MAX_BLOCKS, so filling a directory takes
+ * a logarithmic number of steps until it is large and then one step per DIR_GROW_MAX_BLOCKS blocks. The blocks right
+ * after its last block are used when they are free so that the directory stays contiguous.
+ * The new blocks are zeroed straight away, their FAT links and the new block count (in the directory's entry, or in
+ * the super block for the root directory) are staged like the rest of the batch's metadata.
+ * The path cache entry of the directory is replaced, since it records the block count.
+ * 
+ * @return true if the directory grew, false if the image has no free block left beyond keep or the entry cannot be
+ *         found.
+ */
+bool grow_directory(fs_image *img, slot_cursor *cursor, uint32_t keep){
+    free_map *fm = img->free;
+    uint32_t block_size = img->sb.block_size;
+    uint32_t grow = cursor->block_count < DIR_GROW_MAX_BLOCKS ? cursor->block_count : DIR_GROW_MAX_BLOCKS;
+    if (grow == 0) {
+        grow = 1;
+    }
+    if (fm->free_count < keep) {
+        return false;
+    }
+    if (grow > fm->free_count - keep) {
+        grow = fm->free_count - keep;
+    }
+    if (grow == 0 || cursor->loaded || cursor->last_block >= img->sb.file_system_block_count) {
+        return false;
+    }
+    bool root = cursor->path[0] == '\0';
+    if (!root && cursor->entry_offset == 0 && !find_dir_entry(img, cursor->path, &cursor->entry_offset, &cursor->entry)) {
+        return false;
+    }
+
+    extent *extents;
+    uint32_t extent_count;
+    uint32_t after = free_map_run_length(fm, cursor->last_block + 1, grow);
+    if (after > 0) {
+        extents = (extent *)emalloc(sizeof(extent));
+        extents[0].start = cursor->last_block + 1;
+        extents[0].length = after;
+        extent_count = 1;
+        free_map_take(fm, extents[0].start, after);
+        grow = after;
+    }else{
+        extents = allocate_extents(img, grow, &extent_count);
+    }
+    uint32_t max_length = 0;
+    for (uint32_t e = 0; e < extent_count; e++) {
+        max_length = extents[e].length > max_length ? extents[e].length : max_length;
+    }
+    uint8_t *zeros = (uint8_t *)calloc(max_length, block_size);
+    if (zeros == NULL) {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t e = 0; e < extent_count; e++) {
+        write_image(img, zeros, (size_t)extents[e].length * block_size, block_offset(img, extents[e].start));
+    }
+    free(zeros);
+    fat_set(img, cursor->last_block, extents[0].start);
+    link_extents(img, extents, extent_count);
+
+    cursor->block_count += grow;
+    dir_iter_end(&cursor->it);
+    dir_iter_init(&cursor->it, img, extents[0].start, grow);
+    free(extents);
+    if (root) {
+        img->sb.root_dir_block_count = cursor->block_count;
+        img->root_dirty = true;
+    }else{
+        cursor->entry.block_count = htonl(cursor->block_count);
+        cursor->entry.size = htonl(cursor->block_count * block_size);
+        stage_dir_entry(img, cursor->entry_offset, &cursor->entry);
+        dcache_invalidate(img, cursor->path);
+        dcache_insert(img, cursor->path, cursor->dir_start_block, cursor->block_count);
+    }
+    return true;
+}
+
+/**
+ * Reserves the directory slot of the destination of a put request and fills in its new entry.
+ * 
+ * @param img The file system image, opened for writing.
+ * @param req The put request, with dest_path and size set.
+ * @param now The creation time given to the new entries.
+ * 
+ * The slot comes from the image's free-slot cursor of the directory, created the first time the directory is written
+ * to. A full directory is grown through its FAT chain, never into the blocks the file needs, so that a put refused
+ * for lack of space changes nothing.
+ * Nothing but the new directory blocks is written to the image, the entry is only staged once the data is in place.
+ * 
+ * @return FSIMG_OK, FSIMG_NOT_FOUND if the destination directory does not exist, or FSIMG_NO_SPACE if the image
+ *         does not have the blocks of the file or the directory is full and cannot grow.
+ */
+int reserve_put_slot(fs_image *img, put_request *req, struct tm *now){
+    super_block sb = img->sb;
+    char *dest_file_path = req->dest_path;
+    if (strncmp(dest_file_path, "./", 2) == 0) {
+        dest_file_path += 2;
+    }
+    else if (strncmp(dest_file_path, "/", 1) == 0) {
+        dest_file_path += 1;
+    }
+    req->block_count = req->size == 0 ? 1 : (uint32_t)(((uint64_t)req->size + sb.block_size - 1) / sb.block_size);
+    if (img->free->free_count < req->block_count) {
+        return FSIMG_NO_SPACE;
+    }
+
+    uint32_t current_block;
+    uint32_t blocks_count;
+    char *dest_file_name;
+    char *dest_dir_path;
+    char *last_l = strrchr(dest_file_path, '/');
+    if (last_l != NULL){
+        dest_file_name = last_l + 1;
+        size_t dir_path_length = last_l - dest_file_path;
+        dest_dir_path = (char *)emalloc(dir_path_length + 1);
+        strncpy(dest_dir_path, dest_file_path, dir_path_length);
+        dest_dir_path[dir_path_length] = '\0';
+        uint64_t phase_start = stats_clock();
+        bool found_dir = resolve_directory(img, dest_dir_path, &current_block, &blocks_count);
+        stats_phase(PHASE_LOOKUP, phase_start);
+        if (!found_dir){
+            free(dest_dir_path);
+            return FSIMG_NOT_FOUND;
+        }
+    }else{
+        dest_file_name = dest_file_path;
+        dest_dir_path = NULL;
+        current_block = sb.root_dir_start_block;
+        blocks_count = sb.root_dir_block_count;
+    }
+
+    slot_cursor *cursor = NULL;
+    for (uint32_t c = 0; c < img->cursor_count; c++) {
+        if (img->cursors[c].dir_start_block == current_block) {
+            cursor = &img->cursors[c];
+            break;
+        }
+    }
+    if (cursor == NULL) {
+        slot_cursor *grown = (slot_cursor *)realloc(img->cursors, (img->cursor_count + 1) * sizeof(slot_cursor));
+        if (grown == NULL) {
+            fprintf(stderr, "Error: Unable to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+        img->cursors = grown;
+        cursor = &img->cursors[img->cursor_count++];
+        memset(cursor, 0, sizeof(slot_cursor));
+        cursor->dir_start_block = current_block;
+        cursor->path = normalize_path(dest_dir_path != NULL ? dest_dir_path : "");
+        cursor->last_block = 0xFFFFFFFF;
+        cursor->block_count = blocks_count;
+        dir_iter_init(&cursor->it, img, current_block, blocks_count);
+    }
+    free(dest_dir_path);
+
+    req->cursor = (uint32_t)(cursor - img->cursors);
+    dir_entry_t *entry = &req->entry;
+    while (!next_free_slot(cursor, &req->entry_address, entry)){
+        if (!grow_directory(img, cursor, req->block_count)) {
+            return FSIMG_NO_SPACE;
+        }
+    }
+    entry->status = 3;
+    memset(entry->filename, 0, sizeof(entry->filename));
+    strncpy((char *)entry->filename, dest_file_name, sizeof(entry->filename) - 1);
+    entry->block_count = htonl(req->block_count);
+    entry->size = htonl(req->size);
+    entry->create_time.year = htons(now->tm_year + 1900);
+    entry->create_time.month = now->tm_mon + 1;
+    entry->create_time.day = now->tm_mday;
+    entry->create_time.hour = now->tm_hour;
+    entry->create_time.minute = now->tm_min;
+    entry->create_time.second = now->tm_sec;
+    entry->modify_time = entry->create_time;
+    req->extents = NULL;
+    req->extent_count = 0;
+    return FSIMG_OK;
+}
+
+/**
+ * Checks the source of a put request and reserves the directory slot of its destination.
+ * 
+ * @param img The file system image, opened for writing.
+ * @param req The put request.
+ * @param now The creation time given to the new entries.
+ * 
+ * A source of "-" (standard input), a pipe or a device is marked as a stream, read to its end when it is put.
+ * If the source file or the destination directory is not found, or the directory is full and cannot grow,
+ * it prints an error message and exits the program before any metadata is written.
+ */
+void prepare_put(fs_image *img, put_request *req, struct tm *now){
+    struct stat src_stat;
+    req->stream = strcmp(req->src_path, "-") == 0;
+    if (!req->stream) {
+        if (stat(req->src_path, &src_stat) != 0 || S_ISDIR(src_stat.st_mode)) {
+            printf("File not found.\n");
+            exit(1);
+        }
+        req->stream = !S_ISREG(src_stat.st_mode);
+    }
+    if (!req->stream && src_stat.st_size > UINT32_MAX) {
+        fprintf(stderr, "Error: File %s is too large\n", req->src_path);
+        exit(1);
+    }
+    req->size = req->stream ? 0 : src_stat.st_size;
+    int status = reserve_put_slot(img, req, now);
+    if (status == FSIMG_NOT_FOUND) {
+        printf("Directory not found.\n");
+        exit(1);
+    }
+    if (status == FSIMG_NO_SPACE) {
+        fprintf(stderr, "Error: No free blocks available.\n");
+        exit(1);
+    }
+}
+
+/**
+ * Orders put requests by decreasing size, so that the largest files get the longest free runs.
+ */
+int compare_put_size(const void *a, const void *b){
+    const put_request *x = *(put_request *const *)a;
+    const put_request *y = *(put_request *const *)b;
+    return x->size < y->size ? 1 : (x->size > y->size ? -1 : 0);
+}
+
+/**
+ * This function copies many files from the local file system to a file system image at once.
+ * 
+ * @param img The file system image, opened for writing.
+ * @param requests The source and destination of every file.
+ * @param request_count The number of files.
+ * 
+ * Every source is checked and every directory slot reserved first, so a bad request leaves the image untouched.
+ * The files are then allocated and written largest first, each as contiguous as the free space allows.
+ * Streams, whose size is only known at their end, get their blocks as they are read (see put_stream).
+ * The dirty FAT blocks and the directory entries are written back once, at the end of the batch.
+ */
+void diskput_batch(fs_image *img, put_request *requests, uint32_t request_count){
+    time_t current_time = time(NULL);
+    struct tm now = *localtime(&current_time);
+    uint32_t stdin_count = 0;
+    for (uint32_t r = 0; r < request_count; r++) {
+        prepare_put(img, &requests[r], &now);
+        stdin_count += strcmp(requests[r].src_path, "-") == 0;
+    }
+    if (stdin_count > 1) {
+        fprintf(stderr, "Error: Standard input can only be put once\n");
+        exit(1);
+    }
+
+    put_request **order = (put_request **)emalloc((request_count + 1) * sizeof(put_request *));
+    for (uint32_t r = 0; r < request_count; r++) {
+        order[r] = &requests[r];
+    }
+    qsort(order, request_count, sizeof(put_request *), compare_put_size);
+    uint64_t phase_start = stats_clock();
+    io_engine io;
+    io_engine_init(&io);
+    put_request *async_requests[IO_BATCH_FILES];
+    int async_fds[IO_BATCH_FILES];
+    uint32_t async_count = 0;
+    for (uint32_t r = 0; r < request_count; r++) {
+        put_request *req = order[r];
+        bool from_stdin = strcmp(req->src_path, "-") == 0;
+        int src_fd = from_stdin ? STDIN_FILENO : open(req->src_path, O_RDONLY);
+        if (src_fd < 0) {
+            printf("File not found.\n");
+            exit(1);
+        }
+        if (req->stream) {
+            if (!put_stream(img, req, src_fd)) {
+                fprintf(stderr, "Error: Unable to read file %s\n", req->src_path);
+                exit(1);
+            }
+            if (!from_stdin) {
+                close(src_fd);
+            }
+            continue;
+        }
+        req->extents = allocate_extents(img, req->block_count, &req->extent_count);
+        req->entry.start_block = htonl(req->extents[0].start);
+        struct stat src_stat;
+        if (io.kind == IO_URING && fstat(src_fd, &src_stat) == 0 && S_ISREG(src_stat.st_mode)) {
+            async_requests[async_count] = req;
+            async_fds[async_count++] = src_fd;
+            if (async_count == IO_BATCH_FILES) {
+                put_files_async(img, &io, async_requests, async_fds, async_count);
+                async_count = 0;
+            }
+            continue;
+        }
+        if (!write_extents(img, src_fd, req->extents, req->extent_count, req->size)) {
+            fprintf(stderr, "Error: Unable to read file %s\n", req->src_path);
+            exit(1);
+        }
+        close(src_fd);
+    }
+    if (async_count > 0) {
+        put_files_async(img, &io, async_requests, async_fds, async_count);
+    }
+    io_engine_free(&io);
+    stats_phase(PHASE_DATA_COPY, phase_start);
+
+    for (uint32_t r = 0; r < request_count; r++) {
+        link_extents(img, requests[r].extents, requests[r].extent_count);
+    }
+    for (uint32_t r = 0; r < request_count; r++) {
+        stage_dir_entry(img, requests[r].entry_address, &requests[r].entry);
+        free(requests[r].extents);
+        requests[r].extents = NULL;
+    }
+    flush_metadata(img);
+    free(order);
+}
+
+/**
+ * This function copies a file from the local file system to a file system image.
+ * 
+ * @param img The file system image, opened for writing.
+ * @param src_file_path The path of the source file in the local file system.
+ * @param dest_file_path The path of the destination file in the file system image.
+ * 
+ * The function finds a free entry in the directory and reserves it for the source file.
+ * It reserves the blocks for the whole file up front from the size given by stat, as contiguous as the free space allows.
+ * It then writes each run of blocks with a single large write, links the FAT chain in bulk and writes the directory entry.
+ * A source of "-" is read from standard input, with blocks reserved as the data arrives.
+ */
+void diskput(fs_image *img, char *src_file_path, char *dest_file_path){
+    put_request req;
+    req.src_path = src_file_path;
+    req.dest_path = dest_file_path;
+    diskput_batch(img, &req, 1);
+}
+
+/**
+ * Reads put requests from a manifest, one file per line.
+ * 
+ * @param in The manifest.
+ * @param request_count Set to the number of requests read.
+ * 
+ * A line is either "<src_file>" or "<src_file><TAB><dst_file>". Without a destination the file is put in the root
+ * directory under the name of the source. Empty lines are skipped.
+ * 
+ * @return put_request* The requests, whose paths and array are to be freed by the caller.
+ */
+put_request *read_manifest(FILE *in, uint32_t *request_count){
+    uint32_t capacity = 64;
+    uint32_t count = 0;
+    put_request *requests = (put_request *)emalloc(capacity * sizeof(put_request));
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t length;
+    while ((length = getline(&line, &line_capacity, in)) >= 0) {
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+            line[--length] = '\0';
+        }
+        if (length == 0) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            put_request *grown = (put_request *)realloc(requests, capacity * sizeof(put_request));
+            if (grown == NULL) {
+                fprintf(stderr, "Error: Unable to allocate memory\n");
+                exit(EXIT_FAILURE);
+            }
+            requests = grown;
+        }
+        char *tab = strchr(line, '\t');
+        if (tab != NULL) {
+            *tab = '\0';
+        }
+        char *src = line;
+        char *dest = tab != NULL ? tab + 1 : strrchr(src, '/');
+        if (dest == NULL) {
+            dest = src;
+        }else if (tab == NULL) {
+            dest++;
+        }
+        if (strcmp(src, "-") == 0) {
+            fprintf(stderr, "Error: Standard input holds the manifest\n");
+            exit(1);
+        }
+        requests[count].src_path = strdup(src);
+        requests[count].dest_path = strdup(dest);
+        if (requests[count].src_path == NULL || requests[count].dest_path == NULL) {
+            fprintf(stderr, "Error: Unable to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+        count++;
+    }
+    free(line);
+    *request_count = count;
+    return requests;
+}
+
+/**
+ * Converts a raw directory entry into the decoded form handed out by the library.
+ * 
+ * @param raw The entry, in on-disk byte order.
+ * @param entry The entry to fill.
+ */
+void fill_fsimg_entry(const dir_entry_t *raw, fsimg_entry *entry){
+    entry->status = raw->status;
+    entry->start_block = ntohl(raw->start_block);
+    entry->block_count = ntohl(raw->block_count);
+    entry->size = ntohl(raw->size);
+    entry->create_time.year = ntohs(raw->create_time.year);
+    entry->create_time.month = raw->create_time.month;
+    entry->create_time.day = raw->create_time.day;
+    entry->create_time.hour = raw->create_time.hour;
+    entry->create_time.minute = raw->create_time.minute;
+    entry->create_time.second = raw->create_time.second;
+    entry->modify_time.year = ntohs(raw->modify_time.year);
+    entry->modify_time.month = raw->modify_time.month;
+    entry->modify_time.day = raw->modify_time.day;
+    entry->modify_time.hour = raw->modify_time.hour;
+    entry->modify_time.minute = raw->modify_time.minute;
+    entry->modify_time.second = raw->modify_time.second;
+    memcpy(entry->name, raw->filename, sizeof(raw->filename));
+    entry->name[sizeof(raw->filename)] = '\0';
+}
+
+// The library entry points below are documented in fsimg.h
+
+FSIMG_API int fsimg_open(const char *path, int mode, fsimg **img){
+    int status = load_image(path, (mode & FSIMG_RDWR) != 0, img);
+    if (status == FSIMG_OK && (mode & FSIMG_DURABLE) != 0 && (mode & FSIMG_RDWR) != 0) {
+        status = journal_open(*img);
+        if (status != FSIMG_OK) {
+            close_image(*img);
+        }
+    }
+    return status;
+}
+
+FSIMG_API int fsimg_close(fsimg *img){
+    image_error = FSIMG_OK;
+    if (img->writable) {
+        flush_metadata(img);
+    }
+    int status = image_error;
+    close_image(img);
+    return status;
+}
+
+FSIMG_API int fsimg_get_info(fsimg *img, fsimg_info *info){
+    fat_census c;
+    fat_census_of(img, &c);
+    info->block_size = img->sb.block_size;
+    info->block_count = img->sb.file_system_block_count;
+    info->fat_start_block = img->sb.fat_start_block;
+    info->fat_block_count = img->sb.fat_block_count;
+    info->root_dir_start_block = img->sb.root_dir_start_block;
+    info->root_dir_block_count = img->sb.root_dir_block_count;
+    info->free_blocks = c.free_blocks;
+    info->reserved_blocks = c.reserved_blocks;
+    info->allocated_blocks = c.allocated_blocks;
+    return FSIMG_OK;
+}
+
+FSIMG_API int fsimg_stat(fsimg *img, const char *path, fsimg_entry *entry){
+    image_error = FSIMG_OK;
+    char *normalized = normalize_path(path);
+    if (normalized[0] == '\0') {
+        free(normalized);
+        memset(entry, 0, sizeof(fsimg_entry));
+        entry->status = FSIMG_DIR;
+        entry->start_block = img->sb.root_dir_start_block;
+        entry->block_count = img->sb.root_dir_block_count;
+        entry->size = img->sb.root_dir_block_count * img->sb.block_size;
+        return FSIMG_OK;
+    }
+    char *name = normalized;
+    uint32_t start_block = img->sb.root_dir_start_block;
+    uint32_t block_count = img->sb.root_dir_block_count;
+    char *last_l = strrchr(normalized, '/');
+    bool found = true;
+    if (last_l != NULL) {
+        *last_l = '\0';
+        name = last_l + 1;
+        found = resolve_directory(img, normalized, &start_block, &block_count);
+    }
+    dir_entry_t raw;
+    found = found && (dir_lookup(img, start_block, block_count, FSIMG_FILE, name, &raw) ||
+                      dir_lookup(img, start_block, block_count, FSIMG_DIR, name, &raw));
+    free(normalized);
+    if (image_error != FSIMG_OK) {
+        return image_error;
+    }
+    if (!found) {
+        return FSIMG_NOT_FOUND;
+    }
+    // dir_lookup decodes the entry, encode it back so there is one conversion to the public form
+    encode_dir_entry(&raw);
+    fill_fsimg_entry(&raw, entry);
+    return FSIMG_OK;
+}
+
+FSIMG_API int fsimg_opendir(fsimg *img, const char *path, fsimg_dir *dir, void *buffer, size_t buffer_size){
+    fsimg_entry entry;
+    int status = fsimg_stat(img, path, &entry);
+    if (status != FSIMG_OK) {
+        return status;
+    }
+    if (entry.status != FSIMG_DIR) {
+        return FSIMG_NOT_FOUND;
+    }
+    if (img->map == NULL && (buffer == NULL || buffer_size < img->sb.block_size)) {
+        return FSIMG_BUFFER_TOO_SMALL;
+    }
+    dir->img = img;
+    dir->next_block = entry.start_block;
+    dir->blocks_left = entry.block_count;
+    dir->index = 0;
+    dir->entry_count = 0;
+    dir->entries = NULL;
+    dir->buffer = buffer;
+    return FSIMG_OK;
+}
+
+FSIMG_API int fsimg_readdir(fsimg_dir *dir, fsimg_entry *entry){
+    fs_image *img = dir->img;
+    while (true) {
+        while (dir->index < dir->entry_count) {
+            const dir_entry_t *raw = (const dir_entry_t *)dir->entries + dir->index++;
+            if (raw->status != 0) {
+                fill_fsimg_entry(raw, entry);
+                return FSIMG_OK;
+            }
+        }
+        if (dir->blocks_left == 0 || dir->next_block >= img->sb.file_system_block_count) {
+            return FSIMG_END;
+        }
+        off_t offset = block_offset(img, dir->next_block);
+        if (img->map != NULL && (uint64_t)offset + img->sb.block_size <= img->map_size) {
+            dir->entries = img->map + offset;
+        }else{
+            image_error = FSIMG_OK;
+            read_image(img, dir->buffer, img->sb.block_size, offset);
+            if (image_error != FSIMG_OK) {
+                return image_error;
+            }
+            dir->entries = dir->buffer;
+        }
+        dir->index = 0;
+        dir->entry_count = img->sb.block_size / sizeof(dir_entry_t);
+        dir->blocks_left--;
+        dir->next_block = fat_next(img, dir->next_block);
+    }
+}
+
+FSIMG_API int fsimg_read(fsimg *img, const fsimg_entry *file, uint64_t offset, void *buffer, size_t length, size_t *bytes_read){
+    image_error = FSIMG_OK;
+    *bytes_read = 0;
+    if (offset >= file->size) {
+        return FSIMG_OK;
+    }
+    if (length > file->size - offset) {
+        length = file->size - offset;
+    }
+    uint32_t segment_count;
+    io_segment *segments = map_file_range(img, file->start_block, file->size, offset, length, &segment_count);
+    size_t done = 0;
+    for (uint32_t i = 0; i < segment_count; i++) {
+        read_image(img, (uint8_t *)buffer + segments[i].dest_offset, segments[i].length, segments[i].src_offset);
+        if (image_error != FSIMG_OK) {
+            free(segments);
+            return image_error;
+        }
+        done += segments[i].length;
+        *bytes_read = done;
+    }
+    free(segments);
+    return done < length ? FSIMG_INVALID_IMAGE : FSIMG_OK;
+}
+
+FSIMG_API int fsimg_get_range(fsimg *img, const char *path, uint64_t offset, uint64_t length, int dest_fd){
+    fsimg_entry file;
+    int status = fsimg_stat(img, path, &file);
+    if (status != FSIMG_OK) {
+        return status;
+    }
+    if (file.status != FSIMG_FILE) {
+        return FSIMG_NOT_FOUND;
+    }
+    if (offset >= file.size) {
+        return FSIMG_OK;
+    }
+    if (length > file.size - offset) {
+        length = file.size - offset;
+    }
+    uint32_t segment_count;
+    io_segment *segments = map_file_range(img, file.start_block, file.size, offset, length, &segment_count);
+    int copy_mode = COPY_SENDFILE;
+    uint64_t done = 0;
+    status = FSIMG_OK;
+    for (uint32_t i = 0; i < segment_count; i++) {
+        if (!copy_to_file(img, dest_fd, segments[i].src_offset, -1, segments[i].length, &copy_mode)) {
+            status = FSIMG_IO_ERROR;
+            break;
+        }
+        done += segments[i].length;
+    }
+    if (status == FSIMG_OK && done < length) {
+        status = FSIMG_INVALID_IMAGE;
+    }
+    free(segments);
+    return status;
+}
+
+FSIMG_API int fsimg_get(fsimg *img, const char *path, int dest_fd){
+    return fsimg_get_range(img, path, 0, UINT64_MAX, dest_fd);
+}
+
+/**
+ * Reserves the directory slot and the blocks of a new file of a writable image, before its data is read.
+ * 
+ * @param img The file system image, opened for writing.
+ * @param req The put request to fill in, zeroed.
+ * @param path The path of the new file in the image.
+ * @param size The size of the file.
+ * 
+ * Only the in-memory free-space index and slot cursor change, so the data can be written into the extents without
+ * holding anything, and finish_put or abort_put then settles the request.
+ * 
+ * @return A status of fsimg_put. The request holds extents only if it is FSIMG_OK.
+ */
+int reserve_put(fs_image *img, put_request *req, const char *path, uint32_t size){
+    if (!img->writable) {
+        return FSIMG_READ_ONLY;
+    }
+    time_t current_time = time(NULL);
+    struct tm now = *localtime(&current_time);
+    req->dest_path = (char *)path;
+    req->size = size;
+    int status = reserve_put_slot(img, req, &now);
+    if (status != FSIMG_OK) {
+        return status;
+    }
+    req->extents = allocate_extents(img, req->block_count, &req->extent_count);
+    req->entry.start_block = htonl(req->extents[0].start);
+    return FSIMG_OK;
+}
+
+/**
+ * Links the blocks of a reserved put whose data is in place and stages its directory entry, without flushing.
+ */
+void finish_put(fs_image *img, put_request *req){
+    link_extents(img, req->extents, req->extent_count);
+    stage_dir_entry(img, req->entry_address, &req->entry);
+    free(req->extents);
+    req->extents = NULL;
+}
+
+/**
+ * Gives back the blocks and the directory slot of a reserved put whose data could not be read.
+ * 
+ * Nothing is linked yet, so the image is left as it was, and the next put into the directory gets the slot.
+ */
+void abort_put(fs_image *img, put_request *req){
+    for (uint32_t e = 0; e < req->extent_count; e++) {
+        free_map_release(img->free, req->extents[e].start, req->extents[e].length);
+    }
+    return_free_slot(&img->cursors[req->cursor], req->entry_address);
+    free(req->extents);
+    req->extents = NULL;
+}
+
+/**
+ * Stores a file read from a descriptor in a writable image and stages its metadata, without flushing it.
+ * 
+ * @return A status of fsimg_put. Nothing has been read from src_fd unless it is FSIMG_OK or FSIMG_IO_ERROR.
+ */
+int stage_put(fs_image *img, const char *path, int src_fd, uint32_t size){
+    image_error = FSIMG_OK;
+    put_request req;
+    memset(&req, 0, sizeof(req));
+    int status = reserve_put(img, &req, path, size);
+    if (status != FSIMG_OK) {
+        return status;
+    }
+    if (!write_extents(img, src_fd, req.extents, req.extent_count, req.size) || image_error != FSIMG_OK) {
+        abort_put(img, &req);
+        return FSIMG_IO_ERROR;
+    }
+    finish_put(img, &req);
+    return image_error;
+}
+
+FSIMG_API int fsimg_put(fsimg *img, const char *path, int src_fd, uint32_t size){
+    int status = stage_put(img, path, src_fd, size);
+    if (status != FSIMG_OK) {
+        return status;
+    }
+    flush_metadata(img);
+    return image_error;
+}
+
+FSIMG_API const char *fsimg_strerror(int status){
+    switch (status) {
+        case FSIMG_OK:
+            return "Success";
+        case FSIMG_NOT_FOUND:
+            return "File or directory not found";
+        case FSIMG_NO_SPACE:
+            return "No free blocks available";
+        case FSIMG_DIR_FULL:
+            return "No free space in directory";
+        case FSIMG_BAD_REQUEST:
+            return "Bad request";
+        case FSIMG_IO_ERROR:
+            return "I/O error";
+        case FSIMG_INVALID_IMAGE:
+            return "Invalid file system image";
+        case FSIMG_READ_ONLY:
+            return "Image opened read-only";
+        case FSIMG_BUFFER_TOO_SMALL:
+            return "Buffer too small";
+        case FSIMG_END:
+            return "End of directory";
+        case FSIMG_BUSY:
+            return "Image in use by another writer";
+        default:
+            return "Unknown error";
+    }
+}
+
+/**
+ * Reads and drops len bytes from a descriptor.
+ * 
+ * @return true if len bytes were read, false if the descriptor ended early.
+ */
+bool discard_full(int fd, uint64_t len){
+    uint8_t buffer[65536];
+    while (len > 0) {
+        size_t chunk = len < sizeof(buffer) ? len : sizeof(buffer);
+        if (!read_full(fd, buffer, chunk)) {
+            return false;
+        }
+        len -= chunk;
+    }
+    return true;
+}
+
+/**
+ * Sends a reply made of a status byte only.
+ */
+bool send_status(int fd, uint8_t status){
+    return write_full(fd, &status, 1);
+}
+
+/**
+ * Answers a LIST request with the status, the number of entries and the raw entries of the directory.
+ * 
+ * @param img The image served.
+ * @param fd The connection.
+ * @param dir_path The path of the directory, "" for the root directory.
+ * 
+ * @return false if the connection is broken.
+ */
+bool server_list(fs_image *img, int fd, const char *dir_path){
+    uint32_t start_block;
+    uint32_t block_count;
+    if (!resolve_directory(img, dir_path, &start_block, &block_count)) {
+        return send_status(fd, FSIMG_NOT_FOUND);
+    }
+    uint32_t capacity = 64;
+    uint32_t count = 0;
+    uint8_t *reply = (uint8_t *)emalloc(5 + capacity * sizeof(dir_entry_t));
+    dir_iter it;
+    dir_iter_init(&it, img, start_block, block_count);
+    while (dir_iter_next(&it)) {
+        for (uint32_t i = 0; i < it.entry_count; i++) {
+            if (it.entries[i].status == 0) {
+                continue;
+            }
+            if (count == capacity) {
+                capacity *= 2;
+                uint8_t *grown = (uint8_t *)realloc(reply, 5 + capacity * sizeof(dir_entry_t));
+                if (grown == NULL) {
+                    fprintf(stderr, "Error: Unable to allocate memory\n");
+                    exit(EXIT_FAILURE);
+                }
+                reply = grown;
+            }
+            memcpy(reply + 5 + count * sizeof(dir_entry_t), &it.entries[i], sizeof(dir_entry_t));
+            count++;
+        }
+    }
+    dir_iter_end(&it);
+    reply[0] = FSIMG_OK;
+    uint32_t wire_count = htonl(count);
+    memcpy(reply + 1, &wire_count, sizeof(wire_count));
+    bool sent = write_full(fd, reply, 5 + count * sizeof(dir_entry_t));
+    free(reply);
+    return sent;
+}
+
+/**
+ * Answers a STAT request with the status and the raw entry of a file or directory.
+ * 
+ * @return false if the connection is broken.
+ */
+bool server_stat(fs_image *img, int fd, char *path){
+    dir_entry_t *entry = find_file(img, path);
+    if (entry == NULL) {
+        entry = find_directory(img, path);
+    }
+    if (entry == NULL) {
+        return send_status(fd, FSIMG_NOT_FOUND);
+    }
+    uint8_t reply[1 + sizeof(dir_entry_t)];
+    reply[0] = FSIMG_OK;
+    encode_dir_entry(entry);
+    memcpy(reply + 1, entry, sizeof(dir_entry_t));
+    free(entry);
+    return write_full(fd, reply, sizeof(reply));
+}
+
+/**
+ * Answers a GET or GET_RANGE request with the status, the length sent and the bytes of the file.
+ * 
+ * @param img The image served.
+ * @param fd The connection.
+ * @param path The path of the file.
+ * @param offset The first byte to send, 0 for GET.
+ * @param length The number of bytes to send, cut at the end of the file. UINT64_MAX for GET.
+ * 
+ * The segments of the range are sent straight from the image to the socket with sendfile when possible. A range
+ * starts in the middle of a chain by way of the image's cached chain index, so serving the parts of a large file
+ * does not walk its chain again and again.
+ * 
+ * @return false if the connection is broken.
+ */
+bool server_get(fs_image *img, int fd, char *path, uint64_t offset, uint64_t length){
+    dir_entry_t *file = find_file(img, path);
+    if (file == NULL) {
+        return send_status(fd, FSIMG_NOT_FOUND);
+    }
+    if (offset > file->size) {
+        offset = file->size;
+    }
+    if (length > file->size - offset) {
+        length = file->size - offset;
+    }
+    uint8_t header[5];
+    header[0] = FSIMG_OK;
+    uint32_t wire_length = htonl((uint32_t)length);
+    memcpy(header + 1, &wire_length, sizeof(wire_length));
+    bool sent = write_full(fd, header, sizeof(header));
+
+    uint32_t segment_count;
+    io_segment *segments = map_file_range(img, file->start_block, file->size, offset, length, &segment_count);
+    int copy_mode = COPY_SENDFILE;
+    uint64_t done = 0;
+    for (uint32_t i = 0; sent && i < segment_count; i++) {
+        sent = copy_to_file(img, fd, segments[i].src_offset, -1, segments[i].length, &copy_mode);
+        done += segments[i].length;
+    }
+    // A broken chain leaves the range short, the client still expects the length announced
+    if (sent && done < length) {
+        sent = false;
+    }
+    free(segments);
+    free(file);
+    return sent;
+}
+
+/**
+ * Waits until a group commit covers a staged put of a durable server, running the commit if no other thread is.
+ * 
+ * @param server The server, with a journaled image.
+ * @param ticket The number of the put, from server->staged.
+ * 
+ * The first put to arrive commits everything staged so far with one flush, and with it one journal sync. Puts
+ * staged while that commit runs wait for it and are covered together by the next one, so the syncs are shared by
+ * all the clients writing at the same time instead of paid once per file.
+ * 
+ * @return The status of the commit that covered the put.
+ */
+int server_commit(server_state *server, uint64_t ticket){
+    pthread_mutex_lock(&server->commit_lock);
+    while (server->committed < ticket) {
+        if (server->committing) {
+            pthread_cond_wait(&server->committed_cond, &server->commit_lock);
+            continue;
+        }
+        server->committing = true;
+        pthread_mutex_unlock(&server->commit_lock);
+        pthread_rwlock_wrlock(&server->lock);
+        uint64_t covered = server->staged;
+        image_error = FSIMG_OK;
+        flush_metadata(server->img);
+        int status = image_error;
+        pthread_rwlock_unlock(&server->lock);
+        pthread_mutex_lock(&server->commit_lock);
+        server->committing = false;
+        server->committed = covered;
+        server->commit_status = status;
+        pthread_cond_broadcast(&server->committed_cond);
+    }
+    int status = server->commit_status;
+    pthread_mutex_unlock(&server->commit_lock);
+    return status;
+}
+
+/**
+ * Answers a PUT request: stores the size bytes that follow on the connection as a new file.
+ * 
+ * @param server The server, whose image is opened for writing.
+ * @param fd The connection.
+ * @param path The path of the new file in the image.
+ * @param size The size of the file.
+ * 
+ * The image lock is held alone only to reserve the slot and the extents, and again to link them and flush the
+ * metadata. In between the data goes straight from the socket into the reserved extents with the lock released,
+ * so a slow or stalled client never holds up the other requests. The extents belong to no chain until they are
+ * linked, so no reader can reach them. If the data stops early, the blocks are given back and nothing is linked,
+ * so the image is unchanged. A rejected put drains its data after the lock is released.
+ * On a durable server the put is only acknowledged once a group commit covers it (see server_commit).
+ * 
+ * @return false if the connection is broken.
+ */
+bool server_put(server_state *server, int fd, char *path, uint32_t size){
+    fs_image *img = server->img;
+    put_request req;
+    memset(&req, 0, sizeof(req));
+    image_error = FSIMG_OK;
+    pthread_rwlock_wrlock(&server->lock);
+    int status = reserve_put(img, &req, path, size);
+    pthread_rwlock_unlock(&server->lock);
+    uint64_t ticket = 0;
+    if (status == FSIMG_OK) {
+        bool received = write_extents(img, fd, req.extents, req.extent_count, req.size) && image_error == FSIMG_OK;
+        pthread_rwlock_wrlock(&server->lock);
+        if (!received) {
+            abort_put(img, &req);
+            status = FSIMG_IO_ERROR;
+        }else{
+            finish_put(img, &req);
+            if (server->durable) {
+                ticket = ++server->staged;
+            }else{
+                flush_metadata(img);
+                status = image_error;
+            }
+        }
+        pthread_rwlock_unlock(&server->lock);
+    }
+    if (ticket > 0) {
+        status = server_commit(server, ticket);
+    }
+    if (status == FSIMG_IO_ERROR) {
+        return false;
+    }
+    if (status != FSIMG_OK && !discard_full(fd, size)) {
+        return false;
+    }
+    return send_status(fd, status);
+}
+
+/**
+ * Serves the requests of one client until it closes the connection.
+ * 
+ * @param arg The server_connection, freed here.
+ * 
+ * A request is an operation byte, a big-endian 16-bit path length and the path. A PUT adds a big-endian
+ * 32-bit size and the data, a GET_RANGE a big-endian 64-bit offset and length. LIST, STAT, GET and GET_RANGE
+ * share the image lock, PUT holds it alone while it changes the metadata (see server_put).
+ */
+void *server_connection_main(void *arg){
+    server_connection *conn = (server_connection *)arg;
+    server_state *server = conn->server;
+    int fd = conn->fd;
+    free(conn);
+
+    char path[SERVER_MAX_PATH + 1];
+    uint8_t header[3];
+    bool open = true;
+    while (open && read_full(fd, header, sizeof(header))) {
+        uint16_t path_length = (uint16_t)((header[1] << 8) | header[2]);
+        if (path_length > SERVER_MAX_PATH || !read_full(fd, path, path_length)) {
+            send_status(fd, FSIMG_BAD_REQUEST);
+            break;
+        }
+        path[path_length] = '\0';
+        uint32_t size;
+        uint64_t range[2];
+        switch (header[0]) {
+            case SERVER_LIST:
+                pthread_rwlock_rdlock(&server->lock);
+                open = server_list(server->img, fd, path);
+                pthread_rwlock_unlock(&server->lock);
+                break;
+            case SERVER_STAT:
+                pthread_rwlock_rdlock(&server->lock);
+                open = server_stat(server->img, fd, path);
+                pthread_rwlock_unlock(&server->lock);
+                break;
+            case SERVER_GET:
+                pthread_rwlock_rdlock(&server->lock);
+                open = server_get(server->img, fd, path, 0, UINT64_MAX);
+                pthread_rwlock_unlock(&server->lock);
+                break;
+            case SERVER_GET_RANGE:
+                if (!read_full(fd, range, sizeof(range))) {
+                    open = false;
+                    break;
+                }
+                pthread_rwlock_rdlock(&server->lock);
+                open = server_get(server->img, fd, path, be64toh(range[0]), be64toh(range[1]));
+                pthread_rwlock_unlock(&server->lock);
+                break;
+            case SERVER_PUT:
+                if (!read_full(fd, &size, sizeof(size))) {
+                    open = false;
+                    break;
+                }
+                open = server_put(server, fd, path, ntohl(size));
+                break;
+            default:
+                send_status(fd, FSIMG_BAD_REQUEST);
+                open = false;
+                break;
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+/**
+ * Serves a file system image on a Unix socket until the process is killed.
+ * 
+ * @param img The file system image, opened for writing.
+ * @param socket_path The path of the socket, replaced if it already exists.
+ * 
+ * The image is opened once, so its FAT, free-space index and directory path cache stay in memory across requests.
+ * Every connection gets its own thread. Reads run side by side, writes wait for them and run one at a time, but only
+ * while they change the metadata, not while they receive their data. A connection that sends nothing for
+ * SERVER_TIMEOUT_SECONDS in the middle of a request, or between two, is closed.
+ * The metadata of every put is written back before its reply, so killing the server never loses an acknowledged file.
+ * With a journal (--durable) the puts of concurrent clients are also synced to disk before their replies, sharing
+ * group commits, so that not even a crash of the machine loses them.
+ */
+void diskserver(fs_image *img, char *socket_path){
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path %s is too long\n", socket_path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, socket_path);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        fprintf(stderr, "Error: Unable to create socket\n");
+        exit(1);
+    }
+    unlink(socket_path);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "Error: Unable to listen on %s\n", socket_path);
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    server_state server;
+    memset(&server, 0, sizeof(server));
+    server.img = img;
+    server.durable = img->journal_fd >= 0;
+    pthread_mutex_init(&server.commit_lock, NULL);
+    pthread_cond_init(&server.committed_cond, NULL);
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    // Readers never hold the lock long, but a steady stream of them must not starve a put
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&server.lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    pthread_attr_t thread_attr;
+    pthread_attr_init(&thread_attr);
+    pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+    printf("Serving %s on %s\n", img->path, socket_path);
+    fflush(stdout);
+    while (true) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            fprintf(stderr, "Error: Unable to accept connection\n");
+            exit(1);
+        }
+        struct timeval timeout = { .tv_sec = SERVER_TIMEOUT_SECONDS, .tv_usec = 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        server_connection *conn = (server_connection *)emalloc(sizeof(server_connection));
+        conn->server = &server;
+        conn->fd = fd;
+        pthread_t thread;
+        if (pthread_create(&thread, &thread_attr, server_connection_main, conn) != 0) {
+            close(fd);
+            free(conn);
+        }
+    }
+}
+
+/**
+ * Connects to a disk server.
+ * 
+ * @param socket_path The path of the server socket.
+ * @return int The connected socket, exits the program on error.
+ */
+int client_connect(char *socket_path){
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Error: Unable to connect to %s\n", socket_path);
+        exit(1);
+    }
+    return fd;
+}
+
+/**
+ * Sends the operation byte and the path that start every request.
+ */
+void client_request(int fd, uint8_t op, const char *path){
+    size_t path_length = strlen(path);
+    if (path_length > SERVER_MAX_PATH) {
+        fprintf(stderr, "Error: Path %s is too long\n", path);
+        exit(1);
+    }
+    uint8_t header[3 + SERVER_MAX_PATH];
+    header[0] = op;
+    header[1] = (uint8_t)(path_length >> 8);
+    header[2] = (uint8_t)path_length;
+    memcpy(header + 3, path, path_length);
+    if (!write_full(fd, header, 3 + path_length)) {
+        fprintf(stderr, "Error: Connection to server lost\n");
+        exit(1);
+    }
+}
+
+/**
+ * Reads exactly len bytes of a reply, exits the program if the server went away.
+ */
+void client_read(int fd, void *buf, size_t len){
+    if (!read_full(fd, buf, len)) {
+        fprintf(stderr, "Error: Connection to server lost\n");
+        exit(1);
+    }
+}
+
+/**
+ * Reads the status byte of a reply and exits the program with the matching message if it is not FSIMG_OK.
+ * 
+ * @param fd The connection.
+ * @param not_found The message printed for FSIMG_NOT_FOUND.
+ */
+void client_status(int fd, const char *not_found){
+    uint8_t status;
+    client_read(fd, &status, 1);
+    switch (status) {
+        case FSIMG_OK:
+            return;
+        case FSIMG_NOT_FOUND:
+            printf("%s\n", not_found);
+            break;
+        case FSIMG_NO_SPACE:
+            fprintf(stderr, "Error: No free blocks available.\n");
+            break;
+        case FSIMG_DIR_FULL:
+            printf("No free space in directory.\n");
+            break;
+        case FSIMG_BAD_REQUEST:
+            fprintf(stderr, "Error: Request rejected by server\n");
+            break;
+        default:
+            fprintf(stderr, "Error: Server failed with status %u\n", status);
+            break;
+    }
+    exit(1);
+}
+
+/**
+ * Lists a directory of the served image, in the format of disklist.
+ */
+void client_list(int fd, const char *dir_path){
+    client_request(fd, SERVER_LIST, dir_path);
+    client_status(fd, "Directory not found.");
+    uint32_t count;
+    client_read(fd, &count, sizeof(count));
+    count = ntohl(count);
+    for (uint32_t i = 0; i < count; i++) {
+        dir_entry_t entry;
+        client_read(fd, &entry, sizeof(entry));
+        decode_dir_entry(&entry);
+        print_dir_entry(&entry);
+    }
+}
+
+/**
+ * Prints the directory entry of a file or directory of the served image.
+ */
+void client_stat(int fd, const char *path){
+    client_request(fd, SERVER_STAT, path);
+    client_status(fd, "File not found.");
+    dir_entry_t entry;
+    client_read(fd, &entry, sizeof(entry));
+    decode_dir_entry(&entry);
+    print_dir_entry(&entry);
+    printf("Start block: %u\n", entry.start_block);
+    printf("Block count: %u\n", entry.block_count);
+    printf("Modified: %4u/%02u/%02u %02u:%02u:%02u\n", entry.modify_time.year, entry.modify_time.month, entry.modify_time.day, entry.modify_time.hour, entry.modify_time.minute, entry.modify_time.second);
+}
+
+/**
+ * Copies a file of the served image, or a byte range of it, to the local file system.
+ * 
+ * The whole file is asked for with GET, a range with GET_RANGE. A range past the end of the file gives an empty file.
+ */
+void client_get(int fd, const char *path, const char *dest_file_path, uint64_t offset, uint64_t length){
+    if (offset == 0 && length == UINT64_MAX) {
+        client_request(fd, SERVER_GET, path);
+    }else{
+        client_request(fd, SERVER_GET_RANGE, path);
+        uint64_t range[2] = {htobe64(offset), htobe64(length)};
+        if (!write_full(fd, range, sizeof(range))) {
+            fprintf(stderr, "Error: Connection to server lost\n");
+            exit(1);
+        }
+    }
+    client_status(fd, "File not found.");
+    uint32_t size;
+    client_read(fd, &size, sizeof(size));
+    size = ntohl(size);
+    int dest_fd = open(dest_file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (dest_fd < 0) {
+        fprintf(stderr, "Error: Unable to open file %s\n", dest_file_path);
+        exit(1);
+    }
+    size_t buffer_size = size < MAX_IO_SIZE ? (size > 0 ? size : 1) : MAX_IO_SIZE;
+    uint8_t *buffer = (uint8_t *)emalloc(buffer_size);
+    while (size > 0) {
+        size_t chunk = size < buffer_size ? size : buffer_size;
+        client_read(fd, buffer, chunk);
+        if (!write_full(dest_fd, buffer, chunk)) {
+            fprintf(stderr, "Error: Unable to write file %s\n", dest_file_path);
+            exit(1);
+        }
+        size -= chunk;
+    }
+    free(buffer);
+    close(dest_fd);
+}
+
+/**
+ * Copies a file from the local file system to the served image.
+ */
+void client_put(int fd, const char *src_file_path, const char *dest_file_path){
+    int src_fd = open(src_file_path, O_RDONLY);
+    struct stat src_stat;
+    if (src_fd < 0 || fstat(src_fd, &src_stat) != 0 || !S_ISREG(src_stat.st_mode)) {
+        printf("File not found.\n");
+        exit(1);
+    }
+    if (src_stat.st_size > UINT32_MAX) {
+        fprintf(stderr, "Error: File %s is too large\n", src_file_path);
+        exit(1);
+    }
+    client_request(fd, SERVER_PUT, dest_file_path);
+    uint32_t wire_size = htonl((uint32_t)src_stat.st_size);
+    bool sent = write_full(fd, &wire_size, sizeof(wire_size));
+    off_t offset = 0;
+    while (sent && offset < src_stat.st_size) {
+        size_t chunk = src_stat.st_size - offset < MAX_IO_SIZE ? src_stat.st_size - offset : MAX_IO_SIZE;
+        ssize_t n = sendfile(fd, src_fd, &offset, chunk);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        sent = n > 0;
+    }
+    if (!sent) {
+        fprintf(stderr, "Error: Unable to send file %s\n", src_file_path);
+        exit(1);
+    }
+    close(src_fd);
+    client_status(fd, "Directory not found.");
+}
+
+/**
+ * Returns the next number of a xorshift64 sequence.
+ */
+uint64_t next_random(uint64_t *state){
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+/**
+ * Parses a size such as 4096, 10M or 2G into bytes.
+ * 
+ * @return The size in bytes, or 0 if the size is not valid.
+ */
+uint64_t parse_size(const char *text){
+    char *end;
+    double value = strtod(text, &end);
+    uint64_t unit = 1;
+    if (*end == 'K' || *end == 'k') {
+        unit = 1ULL << 10;
+    }
+    else if (*end == 'M' || *end == 'm') {
+        unit = 1ULL << 20;
+    }
+    else if (*end == 'G' || *end == 'g') {
+        unit = 1ULL << 30;
+    }
+    else if (*end != '\0') {
+        return 0;
+    }
+    if (value <= 0) {
+        return 0;
+    }
+    return (uint64_t)(value * unit);
+}
+
+/**
+ * Fills a directory entry in on-disk byte order.
+ */
+void make_dir_entry(dir_entry_t *entry, uint8_t status, uint32_t start_block, uint32_t block_count, uint32_t size,
+                    const char *name){
+    memset(entry, 0, sizeof(dir_entry_t));
+    entry->status = status;
+    entry->start_block = htonl(start_block);
+    entry->block_count = htonl(block_count);
+    entry->size = htonl(size);
+    entry->create_time.year = htons(2024);
+    entry->create_time.month = 1;
+    entry->create_time.day = 1;
+    entry->modify_time = entry->create_time;
+    strncpy((char *)entry->filename, name, sizeof(entry->filename) - 1);
+}
+
+/**
+ * This function creates a file system image with generated directories and files.
+ * 
+ * @param filename The name of the image to create.
+ * @param opt The layout of the image.
+ * 
+ * Block 0 holds the super block and the FAT follows from block 1, both marked reserved.
+ * The root directory and fan_out^k subdirectories on every level k up to depth follow, each directory contiguous,
+ * and the rest of the image is data. Files named f<n> are spread round-robin over the directories until fill of the
+ * data blocks is used. Each block of a file follows the previous one, except with the probability fragmentation
+ * where it is taken at random from the free blocks.
+ * File data is written with a repeating pattern unless the image is sparse.
+ */
+void mkimage(char *filename, mkimage_options *opt){
+    uint32_t block_size = opt->block_size;
+    uint32_t block_count = opt->block_count;
+    uint32_t entries_per_block = block_size / sizeof(dir_entry_t);
+    uint32_t fat_block_count = (uint32_t)(((uint64_t)block_count * sizeof(uint32_t) + block_size - 1) / block_size);
+    uint64_t random_state = opt->seed != 0 ? opt->seed : 88172645463325252ULL;
+
+    // Directories, numbered breadth first; the children of directory d are d * fan_out + 1 .. d * fan_out + fan_out
+    uint64_t dir_count = 1;
+    uint64_t level = 1;
+    for (uint32_t d = 0; d < opt->depth && opt->fan_out > 0; d++) {
+        level *= opt->fan_out;
+        dir_count += level;
+    }
+    uint64_t reserved = 1 + (uint64_t)fat_block_count;
+    if (reserved + dir_count >= block_count) {
+        fprintf(stderr, "Error: Image too small for its FAT and directories\n");
+        exit(1);
+    }
+    uint64_t file_blocks_mean = ((uint64_t)opt->file_size + block_size - 1) / block_size;
+    if (file_blocks_mean == 0) {
+        file_blocks_mean = 1;
+    }
+    uint64_t data_estimate = block_count - reserved - dir_count;
+    uint64_t file_estimate = (uint64_t)(data_estimate * opt->fill) / file_blocks_mean + 1;
+    uint64_t files_per_dir = (file_estimate + dir_count - 1) / dir_count;
+    uint32_t dir_blocks = (uint32_t)((files_per_dir + opt->fan_out + entries_per_block - 1) / entries_per_block);
+    if (dir_blocks == 0) {
+        dir_blocks = 1;
+    }
+    uint64_t first_data_block = reserved + dir_count * dir_blocks;
+    if (first_data_block >= block_count) {
+        fprintf(stderr, "Error: Image too small for its FAT and directories\n");
+        exit(1);
+    }
+    uint64_t target_blocks = (uint64_t)((block_count - first_data_block) * opt->fill);
+
+    uint32_t *fat = (uint32_t *)calloc(block_count, sizeof(uint32_t));
+    uint8_t *dirs = (uint8_t *)calloc(dir_count * dir_blocks, block_size);
+    uint32_t *dir_used = (uint32_t *)calloc(dir_count, sizeof(uint32_t));
+    if (fat == NULL || dirs == NULL || dir_used == NULL) {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (uint64_t b = 0; b < reserved; b++) {
+        fat[b] = 1;
+    }
+    for (uint64_t d = 0; d < dir_count; d++) {
+        uint32_t start = (uint32_t)(reserved + d * dir_blocks);
+        for (uint32_t b = 0; b < dir_blocks; b++) {
+            fat[start + b] = b + 1 < dir_blocks ? start + b + 1 : 0xFFFFFFFF;
+        }
+    }
+    char name[24];
+    for (uint64_t d = 1; d < dir_count; d++) {
+        uint64_t parent = (d - 1) / opt->fan_out;
+        dir_entry_t *slot = (dir_entry_t *)(dirs + parent * dir_blocks * block_size) + dir_used[parent]++;
+        snprintf(name, sizeof(name), "d%llu", (unsigned long long)d);
+        make_dir_entry(slot, 5, (uint32_t)(reserved + d * dir_blocks), dir_blocks, dir_blocks * block_size, name);
     }
 
-    bool found_file = false;
-
-    FILE *file = fopen(filename, "rb");
-    if (file == NULL) {
-        fprintf(stderr, "Error: Unable to open file %s\n", filename);
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, (off_t)block_count * block_size) != 0) {
+        fprintf(stderr, "Error: Unable to create file %s\n", filename);
         exit(1);
     }
+    uint8_t *pattern = NULL;
+    size_t pattern_size = MAX_IO_SIZE - MAX_IO_SIZE % block_size;
+    if (!opt->sparse) {
+        pattern = (uint8_t *)emalloc(pattern_size);
+        for (size_t i = 0; i < pattern_size; i++) {
+            pattern[i] = (uint8_t)(i * 131 + 7);
+        }
+    }
 
-    fseek(file, sb.fat_start_block * sb.block_size, SEEK_SET);
-    uint32_t *fat = (uint32_t *)emalloc(sb.fat_block_count * sb.block_size);
-    fread(fat, sb.fat_block_count * sb.block_size, 1, file);
-
-    dir_entry_t *entry = (dir_entry_t*)emalloc(sizeof(dir_entry_t));
-    int count = 0;
-    while (count < blocks_count) {
-        fseek(file, current_block * sb.block_size, SEEK_SET);
-        for (int i = 0; i < sb.block_size / sizeof(dir_entry_t); i++) {
-            fread(entry, sizeof(dir_entry_t), 1, file);
-            if (entry->status == 3 && strcmp((char *)entry->filename, file_name) == 0) {
-                entry->start_block = htonl(entry->start_block);
-                entry->block_count = htonl(entry->block_count);
-                entry->size = htonl(entry->size);
-                entry->create_time.year = htons(entry->create_time.year);
-                entry->modify_time.year = htons(entry->modify_time.year);
-                found_file = true;
+    uint64_t used = 0;
+    uint64_t cursor = first_data_block;
+    uint64_t file_count = 0;
+    while (used < target_blocks) {
+        uint64_t dir = file_count % dir_count;
+        if (dir_used[dir] >= dir_blocks * entries_per_block) {
+            break;
+        }
+        uint64_t length = 1 + next_random(&random_state) % (2 * file_blocks_mean - 1);
+        if (length > target_blocks - used) {
+            length = target_blocks - used;
+        }
+        uint32_t first = 0;
+        uint32_t previous = 0;
+        uint32_t blocks = 0;
+        uint32_t run_start = 0;
+        uint32_t run_length = 0;
+        for (uint64_t k = 0; k < length; k++) {
+            uint32_t block = 0xFFFFFFFF;
+            if (opt->fragmentation > 0 && (next_random(&random_state) % 1000000) < opt->fragmentation * 1000000) {
+                for (int attempt = 0; attempt < 8 && block == 0xFFFFFFFF; attempt++) {
+                    uint64_t candidate = first_data_block + next_random(&random_state) % (block_count - first_data_block);
+                    if (fat[candidate] == 0) {
+                        block = (uint32_t)candidate;
+                    }
+                }
+            }
+            while (block == 0xFFFFFFFF && cursor < block_count) {
+                if (fat[cursor] == 0) {
+                    block = (uint32_t)cursor;
+                }
+                cursor++;
+            }
+            if (block == 0xFFFFFFFF) {
                 break;
             }
+            fat[block] = 0xFFFFFFFF;
+            if (k == 0) {
+                first = block;
+            }else{
+                fat[previous] = block;
+            }
+            previous = block;
+            blocks++;
+            used++;
+            if (pattern != NULL) {
+                if (run_length > 0 && run_start + run_length == block && (uint64_t)(run_length + 1) * block_size <= pattern_size) {
+                    run_length++;
+                }else{
+                    if (run_length > 0 && pwrite(fd, pattern, (size_t)run_length * block_size, (off_t)run_start * block_size) < 0) {
+                        fprintf(stderr, "Error: Unable to write file %s\n", filename);
+                        exit(1);
+                    }
+                    run_start = block;
+                    run_length = 1;
+                }
+            }
         }
-        count++;
-        if (found_file){
+        if (pattern != NULL && run_length > 0 &&
+            pwrite(fd, pattern, (size_t)run_length * block_size, (off_t)run_start * block_size) < 0) {
+            fprintf(stderr, "Error: Unable to write file %s\n", filename);
+            exit(1);
+        }
+        if (blocks == 0) {
             break;
         }
-        current_block = ntohl(fat[current_block]);
+        uint32_t size = blocks * block_size - (uint32_t)(next_random(&random_state) % block_size);
+        dir_entry_t *slot = (dir_entry_t *)(dirs + dir * dir_blocks * block_size) + dir_used[dir]++;
+        snprintf(name, sizeof(name), "f%llu", (unsigned long long)file_count);
+        make_dir_entry(slot, 3, first, blocks, size, name);
+        file_count++;
     }
 
-    if (!found_file){
-        return NULL;
+    super_block sb;
+    memset(&sb, 0, sizeof(sb));
+    memcpy(sb.fs_id, "CSC360FS", 8);
+    sb.block_size = htons(block_size);
+    sb.file_system_block_count = htonl(block_count);
+    sb.fat_start_block = htonl(1);
+    sb.fat_block_count = htonl(fat_block_count);
+    sb.root_dir_start_block = htonl((uint32_t)reserved);
+    sb.root_dir_block_count = htonl(dir_blocks);
+    for (uint32_t b = 0; b < block_count; b++) {
+        fat[b] = htonl(fat[b]);
     }
-    return entry;
+    if (pwrite(fd, &sb, sizeof(sb), 0) != sizeof(sb) ||
+        pwrite(fd, fat, (size_t)block_count * sizeof(uint32_t), block_size) != (ssize_t)((size_t)block_count * sizeof(uint32_t)) ||
+        pwrite(fd, dirs, dir_count * dir_blocks * block_size, (off_t)reserved * block_size) != (ssize_t)(dir_count * dir_blocks * block_size)) {
+        fprintf(stderr, "Error: Unable to write file %s\n", filename);
+        exit(1);
+    }
+    close(fd);
+    printf("%s: %u blocks of %u bytes, %llu directories, %llu files, %llu data blocks used\n", filename, block_count,
+           block_size, (unsigned long long)dir_count, (unsigned long long)file_count, (unsigned long long)used);
+    free(pattern);
+    free(fat);
+    free(dirs);
+    free(dir_used);
 }
 
 /**
- * This function displays information about a file system image.
- * 
- * @param filename The name of the file system image.
- *
- * It then prints the metadata found in superblock.
- * It also prints the FAT information.
+ * Sets a directory entry time, in on-disk byte order, to a host time.
  */
-void diskinfo(char *filename){
-    super_block sb = *get_superblock(filename);
-    
-    FILE *file = fopen(filename, "rb");
-    if (file == NULL) {
-        fprintf(stderr, "Error: Unable to open file %s\n", filename);
-        exit(1);
-    }
-    fseek(file, sb.fat_start_block * sb.block_size, SEEK_SET);
-
-    uint32_t *fat;
-
-    // Step 2: Allocate memory for the FAT
-    fat = (uint32_t *)emalloc(sb.fat_block_count * sb.block_size);
-
-    // Step 3: Read the FAT from the file
-    fread(fat, sb.fat_block_count * sb.block_size, 1, file);
-
-    uint32_t free_blocks = 0;
-    uint32_t reserved_blocks = 0;
-    uint32_t allocated_blocks = 0;
-
-    for (uint32_t i = 0; i < sb.file_system_block_count; i++) {
-        uint32_t entry = ntohl(fat[i]);
-        if (entry == 0) {
-            free_blocks++;
-        }
-        else if (entry == 1) {
-            reserved_blocks++;
-        }
-        else {
-            allocated_blocks++;
-        }
-    }
-
-    assert(free_blocks + reserved_blocks + allocated_blocks == sb.file_system_block_count);
-    printf("Super block information\n");
-    printf("Block size: %u\n", sb.block_size);
-    printf("Block Count: %u\n", sb.file_system_block_count);
-    printf("FAT starts: %u\n", sb.fat_start_block);
-    printf("FAT blocks: %u\n", sb.fat_block_count);
-    printf("Root directory starts: %u\n", sb.root_dir_start_block);
-    printf("Root directory blocks: %u\n", sb.root_dir_block_count);
+void encode_entry_time(struct dir_entry_timedate_t *t, time_t when){
+    struct tm local;
+    localtime_r(&when, &local);
+    t->year = htons(local.tm_year + 1900);
+    t->month = local.tm_mon + 1;
+    t->day = local.tm_mday;
+    t->hour = local.tm_hour;
+    t->minute = local.tm_min;
+    t->second = local.tm_sec;
+}
 
-    printf("\nFAT information\n");
-    printf("Free blocks: %u\n", free_blocks);
-    printf("Reserved blocks: %u\n", reserved_blocks);
-    printf("Allocated blocks: %u\n", allocated_blocks);  
-    
-    fclose(file);
-    free(fat);
+/**
+ * Orders source nodes by name.
+ */
+int compare_source_name(const void *a, const void *b){
+    return strcmp(((const source_node *)a)->name, ((const source_node *)b)->name);
 }
 
 /**
- * This function lists the contents of a directory in a file system image.
- * 
- * @param filename The name of the file system image.
- * @param subdir The path of the directory to list.
+ * Reads a host directory tree into a list of nodes, with one pass over every directory.
  * 
- * If a directory path is provided, it finds the directory in the file system image.
- * If no directory path is provided, it lists the contents of the root directory.
- * The function then reads the directory entries and prints information about each entry, including its type (file or directory), size, name, and creation time.
+ * @param root The path of the top directory on the host.
+ * @param tree The tree to fill, zeroed by the caller.
  * 
- * The function does not return a value.
+ * Directories are read breadth first and the children of each are sorted by name, so the same tree always gives
+ * the same image. Symbolic links, special files and names longer than 30 characters cannot be stored in an image
+ * and are skipped with a warning.
+ * Prints an error message and exits the program if a directory cannot be read or a file is 4 GB or more.
  */
-void disklist(char *filename, char *subdir){
-    super_block sb = *get_superblock(filename);
-    uint32_t current_block;
-    uint32_t blocks_count;
-    FILE *file = fopen(filename, "rb");
-    if (file == NULL) {
-        fprintf(stderr, "Error: Unable to open file %s\n", filename);
+void scan_source_tree(const char *root, source_tree *tree){
+    struct stat st;
+    if (stat(root, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        printf("Directory not found.\n");
         exit(1);
     }
-    if (strncmp(subdir, "./", 2) == 0) {
-        subdir += 2;
-    }else if (strncmp(subdir, "/", 1) == 0){
-        subdir += 1;
+    tree->capacity = 1024;
+    tree->nodes = (source_node *)emalloc(tree->capacity * sizeof(source_node));
+    source_node *top = &tree->nodes[0];
+    memset(top, 0, sizeof(source_node));
+    top->path = strdup(root);
+    if (top->path == NULL) {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        exit(EXIT_FAILURE);
     }
-    if (strlen(subdir) > 0){
-        dir_entry_t *start_dir;
-        start_dir = find_directory(filename, subdir);
-        if (start_dir == NULL){
-            printf("Directory not found.\n");
+    top->status = 5;
+    top->mtime = st.st_mtime;
+    tree->count = 1;
+    tree->directories = 1;
+
+    for (uint32_t d = 0; d < tree->count; d++) {
+        if (tree->nodes[d].status != 5) {
+            continue;
+        }
+        DIR *dir = opendir(tree->nodes[d].path);
+        if (dir == NULL) {
+            fprintf(stderr, "Error: Unable to read directory %s\n", tree->nodes[d].path);
             exit(1);
         }
-        current_block = start_dir->start_block;
-        blocks_count = start_dir->block_count;
-    }else{
-        current_block = sb.root_dir_start_block;
-        blocks_count = sb.root_dir_block_count;
-    }
-
-    fseek(file, sb.fat_start_block * sb.block_size, SEEK_SET);
-    uint32_t *fat = (uint32_t *)emalloc(sb.fat_block_count * sb.block_size);
-    fread(fat, sb.fat_block_count * sb.block_size, 1, file);
-
-    fseek(file, current_block * sb.block_size, SEEK_SET);
-    int count = 0;
-    while (count < blocks_count) {
-        dir_entry_t *entries = (dir_entry_t *)emalloc(sb.block_size);
-        
-        for (int i = 0; i < sb.block_size / sizeof(dir_entry_t); i++) {
-            fread(&entries[i], sizeof(dir_entry_t), 1, file);
-            entries[i].start_block = htonl(entries[i].start_block);
-            entries[i].block_count = htonl(entries[i].block_count);
-            entries[i].size = htonl(entries[i].size);
-            entries[i].create_time.year = htons(entries[i].create_time.year);
-            entries[i].modify_time.year = htons(entries[i].modify_time.year);
-            
-
-            if (entries[i].status != 0) {
-                if (entries[i].status == 5) {
-                    printf("D ");
-                }
-                else {
-                    printf("F ");
+        tree->nodes[d].first_child = tree->count;
+        size_t path_length = strlen(tree->nodes[d].path);
+        struct dirent *de;
+        while ((de = readdir(dir)) != NULL) {
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+                continue;
+            }
+            size_t name_length = strlen(de->d_name);
+            char *path = (char *)emalloc(path_length + name_length + 2);
+            sprintf(path, "%s/%s", tree->nodes[d].path, de->d_name);
+            if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+                !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))) {
+                fprintf(stderr, "Warning: Skipping %s, not a regular file or directory\n", path);
+                free(path);
+                continue;
+            }
+            if (name_length >= sizeof(tree->nodes[0].name)) {
+                fprintf(stderr, "Warning: Skipping %s, the name is longer than %zu characters\n", path,
+                        sizeof(tree->nodes[0].name) - 1);
+                free(path);
+                continue;
+            }
+            if (S_ISREG(st.st_mode) && st.st_size > UINT32_MAX) {
+                fprintf(stderr, "Error: File %s is too large\n", path);
+                exit(1);
+            }
+            if (tree->count == tree->capacity) {
+                tree->capacity *= 2;
+                source_node *grown = (source_node *)realloc(tree->nodes, tree->capacity * sizeof(source_node));
+                if (grown == NULL) {
+                    fprintf(stderr, "Error: Unable to allocate memory\n");
+                    exit(EXIT_FAILURE);
                 }
-                printf("%10u ", entries[i].size);
-                printf("%30s ", entries[i].filename);
-                printf("%4u/%02u/%02u %02u:%02u:%02u", entries[i].create_time.year, entries[i].create_time.month, entries[i].create_time.day, entries[i].create_time.hour, entries[i].create_time.minute, entries[i].create_time.second);
-                printf("\n");
+                tree->nodes = grown;
+            }
+            source_node *node = &tree->nodes[tree->count++];
+            memset(node, 0, sizeof(source_node));
+            node->path = path;
+            node->parent = d;
+            node->status = S_ISDIR(st.st_mode) ? 5 : 3;
+            node->size = S_ISREG(st.st_mode) ? (uint32_t)st.st_size : 0;
+            node->mtime = st.st_mtime;
+            memcpy(node->name, de->d_name, name_length + 1);
+            if (node->status == 5) {
+                tree->directories++;
+            }else{
+                tree->files++;
             }
         }
-
-        free(entries);
-        current_block = ntohl(fat[current_block]);
-        count++;
+        closedir(dir);
+        tree->nodes[d].child_count = tree->count - tree->nodes[d].first_child;
+        qsort(&tree->nodes[tree->nodes[d].first_child], tree->nodes[d].child_count, sizeof(source_node),
+              compare_source_name);
     }
-
-    fclose(file);
 }
 
 /**
- * This function copies a file from a file system image to the local file system.
+ * Places every directory and file of a source tree, each as one contiguous run of blocks.
  * 
- * @param filename The name of the file system image.
- * @param file_path The path of the file to copy in the file system image.
- * @param dest_file_path The path of the destination file in the local file system.
+ * @param tree The scanned tree.
+ * @param block_size The block size of the image.
+ * @param first_block The first block after the super block and the FAT.
  * 
- * The function first finds the file in the file system image.
- * If the file is not found, it prints an error message and exits the program.
- * It then opens the file system image and the destination file.
- * Then reads the file data block by block and writes it to the destination file.
+ * Blocks are handed out in the order the image is written: every directory in breadth-first order, immediately
+ * followed by the data of its files.
  * 
- * The function does not return a value.
+ * @return The block after the last one used.
  */
-void diskget(char *filename, char *file_path, char *dest_file_path){
-    dir_entry_t *file = find_file(filename, file_path);
-    if (file == NULL){
-        printf("File not found.\n");
-        exit(1);
-    }
-    super_block sb = *get_superblock(filename);
-
-    FILE *src_file = fopen(filename, "rb");
-    if (src_file == NULL) {
-        fprintf(stderr, "Error: Unable to open file %s\n", filename);
-        exit(1);
+uint64_t plan_source_layout(source_tree *tree, uint32_t block_size, uint64_t first_block){
+    uint32_t entries_per_block = block_size / sizeof(dir_entry_t);
+    uint64_t cursor = first_block;
+    for (uint32_t d = 0; d < tree->count; d++) {
+        source_node *dir = &tree->nodes[d];
+        if (dir->status != 5) {
+            continue;
+        }
+        dir->block_count = dir->child_count == 0 ? 1 : (dir->child_count + entries_per_block - 1) / entries_per_block;
+        dir->size = dir->block_count * block_size;
+        dir->start_block = (uint32_t)cursor;
+        cursor += dir->block_count;
+        for (uint32_t c = dir->first_child; c < dir->first_child + dir->child_count; c++) {
+            source_node *file = &tree->nodes[c];
+            if (file->status != 3) {
+                continue;
+            }
+            file->block_count = fsck_file_blocks(file->size, block_size);
+            file->start_block = (uint32_t)cursor;
+            cursor += file->block_count;
+        }
     }
+    return cursor;
+}
 
-    FILE *dest_file = fopen(dest_file_path, "wb");
-
-
-    fseek(src_file, sb.fat_start_block * sb.block_size, SEEK_SET);
-    uint32_t *fat = (uint32_t *)emalloc(sb.fat_block_count * sb.block_size);
-    fread(fat, sb.fat_block_count * sb.block_size, 1, src_file);
-
-    uint8_t *buffer = (uint8_t *)emalloc(sb.block_size);
-    uint32_t current_block = file->start_block;
-    
-    while (current_block != 0xFFFFFFFF) {
-        fseek(src_file, current_block * sb.block_size, SEEK_SET);
-        fread(buffer, sb.block_size, 1, src_file);
-        fwrite(buffer, sb.block_size, 1, dest_file);
-        current_block = ntohl(fat[current_block]);
+/**
+ * Appends count zeroed blocks to the image being written.
+ */
+void stream_zero_blocks(out_buffer *out, uint64_t count, uint32_t block_size){
+    uint64_t bytes = count * block_size;
+    while (bytes > 0) {
+        size_t chunk = bytes < out->capacity ? bytes : out->capacity;
+        memset(out_reserve(out, chunk), 0, chunk);
+        out->length += chunk;
+        bytes -= chunk;
     }
-
-    fclose(src_file);
-    fclose(dest_file);
-    free(buffer);
-    free(fat);
 }
 
 /**
- * This function finds a free block in the FAT (File Allocation Table) and marks it as used.
- * 
- * @param fat A pointer to the FAT.
- * @param fat_size The size of the FAT.
+ * Appends the blocks of a host file to the image being written, reading the file straight into the output buffer.
  * 
- * The function iterates over the FAT. If it finds a block that is free (i.e., its value is 0), it marks the block as used (i.e., sets its value to 1) and returns the index of the block.
- * If no free block is found, it prints an error message and exits the program.
+ * @param out The output buffer of the image.
+ * @param file The node of the file.
+ * @param block_size The block size of the image.
  * 
- * @return The index of the free block found, or exits the program if no free block is found.
+ * Exactly the size found by the scan is copied, followed by zeros up to the end of the last block. A file that
+ * shrank since the scan is padded with zeros and a warning is printed.
  */
-uint32_t get_free_block(uint32_t *fat, uint32_t fat_size) {
-    for (uint32_t i = 0; i < fat_size; i++) {
-        if (ntohl(fat[i]) == 0) {
-            fat[i] = htonl(1);  // Mark the block as used
-            return i;
+void stream_source_file(out_buffer *out, source_node *file, uint32_t block_size){
+    uint64_t remaining = file->size;
+    if (remaining > 0) {
+        int fd = open(file->path, O_RDONLY);
+        stats_syscall(NULL, 0);
+        if (fd < 0) {
+            fprintf(stderr, "Error: Unable to read file %s\n", file->path);
+            exit(1);
+        }
+        while (remaining > 0) {
+            if (out->length == out->capacity) {
+                out_flush(out);
+            }
+            size_t chunk = out->capacity - out->length;
+            if (chunk > remaining) {
+                chunk = remaining;
+            }
+            ssize_t n = read(fd, out->data + out->length, chunk);
+            stats_syscall(&stats.bytes_read, n);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                fprintf(stderr, "Error: Unable to read file %s\n", file->path);
+                exit(1);
+            }
+            if (n == 0) {
+                fprintf(stderr, "Warning: %s shrank while the image was written, padded with zeros\n", file->path);
+                break;
+            }
+            out->length += n;
+            remaining -= n;
         }
+        close(fd);
+    }
+    uint64_t padding = (uint64_t)file->block_count * block_size - (file->size - remaining);
+    while (padding > 0) {
+        size_t chunk = padding < out->capacity ? padding : out->capacity;
+        memset(out_reserve(out, chunk), 0, chunk);
+        out->length += chunk;
+        padding -= chunk;
     }
-    fprintf(stderr, "Error: No free blocks available.\n");
-    exit(1);
 }
 
 /**
- * This function copies a file from the local file system to a file system image.
+ * This function creates a file system image holding a copy of a host directory tree.
  * 
- * @param filename The name of the file system image.
- * @param src_file_path The path of the source file in the local file system.
- * @param dest_file_path The path of the destination file in the file system image.
+ * @param filename The name of the image to create.
+ * @param opt The block size, and the block count when sized is set.
+ * @param source_dir The directory to copy, which becomes the root directory of the image.
+ * @param sized Whether the block count was given. Otherwise the image is made just large enough.
  * 
- * The function then a free entry in the directory and writes the source_file metadata to it.
- * It reads the source file data block by block and writes it to the file system image.
- * It updates the FAT and the directory entry as it writes the file data.
+ * The tree is scanned once and the whole layout planned up front: block 0 holds the super block, the FAT follows,
+ * then every directory and file gets one contiguous run of blocks in the order they are written (see
+ * plan_source_layout), leaving the free blocks at the end. The image is then written from the first block to the
+ * last used one in a single pass of large sequential writes, with file data read straight into the output buffer,
+ * and the free tail is left as a hole.
+ * Entries take the modification times of the host files and directories.
  */
-void diskput(char *filename, char *src_file_path, char *dest_file_path){
-    FILE *src_file = fopen(src_file_path, "rb");
-    super_block sb = *get_superblock(filename);
-    if (strncmp(dest_file_path, "./", 2) == 0) {
-        dest_file_path += 2;
-    }
-    else if (strncmp(dest_file_path, "/", 1) == 0) {
-        dest_file_path += 1;
+void mkimage_from(char *filename, mkimage_options *opt, const char *source_dir, bool sized){
+    uint32_t block_size = opt->block_size;
+    uint64_t phase_start = stats_clock();
+    source_tree tree;
+    memset(&tree, 0, sizeof(tree));
+    scan_source_tree(source_dir, &tree);
+    stats_phase(PHASE_SCAN, phase_start);
+
+    uint64_t used = plan_source_layout(&tree, block_size, 0);
+    uint64_t fat_block_count = 1;
+    uint64_t block_count = opt->block_count;
+    if (sized) {
+        fat_block_count = (block_count * sizeof(uint32_t) + block_size - 1) / block_size;
+    }else{
+        // The FAT grows with the image it describes
+        while (true) {
+            block_count = 1 + fat_block_count + used;
+            uint64_t needed = (block_count * sizeof(uint32_t) + block_size - 1) / block_size;
+            if (needed <= fat_block_count) {
+                break;
+            }
+            fat_block_count = needed;
+        }
     }
-    if (src_file == NULL) {
-        printf("File not found.\n");
+    uint64_t reserved = 1 + fat_block_count;
+    if (reserved + used > block_count || block_count >= UINT32_MAX) {
+        fprintf(stderr, "Error: Image too small for the tree, %llu blocks needed\n",
+                (unsigned long long)(reserved + used));
         exit(1);
     }
+    used = plan_source_layout(&tree, block_size, reserved) - reserved;
 
-    uint32_t current_block;
-    uint32_t last_block;
-    char *dest_file_name;
-    char *dest_dir_path;
-    char *last_l = strrchr(dest_file_path, '/');
-    if (last_l != NULL){
-        dest_file_name = last_l + 1;
-        size_t dir_path_length = last_l - dest_file_path;
-        dest_dir_path = (char *)malloc(dir_path_length + 1);
-        strncpy(dest_dir_path, dest_file_path, dir_path_length);
-        dest_dir_path[dir_path_length] = '\0';
-        dir_entry_t *dir = find_directory(filename, dest_dir_path);
-        if (dir == NULL){
-            printf("Directory not found.\n");
-            exit(1);
+    uint8_t *fat_blocks = (uint8_t *)calloc(fat_block_count, block_size);
+    if (fat_blocks == NULL) {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t *fat = (uint32_t *)fat_blocks;
+    for (uint64_t b = 0; b < reserved; b++) {
+        fat[b] = htonl(1);
+    }
+    for (uint32_t n = 0; n < tree.count; n++) {
+        source_node *node = &tree.nodes[n];
+        uint32_t last = node->start_block + node->block_count - 1;
+        for (uint32_t b = node->start_block; b < last; b++) {
+            fat[b] = htonl(b + 1);
         }
-        current_block = dir->start_block;
-        last_block = dir->start_block + dir->block_count - 1;
-        free(dest_dir_path);
-    }else{
-        dest_file_name = dest_file_path;
-        current_block = sb.root_dir_start_block;
-        last_block = sb.root_dir_start_block + sb.root_dir_block_count - 1;
+        fat[last] = htonl(0xFFFFFFFF);
     }
 
-    FILE *dest_file = fopen(filename, "rb+");
-    if (dest_file == NULL) {
-        fprintf(stderr, "Error: Unable to open file %s\n", filename);
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Unable to create file %s\n", filename);
         exit(1);
     }
+    phase_start = stats_clock();
+    out_buffer out;
+    out_init(&out, fd);
+    out_reserve(&out, MAX_IO_SIZE - MAX_IO_SIZE % block_size);
 
-    fseek(dest_file, sb.fat_start_block * sb.block_size, SEEK_SET);
-    uint32_t *fat = (uint32_t *)emalloc(sb.fat_block_count * sb.block_size);
-    fread(fat, sb.fat_block_count * sb.block_size, 1, dest_file);
+    super_block *sb = (super_block *)out_reserve(&out, block_size);
+    memset(sb, 0, block_size);
+    memcpy(sb->fs_id, "CSC360FS", 8);
+    sb->block_size = htons(block_size);
+    sb->file_system_block_count = htonl((uint32_t)block_count);
+    sb->fat_start_block = htonl(1);
+    sb->fat_block_count = htonl((uint32_t)fat_block_count);
+    sb->root_dir_start_block = htonl(tree.nodes[0].start_block);
+    sb->root_dir_block_count = htonl(tree.nodes[0].block_count);
+    out.length += block_size;
+    out_bytes(&out, (const char *)fat_blocks, fat_block_count * block_size);
+    free(fat_blocks);
 
-    dir_entry_t *entry = (dir_entry_t*)emalloc(sizeof(dir_entry_t));
-    bool found_free_entry = false;
-    uint32_t entry_address;
-    while (current_block <= last_block) {
-        fseek(dest_file, current_block * sb.block_size, SEEK_SET);
-        for (int i = 0; i < sb.block_size / sizeof(dir_entry_t); i++) {
-            fread(entry, sizeof(dir_entry_t), 1, dest_file);
-            if (entry->status == 0) {
-                entry->status = 3;
-                strncpy((char *)entry->filename, dest_file_name, sizeof(entry->filename));
-                entry->start_block =  htonl(get_free_block(fat, sb.file_system_block_count));
-                entry->block_count = htonl(1);
-                entry->size = htonl(0);
-
-                time_t current_time = time(NULL);
-                struct tm *time_info = localtime(&current_time);
-                entry->create_time.year = htons(time_info->tm_year + 1900);
-                entry->create_time.month = time_info->tm_mon + 1;
-                entry->create_time.day = time_info->tm_mday;
-                entry->create_time.hour = time_info->tm_hour;
-                entry->create_time.minute = time_info->tm_min;
-                entry->create_time.second = time_info->tm_sec;
-                entry->modify_time = entry->create_time;
-
-                entry_address = ftell(dest_file) - sizeof(dir_entry_t);
-                fseek(dest_file, -sizeof(dir_entry_t), SEEK_CUR); // Move back to the start of the entry
-                fwrite(entry, sizeof(dir_entry_t), 1, dest_file);
-                found_free_entry = true;
-                break;
-            }
+    for (uint32_t d = 0; d < tree.count; d++) {
+        source_node *dir = &tree.nodes[d];
+        if (dir->status != 5) {
+            continue;
         }
-        if (found_free_entry){
-            break;
+        size_t dir_bytes = (size_t)dir->block_count * block_size;
+        dir_entry_t *entries = (dir_entry_t *)out_reserve(&out, dir_bytes);
+        memset(entries, 0, dir_bytes);
+        for (uint32_t c = 0; c < dir->child_count; c++) {
+            source_node *child = &tree.nodes[dir->first_child + c];
+            make_dir_entry(&entries[c], child->status, child->start_block, child->block_count, child->size, "");
+            memcpy(entries[c].filename, child->name, sizeof(child->name));
+            encode_entry_time(&entries[c].create_time, child->mtime);
+            entries[c].modify_time = entries[c].create_time;
+        }
+        out.length += dir_bytes;
+        for (uint32_t c = dir->first_child; c < dir->first_child + dir->child_count; c++) {
+            if (tree.nodes[c].status == 3) {
+                stream_source_file(&out, &tree.nodes[c], block_size);
+            }
         }
-        current_block++;
     }
-    if (found_free_entry == false){
-        printf("No free space in directory.\n");
+    out_end(&out);
+    stats_phase(PHASE_DATA_COPY, phase_start);
+    if (ftruncate(fd, (off_t)block_count * block_size) != 0 || close(fd) != 0) {
+        fprintf(stderr, "Error: Unable to write file %s\n", filename);
         exit(1);
     }
-    uint8_t *buffer = (uint8_t *)emalloc(sb.block_size);
-    uint32_t curr_block_index = ntohl(entry->start_block);
-    uint32_t previous_block = curr_block_index;
-
-    bool first_block = true;
-
-    size_t bytes;
-    while ((bytes = fread(buffer, 1, sb.block_size, src_file)) > 0) {
-        // Write data to the current block in the destination file
-        entry->size = htonl(ntohl(entry->size) + bytes);
-        entry->block_count = htonl(ntohl(entry->block_count) + bytes);
-        if (first_block) {
-            first_block = false;
-        }else{
-            curr_block_index = get_free_block(fat, sb.file_system_block_count);
-            fat[previous_block] = htonl(curr_block_index);
-        }
-        
-        fseek(dest_file, curr_block_index * sb.block_size, SEEK_SET);
-        fwrite(buffer, 1, bytes, dest_file);
-        previous_block = curr_block_index;
+    printf("%s: %llu blocks of %u bytes, %u directories, %u files, %llu data blocks used\n", filename,
+           (unsigned long long)block_count, block_size, tree.directories, tree.files, (unsigned long long)used);
+    for (uint32_t n = 0; n < tree.count; n++) {
+        free(tree.nodes[n].path);
     }
-    fat[previous_block] = htonl(0xFFFFFFFF);
-
-    fseek(dest_file, sb.fat_start_block * sb.block_size, SEEK_SET);
-    fwrite(fat, sb.fat_block_count * sb.block_size, 1, dest_file);
-
-
-    fseek(dest_file, entry_address, SEEK_SET); // Move back to the start of the entry
-    fwrite(entry, sizeof(dir_entry_t), 1, dest_file);
-    fclose(src_file);
-    fclose(dest_file);
-    free(buffer);
-    free(fat);
+    free(tree.nodes);
 }
 
 #ifdef DISKINFO
 int main(int argc, char *argv[]) {
+    stats_option(&argc, argv);
     if (argc != 2){
         fprintf(stderr, "Usage: %s <filename>\n", argv[0]);
     }
-    diskinfo(argv[1]);
+    fs_image *img = open_image(argv[1], false);
+    diskinfo(img);
+    close_image(img);
+    return 0;
+}
+#endif
+
+#ifdef DISKFSCK
+int main(int argc, char *argv[]) {
+    stats_option(&argc, argv);
+    if (argc < 2 || argc > 3 || (argc == 3 && strcmp(argv[2], "-r") != 0)){
+        fprintf(stderr, "Usage: %s <filename> [-r]\n", argv[0]);
+        exit(1);
+    }
+    fs_image *img = open_image(argv[1], argc == 3);
+    bool consistent = diskfsck(img, argc == 3);
+    close_image(img);
+    return consistent ? 0 : 1;
+}
+#endif
+
+#ifdef DISKDEFRAG
+int main(int argc, char *argv[]) {
+    stats_option(&argc, argv);
+    if (argc < 2 || argc > 3 || (argc == 3 && strcmp(argv[2], "-n") != 0)){
+        fprintf(stderr, "Usage: %s <filename> [-n]\n", argv[0]);
+        exit(1);
+    }
+    fs_image *img = open_image(argv[1], argc == 2);
+    diskdefrag(img, argc == 3);
+    close_image(img);
     return 0;
 }
 #endif
 
 #ifdef DISKLIST
 int main(int argc, char *argv[]) {
-    if (argc < 2 || argc > 3){
-        fprintf(stderr, "Usage: %s <filename> [<dest_dir>]\n", argv[0]);
+    stats_option(&argc, argv);
+    int format = LIST_HUMAN;
+    int sort = LIST_UNSORTED;
+    char *subdir = "./";
+    bool valid = argc >= 2;
+    bool have_dir = false;
+    bool recursive = false;
+    bool du = false;
+    for (int i = 2; valid && i < argc; i++) {
+        if (strcmp(argv[i], "-R") == 0) {
+            recursive = true;
+        }else if (strcmp(argv[i], "--du") == 0) {
+            du = true;
+        }else if (strcmp(argv[i], "--json") == 0) {
+            format = LIST_JSON;
+        }else if (strcmp(argv[i], "-0") == 0) {
+            format = LIST_NUL;
+        }else if (strcmp(argv[i], "--sort") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "name") == 0) {
+                sort = LIST_BY_NAME;
+            }else if (strcmp(argv[i], "size") == 0) {
+                sort = LIST_BY_SIZE;
+            }else if (strcmp(argv[i], "mtime") == 0) {
+                sort = LIST_BY_MTIME;
+            }else{
+                valid = false;
+            }
+        }else if (!have_dir) {
+            subdir = argv[i];
+            have_dir = true;
+        }else{
+            valid = false;
+        }
+    }
+    if (!valid){
+        fprintf(stderr, "Usage: %s <filename> [-R | --du] [--json | -0] [--sort name|size|mtime] [<dest_dir>]\n", argv[0]);
         exit(1);
     }
-    disklist(argv[1], argc == 3 ? argv[2] : "./");
+    fs_image *img = open_image(argv[1], false);
+    if (recursive || du) {
+        disklist_tree(img, subdir, format, sort, du);
+    }else{
+        disklist(img, subdir, format, sort);
+    }
+    close_image(img);
     return 0;
 }
 #endif
 
 #ifdef DISKGET
 int main(int argc, char *argv[]) {
-    if (argc < 3 || argc > 4){
-        fprintf(stderr, "Usage: %s <filename> <src_file> [<dst_file>]\n", argv[0]);
+    stats_option(&argc, argv);
+    uint64_t offset;
+    uint64_t length;
+    bool range = range_option(&argc, argv, &offset, &length);
+    if (!range && argc >= 4 && argc <= 5 && strcmp(argv[2], "-r") == 0){
+        fs_image *img = open_image(argv[1], false);
+        diskget_tree(img, argv[3], argc == 5 ? argv[4] : ".");
+        close_image(img);
+        return 0;
+    }
+    if (argc < 3 || argc > 4 || strcmp(argv[2], "-r") == 0){
+        fprintf(stderr, "Usage: %s <filename> <src_file> [<dst_file>] [--offset <bytes>] [--length <bytes>]\n", argv[0]);
+        fprintf(stderr, "       %s <filename> -r <src_dir> [<dst_dir>]\n", argv[0]);
         exit(1);
     }
+    fs_image *img = open_image(argv[1], false);
     char *dest_file_name;
     if (argc == 3){
         char *last_l = strrchr(argv[2], '/');
@@ -614,20 +8007,99 @@ int main(int argc, char *argv[]) {
         }else{
             dest_file_name = argv[2];
         }
-        diskget(argv[1], argv[2], dest_file_name);
+        diskget(img, argv[2], dest_file_name, offset, length);
+    }else{
+        diskget(img, argv[2], argv[3], offset, length);
+    }
+    close_image(img);
+    return 0;
+}
+#endif
+
+#ifdef DISKSERVER
+int main(int argc, char *argv[]) {
+    bool durable = durable_option(&argc, argv);
+    if (argc != 3){
+        fprintf(stderr, "Usage: %s <filename> <socket> [--durable]\n", argv[0]);
+        exit(1);
+    }
+    fs_image *img = open_image(argv[1], true);
+    if (durable) {
+        open_journal(img);
+    }
+    diskserver(img, argv[2]);
+    close_image(img);
+    return 0;
+}
+#endif
+
+#ifdef DISKCLIENT
+int main(int argc, char *argv[]) {
+    uint64_t offset;
+    uint64_t length;
+    bool range = range_option(&argc, argv, &offset, &length);
+    bool valid = argc >= 3 && (!range || strcmp(argv[2], "get") == 0) &&
+        ((strcmp(argv[2], "list") == 0 && argc <= 4) ||
+         (strcmp(argv[2], "stat") == 0 && argc == 4) ||
+         ((strcmp(argv[2], "get") == 0 || strcmp(argv[2], "put") == 0) && (argc == 4 || argc == 5)));
+    if (!valid){
+        fprintf(stderr, "Usage: %s <socket> list [<dir>]\n", argv[0]);
+        fprintf(stderr, "       %s <socket> stat <path>\n", argv[0]);
+        fprintf(stderr, "       %s <socket> get <src_file> [<dst_file>] [--offset <bytes>] [--length <bytes>]\n", argv[0]);
+        fprintf(stderr, "       %s <socket> put <src_file> [<dst_file>]\n", argv[0]);
+        exit(1);
+    }
+    int fd = client_connect(argv[1]);
+    char *last_l = argc == 4 ? strrchr(argv[3], '/') : NULL;
+    char *default_name = last_l != NULL ? last_l + 1 : argv[argc - 1];
+    if (strcmp(argv[2], "list") == 0){
+        client_list(fd, argc == 4 ? argv[3] : "");
+    }else if (strcmp(argv[2], "stat") == 0){
+        client_stat(fd, argv[3]);
+    }else if (strcmp(argv[2], "get") == 0){
+        client_get(fd, argv[3], argc == 5 ? argv[4] : default_name, offset, length);
     }else{
-        diskget(argv[1], argv[2], argv[3]);
+        client_put(fd, argv[3], argc == 5 ? argv[4] : default_name);
     }
+    close(fd);
     return 0;
 }
 #endif
 
 #ifdef DISKPUT
 int main(int argc, char *argv[]) {
-    if (argc < 3 || argc > 4){
-        fprintf(stderr, "Usage: %s <filename> <src_file> [<dst_file>]\n", argv[0]);
+    stats_option(&argc, argv);
+    bool durable = durable_option(&argc, argv);
+    if (argc == 3 && strcmp(argv[2], "--batch") == 0){
+        fs_image *img = open_image(argv[1], true);
+        if (durable) {
+            open_journal(img);
+        }
+        uint32_t request_count;
+        put_request *requests = read_manifest(stdin, &request_count);
+        diskput_batch(img, requests, request_count);
+        for (uint32_t r = 0; r < request_count; r++) {
+            free(requests[r].src_path);
+            free(requests[r].dest_path);
+        }
+        free(requests);
+        close_image(img);
+        return 0;
+    }
+    if (argc < 3 || (argc > 4 && argc % 2 != 0)){
+        fprintf(stderr, "Usage: %s <filename> <src_file> [<dst_file>] [--durable]\n", argv[0]);
+        fprintf(stderr, "       %s <filename> <src_file> <dst_file> <src_file> <dst_file> ... [--durable]\n", argv[0]);
+        fprintf(stderr, "       %s <filename> --batch [--durable] < manifest\n", argv[0]);
+        exit(1);
+    }
+    if (argc == 3 && strcmp(argv[2], "-") == 0){
+        fprintf(stderr, "Error: A destination is needed to put standard input\n");
         exit(1);
     }
+    fs_image *img = open_image(argv[1], true);
+    if (durable) {
+        open_journal(img);
+    }
     char *dest_file_name;
     if (argc == 3){
         char *last_l = strrchr(argv[2], '/');
@@ -636,10 +8108,86 @@ int main(int argc, char *argv[]) {
         }else{
             dest_file_name = argv[2];
         }
-        diskput(argv[1], argv[2], dest_file_name);
+        diskput(img, argv[2], dest_file_name);
+    }else{
+        uint32_t request_count = (argc - 2) / 2;
+        put_request *requests = (put_request *)emalloc(request_count * sizeof(put_request));
+        for (uint32_t r = 0; r < request_count; r++) {
+            requests[r].src_path = argv[2 + 2 * r];
+            requests[r].dest_path = argv[3 + 2 * r];
+        }
+        diskput_batch(img, requests, request_count);
+        free(requests);
+    }
+    close_image(img);
+    return 0;
+}
+#endif
+
+#ifdef MKIMAGE
+int main(int argc, char *argv[]) {
+    stats_option(&argc, argv);
+    mkimage_options opt = {512, 6400, 0.0, 0.0, 0, 0, 65536, false, 0};
+    uint64_t image_size = 0;
+    bool sized = false;
+    char *source_dir = NULL;
+    int arg = 1;
+    char *filename = NULL;
+    for (; arg < argc; arg++) {
+        if (strcmp(argv[arg], "--from") == 0 && arg + 1 < argc) {
+            source_dir = argv[++arg];
+            continue;
+        }
+        if (argv[arg][0] != '-' || argv[arg][1] == '\0') {
+            if (filename != NULL) {
+                filename = NULL;
+                break;
+            }
+            filename = argv[arg];
+            continue;
+        }
+        if (strcmp(argv[arg], "-p") == 0) {
+            opt.sparse = true;
+            continue;
+        }
+        if (arg + 1 >= argc) {
+            filename = NULL;
+            break;
+        }
+        char *value = argv[++arg];
+        sized = sized || argv[arg - 1][1] == 'n' || argv[arg - 1][1] == 's';
+        switch (argv[arg - 1][1]) {
+            case 'b': opt.block_size = (uint16_t)atoi(value); break;
+            case 'n': opt.block_count = (uint32_t)strtoul(value, NULL, 10); break;
+            case 's': image_size = parse_size(value); break;
+            case 'f': opt.fill = atof(value); break;
+            case 'F': opt.fragmentation = atof(value); break;
+            case 'd': opt.fan_out = (uint32_t)atoi(value); break;
+            case 'D': opt.depth = (uint32_t)atoi(value); break;
+            case 'a': opt.file_size = (uint32_t)parse_size(value); break;
+            case 'S': opt.seed = strtoull(value, NULL, 10); break;
+            default: filename = NULL; arg = argc; break;
+        }
+    }
+    if (opt.fan_out > 0 && opt.depth == 0) {
+        opt.depth = 1;
+    }
+    if (image_size > 0 && opt.block_size > 0) {
+        uint64_t blocks = image_size / opt.block_size;
+        opt.block_count = blocks > UINT32_MAX - 1 ? UINT32_MAX - 1 : (uint32_t)blocks;
+    }
+    if (filename == NULL || opt.block_size < sizeof(dir_entry_t) || opt.block_size % sizeof(dir_entry_t) != 0 ||
+        opt.block_count == 0 || opt.fill < 0 || opt.fill > 1 || opt.fragmentation < 0 || opt.fragmentation > 1){
+        fprintf(stderr, "Usage: %s <filename> [-b <block_size>] [-n <block_count> | -s <size>] [-f <fill>] [-F <fragmentation>]\n"
+                        "       [-d <fan_out>] [-D <depth>] [-a <avg_file_size>] [-S <seed>] [-p]\n"
+                        "       %s <filename> --from <dir> [-b <block_size>] [-n <block_count> | -s <size>]\n", argv[0], argv[0]);
+        exit(1);
+    }
+    if (source_dir != NULL) {
+        mkimage_from(filename, &opt, source_dir, sized);
     }else{
-        diskput(argv[1], argv[2], argv[3]);
+        mkimage(filename, &opt);
     }
     return 0;
 }
-#endif
\ No newline at end of file
+#endif